@@ -39,10 +39,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <assert.h>
 
 #include "dag.h"
+#include "dagmeta.h"
+#include "dagprof.h"
 #include "mdag.h"
 #include "mine.h"
 #include "keccak.h"
@@ -51,8 +54,10 @@
 
 
 static bool verbose = 0;
+static bool profile = 0;
 static bool quiet = 0;
 static bool stable = 0;
+static bool verify = 0;
 
 
 /* ----- Get the DAG ------------------------------------------------------- */
@@ -99,8 +104,32 @@ static const void *generate_dag(const char *path,
 	if (verbose && !stable)
 		t_print("DAG");
 
-	if (path && strcmp(path, "-"))
-		mdag_write(path, dag, *full_lines);
+	if (path && strcmp(path, "-")) {
+		char *meta_path = dagmeta_path(path);
+		struct dagmeta *m;
+		int err;
+
+		dagmeta_remove(meta_path);
+		err = mdag_write(path, dag, *full_lines);
+		if (err < 0) {
+			errno = -err;
+			perror(path);
+			exit(1);
+		}
+
+		/*
+		 * dagmeta_match checks the DAG size, but not the cache size. A
+		 * DAG made from another cache is not this epoch's DAG, so we
+		 * don't describe it as one.
+		 */
+		if (!cache_override) {
+			m = dagmeta_new(dag_algo, epoch, *full_lines, seed, 0);
+			dagmeta_sum(m, dag, *full_lines, 0);
+			dagmeta_write(m, meta_path);
+			dagmeta_free(m);
+		}
+		free(meta_path);
+	}
 
 	free(cache);
 
@@ -108,6 +137,48 @@ static const void *generate_dag(const char *path,
 }
 
 
+static void bad_chunk(void *user, uint32_t dag_line, uint32_t lines)
+{
+	fprintf(stderr, "%s: bad checksum for lines %u-%u\n",
+	    (const char *) user, dag_line, dag_line + lines - 1);
+}
+
+
+static void check_meta(const char *path, const void *dag, unsigned full_lines,
+    unsigned epoch)
+{
+	char *meta_path = dagmeta_path(path);
+	struct dagmeta *m;
+
+	m = dagmeta_read(meta_path);
+	if (!m) {
+		if (verify) {
+			perror(meta_path);
+			exit(1);
+		}
+		free(meta_path);
+		return;
+	}
+	if (!dagmeta_match(m, dag_algo, epoch, full_lines)) {
+		fprintf(stderr,
+		    "%s: DAG is for %s epoch %u, %u lines, not %s epoch %u, "
+		    "%u lines\n", meta_path,
+		    dagalgo_name(m->hdr.algo), m->hdr.epoch, m->hdr.full_lines,
+		    dagalgo_name(dag_algo), epoch, full_lines);
+		exit(1);
+	}
+	if (verify) {
+		t_start();
+		if (dagmeta_verify_mem(m, dag, 0, bad_chunk, (void *) path))
+			exit(1);
+		if (verbose && !stable)
+			t_print("Verify");
+	}
+	dagmeta_free(m);
+	free(meta_path);
+}
+
+
 static const void *get_dag(const char *path,
     unsigned cache_size, unsigned *full_lines, unsigned epoch)
 {
@@ -131,6 +202,7 @@ static const void *get_dag(const char *path,
 			    (unsigned long long) got * DAG_LINE_BYTES, path);
 			exit(1);
 		}
+		check_meta(path, dag, *full_lines, epoch);
 		if (verbose && !stable)
 			printf("Loaded %llu bytes DAG%s\n",
 			    (unsigned long long) *full_lines * DAG_LINE_BYTES,
@@ -157,7 +229,11 @@ static void try_before(const uint8_t *header_hash, uint64_t nonce)
 }
 
 
-static void try_after(const uint8_t *cmix, const uint8_t *result,
+/*
+ * Returns 0 if the result is above the target.
+ */
+
+static bool try_after(const uint8_t *cmix, const uint8_t *result,
     unsigned long long difficulty)
 {
 	if (verbose)
@@ -175,17 +251,17 @@ static void try_after(const uint8_t *cmix, const uint8_t *result,
 		get_target(target, diff);
 		if (verbose)
 			dump_blob("Target", target, TARGET_BYTES);
-		if (below_target(result, target)) {
-			printf("Below target\n");
-		} else {
+		if (!below_target(result, target)) {
 			fprintf(stderr, "Above target\n");
-			exit(1);
+			return 0;
 		}
+		printf("Below target\n");
 	}
+	return 1;
 }
 
 
-static void try(const uint8_t *dag, unsigned full_lines,
+static bool try(const uint8_t *dag, unsigned full_lines,
     const uint8_t *header_hash, uint64_t nonce, unsigned long long difficulty)
 {
 	uint8_t cmix[CMIX_BYTES];
@@ -193,11 +269,11 @@ static void try(const uint8_t *dag, unsigned full_lines,
 
 	try_before(header_hash, nonce);
 	hashimoto(cmix, result, header_hash, nonce, dag, full_lines);
-	try_after(cmix, result, difficulty);
+	return try_after(cmix, result, difficulty);
 }
 
 
-static void try_light(unsigned epoch, unsigned cache_bytes, unsigned full_lines,
+static bool try_light(unsigned epoch, unsigned cache_bytes, unsigned full_lines,
     const uint8_t *header_hash, uint64_t nonce, unsigned long long difficulty)
 {
 	uint8_t *cache;
@@ -217,7 +293,7 @@ static void try_light(unsigned epoch, unsigned cache_bytes, unsigned full_lines,
 	try_before(header_hash, nonce);
 	hashimoto_light(cmix, result, header_hash, nonce, cache, cache_bytes,
 	    full_lines);
-	try_after(cmix, result, difficulty);
+	return try_after(cmix, result, difficulty);
 }
 
 
@@ -228,7 +304,7 @@ static void usage(const char *name)
 {
 	fprintf(stderr,
 "usage: %s [dag-file|-] [-c cache_lines] [-d difficulty|-t target_bits]\n"
-"       %*s[-f dag_lines] [-q] [-s] [-v [-v [-l]]]\n"
+"       %*s[-f dag_lines] [-P] [-q] [-s] [-V] [-v [-v [-l]]]\n"
 "       %*sepoch header_hash nonce\n"
 	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "");
 	exit(1);
@@ -241,6 +317,8 @@ int main(int argc, char **argv)
 	const uint8_t *dag = NULL;
 	unsigned cache_size = 0, full_lines = 0;
 	uint8_t header_hash[HEADER_HASH_BYTES];
+	bool trace = 0, linear = 0;
+	bool ok;
 	unsigned epoch = 0;
 	unsigned long long nonce = 0x42;
 	unsigned long long difficulty = 0;
@@ -248,7 +326,7 @@ int main(int argc, char **argv)
 	char *end;
 	int c;
 
-	while ((c = getopt(argc, argv, "c:d:f:lqst:v")) != EOF)
+	while ((c = getopt(argc, argv, "c:d:f:lPqst:Vv")) != EOF)
 		switch (c) {
 		case 'c':
 			cache_size =
@@ -267,7 +345,11 @@ int main(int argc, char **argv)
 				usage(*argv);
 			break;
 		case 'l':
-			mine_trace_linear = 1;
+			linear = 1;
+			break;
+		case 'P':
+			profile = 1;
+			dagprof_enable(1, 1);
 			break;
 		case 'q':
 			quiet = 1;
@@ -280,15 +362,21 @@ int main(int argc, char **argv)
 			if (*end)
 				usage(*argv);
 			break;
+		case 'V':
+			verify = 1;
+			break;
 		case 'v':
 			if (verbose)
-				mine_trace = stdout;
+				trace = 1;
 			verbose = 1;
 			break;
 		default:
 			usage(*argv);
 		}
 
+	if (trace)
+		mine_trace_set(mine_trace_text_new(stdout, linear));
+
 	switch (argc - optind) {
 	case 4:
 		dag_arg = argv[optind];
@@ -312,10 +400,14 @@ int main(int argc, char **argv)
 
 	(void) target_bits; /* @@@ for later */
 	if (dag)
-		try(dag, full_lines, header_hash, nonce, difficulty);
+		ok = try(dag, full_lines, header_hash, nonce, difficulty);
 	else
-		try_light(epoch, cache_size, full_lines, header_hash, nonce,
-		    difficulty);
+		ok = try_light(epoch, cache_size, full_lines, header_hash,
+		    nonce, difficulty);
+
+	/* also when above target: those are the runs worth profiling */
+	if (profile)
+		dagprof_json(stderr);
 
-	return 0;
+	return !ok;
 }
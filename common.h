@@ -38,6 +38,12 @@ static inline uint32_t read32(const uint8_t *p)
 }
 
 
+static inline uint64_t read64(const uint8_t *p)
+{
+	return *(const uint64_t *) p;
+}
+
+
 static inline void write32(uint8_t *p, uint32_t v)
 {
 	*(uint32_t *) p = v;
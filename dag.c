@@ -13,12 +13,17 @@
 #include <unistd.h> /* for intptr_t */
 #include <math.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "keccak.h"
 #include "blake2.h"
 #include "common.h"
 #include "dagalgo.h"
 #include "dag.h"
+#include "dagprof.h"
+#include "dagcount.h"
 
 
 struct algo_ops {
@@ -98,11 +103,11 @@ unsigned get_full_lines(int epoch)
 /* ----- Seedhash ---------------------------------------------------------- */
 
 
-void get_seedhash(uint8_t *seed, unsigned epoch)
+void get_seedhash_algo(uint8_t *seed, enum dag_algo algo, unsigned epoch)
 {
 	unsigned rounds, i;
 
-	switch (dag_algo) {
+	switch (algo) {
 	case da_ethash:
 	case da_ubqhash:
 		rounds = epoch;
@@ -114,9 +119,17 @@ void get_seedhash(uint8_t *seed, unsigned epoch)
 		abort();
 	}
 
+	dagprof_begin(dp_seedhash);
 	memset(seed, 0, SEED_BYTES);
 	for (i = 0; i != rounds; i++)
 		KEC_256(seed, seed, SEED_BYTES);
+	dagprof_end(dp_seedhash);
+}
+
+
+void get_seedhash(uint8_t *seed, unsigned epoch)
+{
+	get_seedhash_algo(seed, dag_algo, epoch);
 }
 
 
@@ -132,9 +145,11 @@ static void mkcache_init_ethash(uint8_t *cache, unsigned cache_bytes,
 	assert(n);
 
 	/* squentially produce the initial dataset */
+	dagprof_begin(dp_mkcache_init);
 	KEC_512(cache, seed, 32); 
 	for (p = cache; p != cache + (n - 1) * HASH_BYTES; p += HASH_BYTES)
 		KEC_512(p + HASH_BYTES, p, HASH_BYTES);
+	dagprof_end(dp_mkcache_init);
 }
 
 
@@ -145,6 +160,7 @@ static void mkcache_round_ethash(uint8_t *cache, unsigned cache_bytes)
 	unsigned j, k;
 	uint8_t tmp[HASH_BYTES];
 
+	dagprof_begin(dp_mkcache_round);
 	for (j = 0; j != n; j++) {
 		p = cache + HASH_BYTES * j;
 
@@ -156,7 +172,7 @@ static void mkcache_round_ethash(uint8_t *cache, unsigned cache_bytes)
 			    cache[v * HASH_BYTES + k];
 		KEC_512(p, tmp, HASH_BYTES);
 	}
-
+	dagprof_end(dp_mkcache_round);
 }
 
 
@@ -165,11 +181,11 @@ static void mkcache_ethash(uint8_t *cache, unsigned cache_bytes,
 {
 	unsigned i;
 
-	mkcache_init(cache, cache_bytes, seed);
+	mkcache_init_ethash(cache, cache_bytes, seed);
 
 	/* use a low-round version of randmemohash */
 	for (i = 0; i != CACHE_ROUNDS; i++)
-		mkcache_round(cache, cache_bytes);
+		mkcache_round_ethash(cache, cache_bytes);
 }
 
 
@@ -185,9 +201,11 @@ static void mkcache_init_ubqhash(uint8_t *cache, unsigned cache_bytes,
 	assert(n);
 
 	/* squentially produce the initial dataset */
+	dagprof_begin(dp_mkcache_init);
 	BLAKE2B_512(cache, seed, 32);
 	for (p = cache; p != cache + (n - 1) * HASH_BYTES; p += HASH_BYTES)
 		BLAKE2B_512(p + HASH_BYTES, p, HASH_BYTES);
+	dagprof_end(dp_mkcache_init);
 }
 
 
@@ -198,6 +216,7 @@ static void mkcache_round_ubqhash(uint8_t *cache, unsigned cache_bytes)
 	unsigned j, k;
 	uint8_t tmp[HASH_BYTES];
 
+	dagprof_begin(dp_mkcache_round);
 	for (j = 0; j != n; j++) {
 		p = cache + HASH_BYTES * j;
 
@@ -209,6 +228,7 @@ static void mkcache_round_ubqhash(uint8_t *cache, unsigned cache_bytes)
 			    cache[v * HASH_BYTES + k];
 		BLAKE2B_512(p, tmp, HASH_BYTES);
 	}
+	dagprof_end(dp_mkcache_round);
 }
 
 
@@ -264,9 +284,63 @@ void calc_dataset_range(uint8_t *dag, unsigned start, unsigned lines,
 {
 	unsigned i;
 
+	dagprof_begin(dp_dataset);
 	for (i = 0; i != 2 * lines; i++)
 		calc_dataset_item(dag + (intptr_t) i * HASH_BYTES,
 		    cache, cache_bytes, 2 * start + i);
+	dagprof_end(dp_dataset);
+	dagcount(ls_dataset_items, 2 * lines);
+}
+
+
+/*
+ * Store one item with non-temporal stores. "dst" must be 16-byte aligned.
+ */
+
+static inline void stream_item(uint8_t *dst, const uint8_t *mix)
+{
+#if defined(__SSE2__)
+	unsigned k;
+
+	for (k = 0; k != HASH_BYTES; k += 16)
+		_mm_stream_si128((__m128i *) (dst + k),
+		    _mm_loadu_si128((const __m128i *) (mix + k)));
+#elif defined(__aarch64__)
+	unsigned k;
+
+	for (k = 0; k != HASH_BYTES; k += 16)
+		asm volatile("stnp %x1, %x2, [%0]"
+		    :: "r" (dst + k), "r" (read64(mix + k)),
+		    "r" (read64(mix + k + 8))
+		    : "memory");
+#else
+	memcpy(dst, mix, HASH_BYTES);
+#endif
+}
+
+
+void calc_dataset_range_nt(uint8_t *dag, unsigned start, unsigned lines,
+    const uint8_t *cache, unsigned cache_bytes)
+{
+	uint8_t mix[HASH_BYTES] __attribute__((aligned(16)));
+	unsigned i;
+
+	if ((uintptr_t) dag & 15) {
+		calc_dataset_range(dag, start, lines, cache, cache_bytes);
+		return;
+	}
+	dagprof_begin(dp_dataset);
+	for (i = 0; i != 2 * lines; i++) {
+		calc_dataset_item(mix, cache, cache_bytes, 2 * start + i);
+		stream_item(dag + (intptr_t) i * HASH_BYTES, mix);
+	}
+#if defined(__SSE2__)
+	_mm_sfence();
+#elif defined(__aarch64__)
+	asm volatile("dmb ishst" ::: "memory");
+#endif
+	dagprof_end(dp_dataset);
+	dagcount(ls_dataset_items, 2 * lines);
 }
 
 
@@ -318,3 +392,10 @@ void mkcache(uint8_t *cache, unsigned cache_bytes, const uint8_t *seed)
 {
 	algo_ops[dag_algo].mkcache(cache, cache_bytes, seed);
 }
+
+
+void mkcache_algo(enum dag_algo algo, uint8_t *cache, unsigned cache_bytes,
+    const uint8_t *seed)
+{
+	algo_ops[algo].mkcache(cache, cache_bytes, seed);
+}
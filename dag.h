@@ -43,8 +43,27 @@ void mkcache_init(uint8_t *cache, unsigned cache_bytes, const uint8_t *seed);
 void mkcache_round(uint8_t *cache, unsigned cache_bytes);
 void mkcache(uint8_t *cache, unsigned cache_bytes, const uint8_t *seed);
 
+/*
+ * Variants that don't depend on the global "dag_algo", e.g., for preparing
+ * the next epoch while still hashing with the current one.
+ */
+void get_seedhash_algo(uint8_t *seed, enum dag_algo algo, unsigned epoch);
+void mkcache_algo(enum dag_algo algo, uint8_t *cache, unsigned cache_bytes,
+    const uint8_t *seed);
+
 void calc_dataset_range(uint8_t *dag, unsigned start, unsigned lines,
     const uint8_t *cache, unsigned cache_bytes);
+
+/*
+ * Same result as calc_dataset_range, but the DAG is written with
+ * non-temporal stores, so that it doesn't evict the light cache from the
+ * CPU caches. Use this when generating into memory that isn't read again
+ * soon. "dag" should be 16-byte aligned, else this falls back to normal
+ * stores.
+ */
+void calc_dataset_range_nt(uint8_t *dag, unsigned start, unsigned lines,
+    const uint8_t *cache, unsigned cache_bytes);
+
 void calc_dataset(uint8_t *dag, unsigned full_lines,
     const uint8_t *cache, unsigned cache_bytes);
 
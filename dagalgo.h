@@ -32,6 +32,7 @@ enum dag_algo {
 
 
 extern unsigned etchash_epoch;
+extern unsigned ubqhash_epoch;
 
 
 const char *dagalgo_name(enum dag_algo algo);
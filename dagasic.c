@@ -0,0 +1,85 @@
+/*
+ * dagasic.c - Convert DAG lines to and from the ASIC word layout
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dag.h"
+#include "dagasic.h"
+
+
+/*
+ * We use GCC's generic vectors, which become SSE2 on x86-64 and NEON on
+ * ARM. A line is eight vectors of four words. Canonical vectors 6 - 2q and
+ * 7 - 2q hold words 24 - 8q to 31 - 8q, and these are exactly the words of
+ * ASIC vectors q (odd words) and 4 + q (even words). Below, "v" holds the
+ * canonical vectors of a line, "w" the ASIC vectors.
+ */
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+#define	VECS	(DAG_LINE_BYTES / sizeof(v4u32))
+
+
+static inline v4u32 bswap(v4u32 x)
+{
+	x = x << 16 | x >> 16;
+	return (x & 0x00ff00ff) << 8 | (x >> 8 & 0x00ff00ff);
+}
+
+
+void dagasic_to_asic(void *dst, const void *src, uint32_t lines)
+{
+	const v4u32 even = { 6, 4, 2, 0 };
+	const v4u32 odd = { 7, 5, 3, 1 };
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	v4u32 v[VECS], w[VECS], a, b;
+	uint32_t i;
+	unsigned q;
+
+	for (i = 0; i != lines; i++) {
+		memcpy(v, s, DAG_LINE_BYTES);
+		for (q = 0; q != VECS / 2; q++) {
+			a = v[6 - 2 * q];
+			b = v[7 - 2 * q];
+			w[q] = bswap(__builtin_shuffle(a, b, odd));
+			w[4 + q] = bswap(__builtin_shuffle(a, b, even));
+		}
+		memcpy(d, w, DAG_LINE_BYTES);
+		s += DAG_LINE_BYTES;
+		d += DAG_LINE_BYTES;
+	}
+}
+
+
+void dagasic_from_asic(void *dst, const void *src, uint32_t lines)
+{
+	const v4u32 lo = { 3, 7, 2, 6 };
+	const v4u32 hi = { 1, 5, 0, 4 };
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	v4u32 v[VECS], w[VECS], e, o;
+	uint32_t i;
+	unsigned q;
+
+	for (i = 0; i != lines; i++) {
+		memcpy(w, s, DAG_LINE_BYTES);
+		for (q = 0; q != VECS / 2; q++) {
+			o = bswap(w[q]);
+			e = bswap(w[4 + q]);
+			v[6 - 2 * q] = __builtin_shuffle(e, o, lo);
+			v[7 - 2 * q] = __builtin_shuffle(e, o, hi);
+		}
+		memcpy(d, v, DAG_LINE_BYTES);
+		s += DAG_LINE_BYTES;
+		d += DAG_LINE_BYTES;
+	}
+}
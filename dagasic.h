@@ -0,0 +1,36 @@
+/*
+ * dagasic.h - Convert DAG lines to and from the ASIC word layout
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGASIC_H
+#define	LIBDAG_DAGASIC_H
+
+/*
+ * The ASIC organizes each 128 byte DAG line as follows:
+ * - the last word comes first, the first word comes last,
+ * - we interleave even and odd 32-bit words,
+ * - instead of little-endian, words are big-endian,
+ *
+ * w[31] w[29] w[27] ... w[1] w[30] w[28] ... w[0]
+ *
+ * This is the order in which the text trace (mine_trace_text_new) prints
+ * lines.
+ *
+ * The conversions work on whole lines, and "dst" can be the same as "src",
+ * so they can run in place on each batch on its way from generation to
+ * dagio_writer_write, or from dagio_pread to the consumer. Neither buffer
+ * needs to be aligned.
+ */
+
+#include <stdint.h>
+
+
+void dagasic_to_asic(void *dst, const void *src, uint32_t lines);
+void dagasic_from_asic(void *dst, const void *src, uint32_t lines);
+
+#endif /* !LIBDAG_DAGASIC_H */
@@ -0,0 +1,121 @@
+/*
+ * dagcapture.c - Record the DAG accesses of many nonces
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (one million nonces, packed, on all CPUs):
+ * ./dagcapture -d -t $(nproc) dag400 \
+ *   0x892a2e92b8a050dff196e1a19efcb2a903655584913e719435c0ad2b53cfa7bd \
+ *   0 1000000 trace400
+ *
+ * Then, e.g.,
+ * ./dagreplay trace400
+ * ./membench -r trace400
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dag.h"
+#include "mdag.h"
+#include "mine.h"
+#include "dagtrace.h"
+
+#include "util.h"
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-d] [-m] [-t threads] dag_file header_hash nonce count\n"
+"       %*strace_file\n\n"
+"  -d  packed lines and nonce differences (DAGTRACE_DELTA)\n"
+"  -m  also record the mix after each round (8 kB per nonce)\n"
+"  -t threads\n"
+"      number of capture threads (default: 1)\n"
+	    , name, (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned flags = 0;
+	unsigned threads = 1;
+	uint8_t header_hash[HEADER_HASH_BYTES];
+	unsigned long long nonce, count;
+	struct dagtrace_writer *w;
+	const char *path;
+	struct mdag *m;
+	struct stat st;
+	double t;
+	char *end;
+	int c, err;
+
+	while ((c = getopt(argc, argv, "dmt:")) != EOF)
+		switch (c) {
+		case 'd':
+			flags |= DAGTRACE_DELTA;
+			break;
+		case 'm':
+			flags |= DAGTRACE_MIX;
+			break;
+		case 't':
+			threads = strtoul(optarg, &end, 0);
+			if (*end || !threads)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc - optind != 5)
+		usage(*argv);
+
+	err = mdag_map(&m, argv[optind], MDAG_POPULATE | MDAG_RANDOM);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		exit(1);
+	}
+	hex_decode_big_endian(header_hash, argv[optind + 1], HEADER_HASH_BYTES);
+	nonce = strtoull(argv[optind + 2], &end, 16);
+	if (*end)
+		usage(*argv);
+	count = strtoull(argv[optind + 3], &end, 0);
+	if (*end)
+		usage(*argv);
+	path = argv[optind + 4];
+
+	w = dagtrace_create(path, flags, mdag_lines(m), header_hash);
+	t = now();
+	dagtrace_capture(w, mdag_addr(m), nonce, count, threads);
+	t = now() - t;
+	dagtrace_writer_close(w);
+	mdag_unmap(m);
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	printf("%llu nonces in %.3f s (%.0f nonces/s), %.1f MB\n", count, t,
+	    count / t, st.st_size * 1e-6);
+	return 0;
+}
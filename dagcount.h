@@ -0,0 +1,56 @@
+/*
+ * dagcount.h - Counting into the runtime statistics (internal)
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGCOUNT_H
+#define	LIBDAG_DAGCOUNT_H
+
+#include <stdint.h>
+
+#include "dagstats.h"
+
+
+#ifdef NO_STATS
+
+#define	dagcount(stat, n)	do { (void) (n); } while (0)
+
+#else /* NO_STATS */
+
+#define	DAGCOUNT_LINE_BYTES	64
+
+
+struct dagcount_slot {
+	uint64_t	count[libdag_stat_kinds];
+	struct dagcount_slot *next;
+} __attribute__((aligned(DAGCOUNT_LINE_BYTES)));
+
+
+extern __thread struct dagcount_slot *dagcount_slot;
+
+struct dagcount_slot *dagcount_register(void);
+
+
+/*
+ * Only the owning thread writes to its slot, so we don't need an atomic
+ * read-modify-write. The store is atomic so that snapshots never see a torn
+ * value.
+ */
+
+static inline void dagcount(enum libdag_stat stat, uint64_t n)
+{
+	struct dagcount_slot *s = dagcount_slot;
+
+	if (__builtin_expect(!s, 0))
+		s = dagcount_register();
+	__atomic_store_n(&s->count[stat], s->count[stat] + n,
+	    __ATOMIC_RELAXED);
+}
+
+#endif /* !NO_STATS */
+
+#endif /* !LIBDAG_DAGCOUNT_H */
@@ -0,0 +1,146 @@
+/*
+ * dagfetch.c - Fetch a DAG from a DAG server into dagio files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example:
+ * ./dagfetch -c 4 dagserver 8546 100 /tmp/dag
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagio.h"
+#include "dagmeta.h"
+#include "dagnet.h"
+
+
+static uint32_t stripe_lines = 0;
+static enum dagio_backend backend = dbe_file;
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-a algo] [-B backend] [-b stripe_kB] [-c connections]\n"
+"       %*s[-f dag_lines] [-M] [-q] host port epoch dag-file ...\n\n"
+"  -a algo\n"
+"      DAG algorithm (ethash, etchash, ubqhash; default: ethash)\n"
+"  -B backend\n"
+"      storage backend (file, mmap, uring; default: file)\n"
+"  -b stripe_kB\n"
+"      stripe the DAG over the dag-files, in stripes of this size\n"
+"  -c connections\n"
+"      number of parallel connections (default: 4)\n"
+"  -f dag_lines\n"
+"      override the DAG size\n"
+"  -M  don't write the metadata sidecar (dag-file.meta)\n"
+"  -q  quiet operation\n"
+	    , name, (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct dag_handle *h;
+	struct dagmeta *m;
+	struct dagnet_fetch_result res;
+	struct timespec t0, t1;
+	unsigned connections = 4;
+	unsigned full_lines = 0;
+	unsigned epoch;
+	bool meta = 1;
+	bool quiet = 0;
+	char *meta_path;
+	char *end;
+	int c, code;
+
+	while ((c = getopt(argc, argv, "a:B:b:c:f:Mq")) != EOF)
+		switch (c) {
+		case 'a':
+			code = dagalgo_code(optarg);
+			if (code < 0)
+				usage(*argv);
+			dag_algo = code;
+			break;
+		case 'B':
+			code = dagio_backend_code(optarg);
+			if (code < 0)
+				usage(*argv);
+			backend = code;
+			break;
+		case 'b':
+			stripe_lines = (strtoul(optarg, &end, 0) << 10) /
+			    DAG_LINE_BYTES;
+			if (*end || !stripe_lines)
+				usage(*argv);
+			break;
+		case 'c':
+			connections = strtoul(optarg, &end, 0);
+			if (*end || !connections)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'M':
+			meta = 0;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind < 4)
+		usage(*argv);
+	if (!stripe_lines && argc - optind != 4)
+		usage(*argv);
+	epoch = strtoul(argv[optind + 2], &end, 0);
+	if (*end)
+		usage(*argv);
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+
+	meta_path = dagmeta_path(argv[optind + 3]);
+	dagmeta_remove(meta_path);
+	h = dagio_open_backend(backend, (const char *const *) argv + optind + 3,
+	    argc - optind - 3, O_WRONLY | O_CREAT | O_TRUNC, full_lines,
+	    stripe_lines);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	m = dagnet_fetch(argv[optind], argv[optind + 1], dag_algo, epoch, h,
+	    connections, &res);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	dagio_close(h);
+
+	if (meta)
+		dagmeta_write(m, meta_path);
+	free(meta_path);
+	dagmeta_free(m);
+
+	if (!quiet)
+		printf("%s epoch %u: %u chunks, %u fetched, %u computed, "
+		    "%.3f s\n", dagalgo_name(dag_algo), epoch, res.chunks,
+		    res.fetched, res.computed,
+		    t1.tv_sec - t0.tv_sec + 1e-9 * (t1.tv_nsec - t0.tv_nsec));
+	return 0;
+}
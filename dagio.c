@@ -7,7 +7,7 @@
  * A copy of the license can be found in the file COPYING.txt
  */
 
-#define _GNU_SOURCE	/* for asprintf */
+#define _GNU_SOURCE	/* for asprintf, O_DIRECT, RWF_DSYNC */
 #define _FILE_OFFSET_BITS 64
 
 #include <stddef.h>
@@ -15,17 +15,26 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 
 #include "linzhi/alloc.h"
 
 #include "dag.h"
 #include "dagio.h"
+#include "dagiobe.h"
+#include "dagprof.h"
+#include "dagcount.h"
 
 
 /* --- old API ------------------------------------------------------------- */
@@ -37,6 +46,7 @@ void pread_dag_line(int dag_fd, uint32_t dag_line, void *buf)
 
 	got = pread(dag_fd, buf, DAG_LINE_BYTES,
 	    (off_t) dag_line * DAG_LINE_BYTES);
+	dagcount(ls_preads, 1);
 	if (got < 0) {
 		perror("pread");
 		exit(1);
@@ -52,33 +62,125 @@ void pread_dag_line(int dag_fd, uint32_t dag_line, void *buf)
 /* --- new API ------------------------------------------------------------- */
 
 
-#define	DAG_FDS		2
+/*
+ * The DAG is spread over one or more files. Stripe s (of stripe_lines lines)
+ * goes to file s % files, where it is stripe s / files. The classic layout,
+ * with name, name-1, ... each holding up to MAX_DAG_FILE_BYTES, is the case
+ * where there are just enough files for each to hold one stripe of
+ * LINES_PER_FILE lines.
+ */
+
 #define	LINES_PER_FILE	(MAX_DAG_FILE_BYTES / DAG_LINE_BYTES)
 
+/* use one thread per file for requests that touch several, and are large */
+#define	PARALLEL_BYTES	(1 << 20)
+
+#define	STACK_SEGMENTS	4
+#define	STACK_FILES	16
+
+/* Linux transfers at most 0x7ffff000 bytes per read or write */
+#define	MAX_IO_BYTES	(1 << 30)
+#define	SEGMENT_LINES	(MAX_IO_BYTES / DAG_LINE_BYTES)
 
-struct dag_handle {
-	char		*name[DAG_FDS];
-	int		fd[DAG_FDS];
-	uint32_t	full_lines;
+
+static const struct dagio_ops *backends[] = {
+	[dbe_file]	= &dagio_file_ops,
+	[dbe_mmap]	= &dagio_mmap_ops,
+	[dbe_mem]	= &dagio_mem_ops,
+	[dbe_uring]	= &dagio_uring_ops,
 };
 
 
+/* ----- Layout ------------------------------------------------------------ */
+
+
+unsigned dagio_locate(const struct dag_handle *h, uint32_t dag_line,
+    uint64_t *pos)
+{
+	uint32_t stripe = dag_line / h->stripe_lines;
+
+	*pos = ((uint64_t) (stripe / h->files) * h->stripe_lines +
+	    dag_line % h->stripe_lines) * DAG_LINE_BYTES;
+	return stripe % h->files;
+}
+
+
+uint32_t dagio_stripe_left(const struct dag_handle *h, uint32_t dag_line)
+{
+	uint32_t left = h->stripe_lines - dag_line % h->stripe_lines;
+
+	if (left > h->full_lines - dag_line)
+		left = h->full_lines - dag_line;
+	return left;
+}
+
+
+uint64_t dagio_file_bytes(const struct dag_handle *h, unsigned i)
+{
+	uint32_t stripes = (h->full_lines + h->stripe_lines - 1) /
+	    h->stripe_lines;
+	uint32_t partial = h->full_lines % h->stripe_lines;
+	uint64_t lines;
+
+	if (i >= stripes)
+		return 0;
+	lines = (uint64_t) ((stripes - i + h->files - 1) / h->files) *
+	    h->stripe_lines;
+	if (partial && (stripes - 1) % h->files == i)
+		lines -= h->stripe_lines - partial;
+	return lines * DAG_LINE_BYTES;
+}
+
+
+unsigned dagio_max_segments(const struct dag_handle *h, uint32_t lines)
+{
+	return lines / h->stripe_lines + lines / SEGMENT_LINES + 2;
+}
+
+
+unsigned dagio_segments(const struct dag_handle *h, struct dagio_segment *seg,
+    uint8_t *buf, uint32_t lines, uint32_t dag_line)
+{
+	unsigned n = 0;
+	uint32_t i;
+
+	assert(dag_line + lines <= h->full_lines);
+	while (lines) {
+		seg[n].file = dagio_locate(h, dag_line, &seg[n].pos);
+		seg[n].buf = buf;
+		i = dagio_stripe_left(h, dag_line);
+		if (i > lines)
+			i = lines;
+		if (i > SEGMENT_LINES)
+			i = SEGMENT_LINES;
+		seg[n].bytes = (size_t) i * DAG_LINE_BYTES;
+		buf += seg[n].bytes;
+		dag_line += i;
+		lines -= i;
+		n++;
+	}
+	return n;
+}
+
+
+/* ----- Information ------------------------------------------------------- */
+
+
 uint64_t dagio_bytes(const struct dag_handle *h)
 {
 	uint64_t size = 0;
 	unsigned i;
 	struct stat st;
 
-	for (i = 0; i != DAG_FDS; i++)
-		if (h->fd[i] >= 0) {
-			if (fstat(h->fd[i], &st) < 0) {
-				perror(h->name[i]);
-				exit(1);
-			}
-			size += st.st_size;
-			if (st.st_size != MAX_DAG_FILE_BYTES)
-				break;
+	if (!h->files)
+		return (uint64_t) h->full_lines * DAG_LINE_BYTES;
+	for (i = 0; i != h->files; i++) {
+		if (fstat(h->fd[i], &st) < 0) {
+			perror(h->name[i]);
+			exit(1);
 		}
+		size += st.st_size;
+	}
 	return size;
 }
 
@@ -89,134 +191,386 @@ unsigned dagio_full_lines(const struct dag_handle *h)
 }
 
 
-void dagio_pread(struct dag_handle *h, void *buf, uint32_t lines,
-    uint32_t dag_line)
+unsigned dagio_files(const struct dag_handle *h)
 {
-	unsigned i = 0;
+	return h->files;
+}
 
-	assert(dag_line + lines <= h->full_lines);
-	while (dag_line >= LINES_PER_FILE) {
-		i++;
-		dag_line -= LINES_PER_FILE;
-	}
-	while (lines) {
-		assert(i < DAG_FDS);
-		pread_dag_line(h->fd[i], dag_line, buf);
-		dag_line++;
-		buf += DAG_LINE_BYTES;
-		if (dag_line == LINES_PER_FILE) {
-			dag_line = 0;
-			i++;
+
+const char *dagio_backend_name(enum dagio_backend be)
+{
+	return backends[be]->name;
+}
+
+
+int dagio_backend_code(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i != dagio_backends; i++)
+		if (!strcmp(backends[i]->name, name))
+			return i;
+	return -1;
+}
+
+
+/* ----- File backend ------------------------------------------------------ */
+
+
+struct file_io {
+	const struct dag_handle *h;
+	const struct dagio_segment *seg;
+	unsigned	n;
+	unsigned	file;
+	bool		write;
+	pthread_t	thread;
+};
+
+
+static void *file_io(void *arg)
+{
+	const struct file_io *io = arg;
+	const struct dag_handle *h = io->h;
+	const struct dagio_segment *s;
+	uint8_t *buf;
+	uint64_t pos;
+	size_t left, size;
+	ssize_t got;
+
+	for (s = io->seg; s != io->seg + io->n; s++) {
+		if (s->file != io->file)
+			continue;
+		buf = s->buf;
+		pos = s->pos;
+		for (left = s->bytes; left; left -= got) {
+			size = left < MAX_IO_BYTES ? left : MAX_IO_BYTES;
+			if (io->write) {
+				got = pwrite(h->fd[s->file], buf, size, pos);
+			} else {
+				got = pread(h->fd[s->file], buf, size, pos);
+				dagcount(ls_preads, 1);
+			}
+			if (got < 0) {
+				perror(h->name[s->file]);
+				exit(1);
+			}
+			if (!got) {
+				fprintf(stderr, "%s: short %s (%llu < %llu)\n",
+				    h->name[s->file],
+				    io->write ? "write" : "read",
+				    (unsigned long long) (s->bytes - left),
+				    (unsigned long long) s->bytes);
+				exit(1);
+			}
+			buf += got;
+			pos += got;
 		}
-		lines--;
 	}
+	return NULL;
 }
 
 
-void dagio_pwrite(struct dag_handle *h, const void *buf, uint32_t lines,
-    uint32_t dag_line)
+static void file_rw(const struct dag_handle *h, uint8_t *buf,
+    uint32_t lines, uint32_t dag_line, bool write)
 {
-	unsigned i = 0;
-	unsigned n;
-	size_t bytes;
-	ssize_t wrote;
+	struct dagio_segment seg_buf[STACK_SEGMENTS];
+	struct dagio_segment *seg = seg_buf;
+	struct file_io io_buf[STACK_FILES];
+	struct file_io *io = io_buf;
+	bool used_buf[STACK_FILES];
+	bool *used = used_buf;
+	unsigned max = dagio_max_segments(h, lines);
+	unsigned n, files = 0, i;
+	int err;
+
+	if (max > STACK_SEGMENTS)
+		seg = alloc_size(sizeof(struct dagio_segment) * max);
+	n = dagio_segments(h, seg, buf, lines, dag_line);
+	if (!n)
+		goto out;
+
+	/* the common case, e.g., single lines for hashimoto_dh */
+	if (n == 1) {
+		io->h = h;
+		io->seg = seg;
+		io->n = 1;
+		io->file = seg->file;
+		io->write = write;
+		file_io(io);
+		goto out;
+	}
 
-	assert(dag_line + lines <= h->full_lines);
-	while (dag_line >= LINES_PER_FILE) {
-		i++;
-		dag_line -= LINES_PER_FILE;
+	if (h->files > STACK_FILES) {
+		io = alloc_size(sizeof(struct file_io) * h->files);
+		used = alloc_size(sizeof(bool) * h->files);
 	}
-	while (lines) {
-		assert(i < DAG_FDS);
-		if (dag_line + lines < LINES_PER_FILE)
-			n = lines;
-		else
-			n = LINES_PER_FILE - dag_line;
-		bytes = (size_t) n * DAG_LINE_BYTES;
-		wrote = pwrite(h->fd[i], buf, bytes,
-		    (off_t) dag_line * DAG_LINE_BYTES);
-		if (wrote < 0) {
-			perror(h->name[i]);
-			exit(1);
-		}
-		if ((size_t) wrote != bytes) {
-			fprintf(stderr, "%s: short write (%llu < %llu)\n",
-			    h->name[i], (unsigned long long) wrote,
-			    (unsigned long long) bytes);
-			exit(1);
+	memset(used, 0, sizeof(bool) * h->files);
+	for (i = 0; i != n; i++)
+		if (!used[seg[i].file]) {
+			used[seg[i].file] = 1;
+			files++;
 		}
-		dag_line += n;
-		buf += bytes;
-		if (dag_line == LINES_PER_FILE) {
-			dag_line = 0;
-			i++;
+	for (i = 0; i != h->files; i++) {
+		io[i].h = h;
+		io[i].seg = seg;
+		io[i].n = n;
+		io[i].file = i;
+		io[i].write = write;
+	}
+	if (files == 1 || (uint64_t) lines * DAG_LINE_BYTES < PARALLEL_BYTES) {
+		for (i = 0; i != h->files; i++)
+			if (used[i])
+				file_io(io + i);
+	} else {
+		for (i = 0; i != h->files; i++) {
+			if (!used[i])
+				continue;
+			err = pthread_create(&io[i].thread, NULL, file_io,
+			    io + i);
+			if (err) {
+				fprintf(stderr, "pthread_create: %s\n",
+				    strerror(err));
+				exit(1);
+			}
 		}
-		lines -= n;
+		for (i = 0; i != h->files; i++)
+			if (used[i])
+				pthread_join(io[i].thread, NULL);
 	}
+	if (io != io_buf) {
+		free(used);
+		free(io);
+	}
+out:
+	if (seg != seg_buf)
+		free(seg);
 }
 
 
-struct dag_handle *dagio_try_open(const char *name, mode_t mode,
-    uint32_t full_lines)
+static int file_open(struct dag_handle *h)
+{
+	return 0;
+}
+
+
+static void file_read(struct dag_handle *h, void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	file_rw(h, buf, lines, dag_line, 0);
+}
+
+
+static void file_write(struct dag_handle *h, const void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	file_rw(h, (uint8_t *) buf, lines, dag_line, 1);
+}
+
+
+static const void *file_map(struct dag_handle *h)
+{
+	return NULL;
+}
+
+
+static void file_close(struct dag_handle *h)
+{
+}
+
+
+const struct dagio_ops dagio_file_ops = {
+	.name		= "file",
+	.files		= 1,
+	.rdwr		= 0,
+	.direct		= 1,
+	.open		= file_open,
+	.read_lines	= file_read,
+	.write_lines	= file_write,
+	.map		= file_map,
+	.close		= file_close,
+};
+
+
+/* ----- Reading and writing ----------------------------------------------- */
+
+
+void dagio_pread(struct dag_handle *h, void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	assert(dag_line + lines <= h->full_lines);
+	h->ops->read_lines(h, buf, lines, dag_line);
+}
+
+
+void dagio_pwrite(struct dag_handle *h, const void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	assert(dag_line + lines <= h->full_lines);
+	h->ops->write_lines(h, buf, lines, dag_line);
+	dagcount(ls_bytes_written, (uint64_t) lines * DAG_LINE_BYTES);
+}
+
+
+const void *dagio_map(struct dag_handle *h)
+{
+	return h->ops->map(h);
+}
+
+
+/* ----- Opening and closing ----------------------------------------------- */
+
+
+static void close_files(struct dag_handle *h, bool del)
+{
+	unsigned i;
+
+	for (i = 0; i != h->files; i++) {
+		if (h->fd[i] >= 0)
+			if (close(h->fd[i]) < 0)
+				perror(h->name[i]);
+		if (del && h->fd[i] >= 0)
+			if (unlink(h->name[i]) < 0)
+				perror(h->name[i]);
+		free(h->name[i]);
+	}
+	free(h->name);
+	free(h->fd);
+	free(h);
+}
+
+
+/*
+ * With stripe_lines == 0, we use the classic layout, with names[0] as the
+ * base name.
+ */
+
+struct dag_handle *dagio_try_open_backend(enum dagio_backend be,
+    const char *const *names, unsigned files, mode_t mode,
+    uint32_t full_lines, uint32_t stripe_lines)
 {
 	struct dag_handle *h = alloc_type(struct dag_handle);
-	unsigned n, i;
+	unsigned i;
 	int error;
 
+	h->ops = backends[be];
+	h->mode = mode;
 	h->full_lines = full_lines;
-	n = (full_lines + LINES_PER_FILE - 1) / LINES_PER_FILE;
-	for (i = 0; i != DAG_FDS; i++) {
-		h->fd[i] = -1;
-		h->name[i] = NULL;
+	h->priv = NULL;
+	if (stripe_lines) {
+		if (!files && h->ops->files) {
+			free(h);
+			errno = EINVAL;
+			return NULL;
+		}
+		h->stripe_lines = stripe_lines;
+	} else {
+		h->stripe_lines = LINES_PER_FILE;
+		files = (full_lines + LINES_PER_FILE - 1) / LINES_PER_FILE;
 	}
-	for (i = 0; i != n; i++) {
-		if (i) {
-			if (asprintf(&h->name[i], "%s-%u", name, i) < 0)
-				goto fail;
+	if (!h->ops->files) {
+		/* memory-only backends can load the DAG, but not store it */
+		if (names && (mode & O_ACCMODE) != O_RDONLY) {
+			free(h);
+			errno = ENOTSUP;
+			return NULL;
+		}
+		if (!names)
+			files = 0;
+	}
+	h->files = files;
+	h->name = alloc_size(sizeof(char *) * (files ? files : 1));
+	h->fd = alloc_size(sizeof(int) * (files ? files : 1));
+	for (i = 0; i != files; i++) {
+		h->fd[i] = -1;
+		if (stripe_lines) {
+			h->name[i] = stralloc(names[i]);
+		} else if (i) {
+			if (asprintf(&h->name[i], "%s-%u", names[0], i) < 0) {
+				perror("asprintf");
+				exit(1);
+			}
 		} else {
-			h->name[i] = stralloc(name);
+			h->name[i] = stralloc(names[0]);
 		}
+	}
+	if (h->ops->rdwr && (mode & O_ACCMODE) == O_WRONLY)
+		mode = (mode & ~O_ACCMODE) | O_RDWR;
+	for (i = 0; i != files; i++) {
 		h->fd[i] = open(h->name[i], mode, 0666);
 		if (h->fd[i] < 0)
 			goto fail;
 	}
+	if (h->ops->open(h) < 0)
+		goto fail;
 	return h;
 
 fail:
 	error = errno;
-	dagio_close(h);
+	close_files(h, 0);
 	errno = error;
 	return NULL;
 }
 
 
+struct dag_handle *dagio_open_backend(enum dagio_backend be,
+    const char *const *names, unsigned files, mode_t mode,
+    uint32_t full_lines, uint32_t stripe_lines)
+{
+	struct dag_handle *h;
+
+	h = dagio_try_open_backend(be, names, files, mode, full_lines,
+	    stripe_lines);
+	if (h)
+		return h;
+	perror(names ? names[0] : dagio_backend_name(be));
+	exit(1);
+}
+
+
+struct dag_handle *dagio_try_open(const char *name, mode_t mode,
+    uint32_t full_lines)
+{
+	return dagio_try_open_backend(dbe_file, &name, 1, mode, full_lines, 0);
+}
+
+
 struct dag_handle *dagio_open(const char *name, mode_t mode,
     uint32_t full_lines)
+{
+	return dagio_open_backend(dbe_file, &name, 1, mode, full_lines, 0);
+}
+
+
+struct dag_handle *dagio_try_open_striped(const char *const *names,
+    unsigned files, mode_t mode, uint32_t full_lines, uint32_t stripe_lines)
+{
+	if (!stripe_lines) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return dagio_try_open_backend(dbe_file, names, files, mode, full_lines,
+	    stripe_lines);
+}
+
+
+struct dag_handle *dagio_open_striped(const char *const *names,
+    unsigned files, mode_t mode, uint32_t full_lines, uint32_t stripe_lines)
 {
 	struct dag_handle *h;
 
-	h = dagio_try_open(name, mode, full_lines);
+	h = dagio_try_open_striped(names, files, mode, full_lines,
+	    stripe_lines);
 	if (h)
 		return h;
-	perror(name);
+	perror(files ? names[0] : "dagio_open_striped");
 	exit(1);
 }
 
 
 static void close_and_delete(struct dag_handle *h, bool del)
 {
-	unsigned i;
-
-	for (i = 0; i != DAG_FDS; i++) {
-		if (h->fd[i] >= 0)
-			if (close(h->fd[i]) < 0)
-				perror(h->name[i]);
-		if (del && h->name[i])
-			if (unlink(h->name[i]) < 0)
-				perror(h->name[i]);
-		free(h->name[i]);
-	}
-	free(h);
+	h->ops->close(h);
+	close_files(h, del);
 }
 
 
@@ -230,3 +584,359 @@ void dagio_close_and_delete(struct dag_handle *h)
 {
 	close_and_delete(h, 1);
 }
+
+
+/* ----- Sequential writer ------------------------------------------------- */
+
+
+/*
+ * In direct mode, we bypass the page cache with O_DIRECT and keep several
+ * chunk-sized writes in flight with Linux native AIO. O_DIRECT needs aligned
+ * offsets and sizes, which the end of each file (4 GB - 128 bytes for the
+ * first one) isn't, so the last partial block of a file is written with
+ * O_DIRECT turned off, after all the writes to that file have completed.
+ * Stripes that don't end a file must therefore be aligned.
+ *
+ * If the file system or kernel doesn't support any of this, we quietly fall
+ * back to buffered writes.
+ */
+
+#define	DIRECT_ALIGN		4096
+#define	DEFAULT_INFLIGHT	8
+#define	DEFAULT_CHUNK_BYTES	(1 << 20)
+
+
+struct dagio_writer {
+	struct dag_handle *h;
+	struct dagio_writer_cfg cfg;
+	struct timespec	t0;
+	uint64_t	bytes;
+	uint32_t	next_line;
+
+	/* direct mode */
+	aio_context_t	ctx;
+	uint8_t		**buf;
+	struct iocb	*iocb;
+	unsigned	*free_buf;	/* stack of free buffers */
+	unsigned	free;
+	int		cur;		/* buffer being filled, -1 if none */
+	unsigned	fill;		/* bytes in that buffer */
+	unsigned	file;		/* file of the current buffer */
+	uint64_t	pos;		/* file offset of current buffer */
+};
+
+
+static const char *fd_name(const struct dag_handle *h, int fd)
+{
+	unsigned i;
+
+	for (i = 0; i != h->files; i++)
+		if (h->fd[i] == fd)
+			return h->name[i];
+	return "?";
+}
+
+
+static void sync_files(struct dag_handle *h, int (*fn)(int fd))
+{
+	unsigned i;
+
+	for (i = 0; i != h->files; i++)
+		if (fn(h->fd[i]) < 0) {
+			perror(h->name[i]);
+			exit(1);
+		}
+}
+
+
+static bool set_direct(struct dag_handle *h, bool on)
+{
+	unsigned i;
+	int flags;
+
+	for (i = 0; i != h->files; i++) {
+		flags = fcntl(h->fd[i], F_GETFL);
+		if (flags < 0)
+			return 0;
+		flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+		if (fcntl(h->fd[i], F_SETFL, flags) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+
+static void reap(struct dagio_writer *w, unsigned min)
+{
+	struct io_event ev[w->cfg.inflight];
+	const struct iocb *cb;
+	long got, i;
+
+	got = syscall(SYS_io_getevents, w->ctx, min, w->cfg.inflight, ev,
+	    NULL);
+	if (got < 0) {
+		perror("io_getevents");
+		exit(1);
+	}
+	for (i = 0; i != got; i++) {
+		cb = (const struct iocb *) (uintptr_t) ev[i].obj;
+		if (ev[i].res < 0) {
+			fprintf(stderr, "%s: %s\n",
+			    fd_name(w->h, cb->aio_fildes),
+			    strerror(-ev[i].res));
+			exit(1);
+		}
+		if ((uint64_t) ev[i].res != cb->aio_nbytes) {
+			fprintf(stderr, "%s: short write (%llu < %llu)\n",
+			    fd_name(w->h, cb->aio_fildes),
+			    (unsigned long long) ev[i].res,
+			    (unsigned long long) cb->aio_nbytes);
+			exit(1);
+		}
+		w->free_buf[w->free++] = ev[i].data;
+	}
+}
+
+
+static void drain(struct dagio_writer *w)
+{
+	unsigned busy = w->cfg.inflight - w->free - (w->cur >= 0);
+
+	while (busy) {
+		reap(w, 1);
+		busy = w->cfg.inflight - w->free - (w->cur >= 0);
+	}
+}
+
+
+static void submit(struct dagio_writer *w, unsigned bytes)
+{
+	struct iocb *cb = w->iocb + w->cur;
+
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_data = w->cur;
+	cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb->aio_fildes = w->h->fd[w->file];
+	cb->aio_buf = (uintptr_t) w->buf[w->cur];
+	cb->aio_nbytes = bytes;
+	cb->aio_offset = w->pos;
+	if (w->cfg.sync == dsync_chunk)
+		cb->aio_rw_flags = RWF_DSYNC;
+	if (syscall(SYS_io_submit, w->ctx, 1, &cb) != 1) {
+		perror("io_submit");
+		exit(1);
+	}
+	w->pos += bytes;
+	w->cur = -1;
+}
+
+
+/*
+ * Write out what's left in the current buffer: the aligned part with O_DIRECT,
+ * the rest buffered. This ends O_DIRECT for the file.
+ */
+
+static void flush_file(struct dagio_writer *w)
+{
+	unsigned aligned = w->fill & ~(DIRECT_ALIGN - 1);
+	unsigned tail = w->fill - aligned;
+	const uint8_t *p;
+	ssize_t wrote;
+	int fd, flags;
+
+	if (w->cur < 0)
+		return;
+	fd = w->h->fd[w->file];
+	p = w->buf[w->cur] + aligned;
+	if (aligned) {
+		submit(w, aligned);
+	} else {
+		w->free_buf[w->free++] = w->cur;
+		w->cur = -1;
+	}
+	drain(w);
+	if (!tail)
+		return;
+
+	/* the buffer is free again, but nobody has reused it yet */
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+		perror(w->h->name[w->file]);
+		exit(1);
+	}
+	wrote = pwrite(fd, p, tail, w->pos);
+	if (wrote < 0) {
+		perror(w->h->name[w->file]);
+		exit(1);
+	}
+	if ((size_t) wrote != tail) {
+		fprintf(stderr, "%s: short write (%llu < %u)\n",
+		    w->h->name[w->file], (unsigned long long) wrote, tail);
+		exit(1);
+	}
+	if (w->cfg.sync == dsync_chunk && fdatasync(fd) < 0) {
+		perror(w->h->name[w->file]);
+		exit(1);
+	}
+	w->pos += tail;
+}
+
+
+static void write_direct(struct dagio_writer *w, const uint8_t *buf,
+    uint32_t lines)
+{
+	struct dag_handle *h = w->h;
+	uint32_t line = w->next_line;
+	uint32_t left, room;
+
+	while (lines) {
+		if (w->cur < 0) {
+			if (!w->free)
+				reap(w, 1);
+			w->cur = w->free_buf[--w->free];
+			w->fill = 0;
+			w->file = dagio_locate(h, line, &w->pos);
+		}
+		left = dagio_stripe_left(h, line);
+		room = (w->cfg.chunk_bytes - w->fill) / DAG_LINE_BYTES;
+		if (room > left)
+			room = left;
+		if (room > lines)
+			room = lines;
+		memcpy(w->buf[w->cur] + w->fill, buf,
+		    (size_t) room * DAG_LINE_BYTES);
+		w->fill += room * DAG_LINE_BYTES;
+		buf += (size_t) room * DAG_LINE_BYTES;
+		lines -= room;
+		line += room;
+		if (room == left &&
+		    w->pos + w->fill == dagio_file_bytes(h, w->file)) {
+			/* dsync_end syncs all files once, in the close */
+			flush_file(w);
+		} else if (room == left ||
+		    w->fill + DAG_LINE_BYTES > w->cfg.chunk_bytes) {
+			/* next line goes to another file, or doesn't fit */
+			submit(w, w->fill);
+		}
+	}
+}
+
+
+static bool setup_direct(struct dagio_writer *w)
+{
+	struct dag_handle *h = w->h;
+	unsigned i;
+
+	if (w->cfg.chunk_bytes % DIRECT_ALIGN) {
+		fprintf(stderr, "chunk size must be a multiple of %u bytes\n",
+		    DIRECT_ALIGN);
+		exit(1);
+	}
+	if (!h->ops->direct)
+		return 0;
+	if (h->full_lines > (uint64_t) h->stripe_lines * h->files &&
+	    h->stripe_lines * DAG_LINE_BYTES % DIRECT_ALIGN)
+		return 0;
+	for (i = 0; i != h->files; i++)
+		if (fallocate(h->fd[i], 0, 0, dagio_file_bytes(h, i)) < 0 &&
+		    errno != EOPNOTSUPP && errno != ENOSYS) {
+			perror(h->name[i]);
+			exit(1);
+		}
+	if (!set_direct(h, 1)) {
+		set_direct(h, 0);
+		return 0;
+	}
+	w->ctx = 0;
+	if (syscall(SYS_io_setup, w->cfg.inflight, &w->ctx) < 0) {
+		set_direct(h, 0);
+		return 0;
+	}
+	w->buf = alloc_size(sizeof(uint8_t *) * w->cfg.inflight);
+	w->iocb = alloc_size(sizeof(struct iocb) * w->cfg.inflight);
+	w->free_buf = alloc_size(sizeof(unsigned) * w->cfg.inflight);
+	for (i = 0; i != w->cfg.inflight; i++) {
+		if (posix_memalign((void **) &w->buf[i], DIRECT_ALIGN,
+		    w->cfg.chunk_bytes)) {
+			perror("posix_memalign");
+			exit(1);
+		}
+		w->free_buf[i] = i;
+	}
+	w->free = w->cfg.inflight;
+	w->cur = -1;
+	return 1;
+}
+
+
+struct dagio_writer *dagio_writer_open(struct dag_handle *h,
+    const struct dagio_writer_cfg *cfg)
+{
+	struct dagio_writer *w = alloc_type(struct dagio_writer);
+
+	w->h = h;
+	w->cfg = *cfg;
+	if (!w->cfg.inflight)
+		w->cfg.inflight = DEFAULT_INFLIGHT;
+	if (!w->cfg.chunk_bytes)
+		w->cfg.chunk_bytes = DEFAULT_CHUNK_BYTES;
+	w->bytes = 0;
+	w->next_line = 0;
+	clock_gettime(CLOCK_MONOTONIC, &w->t0);
+	if (w->cfg.direct)
+		w->cfg.direct = setup_direct(w);
+	return w;
+}
+
+
+void dagio_writer_write(struct dagio_writer *w, const void *buf,
+    uint32_t lines)
+{
+	uint64_t bytes = (uint64_t) lines * DAG_LINE_BYTES;
+
+	assert(w->next_line + lines <= w->h->full_lines);
+	dagprof_begin(dp_write);
+	if (w->cfg.direct) {
+		write_direct(w, buf, lines);
+		dagcount(ls_bytes_written, bytes);
+	} else {
+		dagio_pwrite(w->h, buf, lines, w->next_line);
+		if (w->cfg.sync == dsync_chunk)
+			sync_files(w->h, fdatasync);
+	}
+	dagprof_end(dp_write);
+	w->next_line += lines;
+	w->bytes += bytes;
+}
+
+
+void dagio_writer_close(struct dagio_writer *w,
+    struct dagio_writer_stats *stats)
+{
+	struct timespec t1;
+	unsigned i;
+
+	if (w->cfg.direct) {
+		flush_file(w);
+		drain(w);
+		syscall(SYS_io_destroy, w->ctx);
+		for (i = 0; i != w->cfg.inflight; i++)
+			free(w->buf[i]);
+		free(w->buf);
+		free(w->iocb);
+		free(w->free_buf);
+		set_direct(w->h, 0);
+	}
+	if (w->cfg.sync == dsync_end)
+		sync_files(w->h, fsync);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (stats) {
+		stats->bytes = w->bytes;
+		stats->seconds = t1.tv_sec - w->t0.tv_sec +
+		    1e-9 * (t1.tv_nsec - w->t0.tv_nsec);
+		stats->mb_s = stats->seconds ?
+		    w->bytes / stats->seconds / 1e6 : 0;
+		stats->direct = w->cfg.direct;
+	}
+	free(w);
+}
@@ -19,22 +19,110 @@
 
 
 struct dag_handle;
+struct dagio_writer;
+
+
+/*
+ * Storage backends:
+ * file		pread/pwrite on the files
+ * mmap		shared mappings of the files
+ * mem		anonymous memory; read-only opens load the files, and nothing
+ *		is written back
+ * uring	io_uring on the files (raw system calls, no liburing)
+ */
+
+enum dagio_backend {
+	dbe_file	= 0,
+	dbe_mmap	= 1,
+	dbe_mem		= 2,
+	dbe_uring	= 3,
+	dagio_backends	= 4	/* must be last */
+};
+
+
+enum dagio_sync {
+	dsync_none	= 0,	/* leave writeback to the kernel */
+	dsync_end	= 1,	/* fsync all files in dagio_writer_close */
+	dsync_chunk	= 2,	/* each write is durable (O_DSYNC semantics) */
+};
+
+struct dagio_writer_cfg {
+	bool		direct;		/* O_DIRECT, preallocate, async */
+	unsigned	inflight;	/* writes in flight (direct only) */
+	unsigned	chunk_bytes;	/* bytes per write (direct only) */
+	enum dagio_sync	sync;
+};
+
+struct dagio_writer_stats {
+	uint64_t	bytes;		/* bytes written */
+	double		seconds;	/* from open to close, incl. sync */
+	double		mb_s;		/* sustained 10^6 bytes/s */
+	bool		direct;		/* false if we fell back to buffered */
+};
 
 
 void pread_dag_line(int dag_fd, uint32_t dag_line, void *buf);
 
 uint64_t dagio_bytes(const struct dag_handle *h);
 unsigned dagio_full_lines(const struct dag_handle *h);
+unsigned dagio_files(const struct dag_handle *h);
+
+const char *dagio_backend_name(enum dagio_backend be);
+
+/*
+ * Returns enum dagio_backend, -1 if no such backend is known.
+ */
+int dagio_backend_code(const char *name);
 
 void dagio_pread(struct dag_handle *h, void *buf, uint32_t lines,
     uint32_t dag_line);
 void dagio_pwrite(struct dag_handle *h, const void *buf, uint32_t lines,
     uint32_t dag_line);
 
+/*
+ * Contiguous view of the whole DAG, NULL if the backend can't provide one.
+ */
+const void *dagio_map(struct dag_handle *h);
+
+/*
+ * The writer writes the whole DAG sequentially, from line 0 on.
+ */
+
+struct dagio_writer *dagio_writer_open(struct dag_handle *h,
+    const struct dagio_writer_cfg *cfg);
+void dagio_writer_write(struct dagio_writer *w, const void *buf,
+    uint32_t lines);
+void dagio_writer_close(struct dagio_writer *w,
+    struct dagio_writer_stats *stats);
+
 struct dag_handle *dagio_try_open(const char *name, mode_t mode,
     uint32_t full_lines);
 struct dag_handle *dagio_open(const char *name, mode_t mode,
     uint32_t full_lines);
+
+/*
+ * Striped layout: stripes of "stripe_lines" lines go round-robin to the files
+ * in "names", e.g., on different disks. Requests that span several files
+ * access them in parallel. For direct writes, stripes should be a multiple
+ * of 4 kB (32 lines).
+ */
+struct dag_handle *dagio_try_open_striped(const char *const *names,
+    unsigned files, mode_t mode, uint32_t full_lines, uint32_t stripe_lines);
+struct dag_handle *dagio_open_striped(const char *const *names,
+    unsigned files, mode_t mode, uint32_t full_lines, uint32_t stripe_lines);
+
+/*
+ * Open with any backend. With stripe_lines == 0, names[0] is the base name
+ * of the classic layout, and "files" is ignored. The "mem" backend starts
+ * with a zero DAG if "names" is NULL. Else it loads the DAG from the files,
+ * which it can only do for O_RDONLY (ENOTSUP otherwise).
+ */
+struct dag_handle *dagio_try_open_backend(enum dagio_backend be,
+    const char *const *names, unsigned files, mode_t mode,
+    uint32_t full_lines, uint32_t stripe_lines);
+struct dag_handle *dagio_open_backend(enum dagio_backend be,
+    const char *const *names, unsigned files, mode_t mode,
+    uint32_t full_lines, uint32_t stripe_lines);
 void dagio_close(struct dag_handle *h);
 void dagio_close_and_delete(struct dag_handle *h);
 
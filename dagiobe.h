@@ -0,0 +1,86 @@
+/*
+ * dagiobe.h - DAG I/O backends (internal)
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGIOBE_H
+#define	LIBDAG_DAGIOBE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+struct dag_handle;
+
+/*
+ * dagio opens (and closes) the files, if the backend uses them or is to load
+ * the DAG from them, before calling "open" (and after calling "close").
+ * "open" returns 0 on success, -1 (and errno) on failure. "map" returns NULL
+ * if the backend can't provide a contiguous view of the DAG.
+ */
+
+struct dagio_ops {
+	const char	*name;
+	bool		files;		/* backend uses the files for I/O */
+	bool		rdwr;		/* writing needs O_RDWR */
+	bool		direct;		/* writer can use O_DIRECT and AIO */
+	int (*open)(struct dag_handle *h);
+	void (*read_lines)(struct dag_handle *h, void *buf, uint32_t lines,
+	    uint32_t dag_line);
+	void (*write_lines)(struct dag_handle *h, const void *buf,
+	    uint32_t lines, uint32_t dag_line);
+	const void *(*map)(struct dag_handle *h);
+	void (*close)(struct dag_handle *h);
+};
+
+struct dag_handle {
+	const struct dagio_ops *ops;
+	unsigned	files;
+	char		**name;
+	int		*fd;
+	mode_t		mode;
+	uint32_t	full_lines;
+	uint32_t	stripe_lines;
+	void		*priv;		/* backend data */
+};
+
+/*
+ * A request split into pieces that are contiguous in one file. Pieces are at
+ * most 1 GiB, so that backends can map them to single I/O operations, but
+ * the kernel may still transfer less than asked for.
+ */
+
+struct dagio_segment {
+	unsigned	file;
+	uint64_t	pos;
+	size_t		bytes;
+	uint8_t		*buf;
+};
+
+
+extern const struct dagio_ops dagio_file_ops;
+extern const struct dagio_ops dagio_mmap_ops;
+extern const struct dagio_ops dagio_mem_ops;
+extern const struct dagio_ops dagio_uring_ops;
+
+
+unsigned dagio_locate(const struct dag_handle *h, uint32_t dag_line,
+    uint64_t *pos);
+uint32_t dagio_stripe_left(const struct dag_handle *h, uint32_t dag_line);
+uint64_t dagio_file_bytes(const struct dag_handle *h, unsigned i);
+
+/*
+ * "seg" must have room for dagio_max_segments(h, lines) entries. Returns the
+ * number of segments.
+ */
+unsigned dagio_max_segments(const struct dag_handle *h, uint32_t lines);
+unsigned dagio_segments(const struct dag_handle *h, struct dagio_segment *seg,
+    uint8_t *buf, uint32_t lines, uint32_t dag_line);
+
+#endif /* !LIBDAG_DAGIOBE_H */
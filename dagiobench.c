@@ -0,0 +1,211 @@
+/*
+ * dagiobench.c - Compare DAG I/O backends
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (compare backends on the same DAG):
+ * for b in file mmap uring; do ./dagiobench -B $b 100 /tmp/dag; done
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagio.h"
+
+
+#define	SEQ_LINES	(1 << 13)	/* 1 MB */
+
+
+static uint32_t stripe_lines = 0;
+static enum dagio_backend backend = dbe_file;
+static unsigned reads = 100000;
+
+
+struct job {
+	struct dag_handle *h;
+	unsigned	index;
+	pthread_t	thread;
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+/* ----- Random single-line reads (like hashimoto_dh) ---------------------- */
+
+
+static void *random_thread(void *arg)
+{
+	const struct job *job = arg;
+	unsigned full_lines = dagio_full_lines(job->h);
+	uint64_t x = 0x9e3779b97f4a7c15ull * (job->index + 1);
+	uint8_t line[DAG_LINE_BYTES];
+	unsigned i;
+
+	for (i = 0; i != reads; i++) {
+		/* xorshift64 */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		dagio_pread(job->h, line, 1, x % full_lines);
+	}
+	return NULL;
+}
+
+
+static void bench_random(struct dag_handle *h, unsigned threads)
+{
+	struct job *job = alloc_size(sizeof(struct job) * threads);
+	double t0, t;
+	unsigned i;
+	int err;
+
+	t0 = now();
+	for (i = 0; i != threads; i++) {
+		job[i].h = h;
+		job[i].index = i;
+		err = pthread_create(&job[i].thread, NULL, random_thread,
+		    job + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(job[i].thread, NULL);
+	t = now() - t0;
+	printf("%s random: %u threads, %.0f lines/s\n",
+	    dagio_backend_name(backend), threads,
+	    (double) reads * threads / t);
+	free(job);
+}
+
+
+/* ----- Sequential reads -------------------------------------------------- */
+
+
+static void bench_seq(struct dag_handle *h)
+{
+	unsigned full_lines = dagio_full_lines(h);
+	uint8_t *buf = alloc_size((size_t) SEQ_LINES * DAG_LINE_BYTES);
+	unsigned line, n;
+	double t0, t;
+
+	t0 = now();
+	for (line = 0; line != full_lines; line += n) {
+		n = full_lines - line < SEQ_LINES ? full_lines - line :
+		    SEQ_LINES;
+		dagio_pread(h, buf, n, line);
+	}
+	t = now() - t0;
+	printf("%s sequential: %.1f MB/s\n", dagio_backend_name(backend),
+	    (double) full_lines * DAG_LINE_BYTES / t / 1e6);
+	free(buf);
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-B backend] [-b stripe_kB] [-f dag_lines] [-n reads]\n"
+"       %*s[-t threads] epoch dag-file ...\n\n"
+"  -B backend\n"
+"      storage backend (file, mmap, mem, uring; default: file)\n"
+"  -b stripe_kB\n"
+"      the DAG is striped over the dag-files, in stripes of this size\n"
+"  -f dag_lines\n"
+"      override the DAG size\n"
+"  -n reads\n"
+"      random reads per thread (default: 100000)\n"
+"  -t threads\n"
+"      number of threads for random reads (default: one per CPU)\n"
+	    , name, (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct dag_handle *h;
+	unsigned full_lines = 0;
+	unsigned threads = 0;
+	unsigned epoch;
+	char *end;
+	int c, be;
+
+	while ((c = getopt(argc, argv, "B:b:f:n:t:")) != EOF)
+		switch (c) {
+		case 'B':
+			be = dagio_backend_code(optarg);
+			if (be < 0)
+				usage(*argv);
+			backend = be;
+			break;
+		case 'b':
+			stripe_lines = (strtoul(optarg, &end, 0) << 10) /
+			    DAG_LINE_BYTES;
+			if (*end || !stripe_lines)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'n':
+			reads = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 't':
+			threads = strtoul(optarg, &end, 0);
+			if (*end || !threads)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind < 2)
+		usage(*argv);
+	if (!stripe_lines && argc - optind != 2)
+		usage(*argv);
+	epoch = strtoul(argv[optind], &end, 0);
+	if (*end)
+		usage(*argv);
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	h = dagio_open_backend(backend, (const char *const *) argv + optind + 1,
+	    argc - optind - 1, O_RDONLY, full_lines, stripe_lines);
+	bench_seq(h);
+	bench_random(h, threads);
+	dagio_close(h);
+
+	return 0;
+}
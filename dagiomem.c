@@ -0,0 +1,87 @@
+/*
+ * dagiomem.c - DAG I/O backend: anonymous memory
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dag.h"
+#include "dagiobe.h"
+
+
+static size_t mem_bytes(const struct dag_handle *h)
+{
+	/* mmap doesn't like zero-sized mappings */
+	return h->full_lines ? (size_t) h->full_lines * DAG_LINE_BYTES : 1;
+}
+
+
+/*
+ * If dagio opened files for us, they hold the DAG to load. The file backend
+ * knows how to read them, including striped layouts and short files.
+ */
+
+static int mem_open(struct dag_handle *h)
+{
+	void *p;
+
+	p = mmap(NULL, mem_bytes(h), PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	h->priv = p;
+	if (h->files && h->full_lines)
+		dagio_file_ops.read_lines(h, p, h->full_lines, 0);
+	return 0;
+}
+
+
+static void mem_read(struct dag_handle *h, void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	memcpy(buf, (const uint8_t *) h->priv +
+	    (size_t) dag_line * DAG_LINE_BYTES,
+	    (size_t) lines * DAG_LINE_BYTES);
+}
+
+
+static void mem_write(struct dag_handle *h, const void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	memcpy((uint8_t *) h->priv + (size_t) dag_line * DAG_LINE_BYTES, buf,
+	    (size_t) lines * DAG_LINE_BYTES);
+}
+
+
+static const void *mem_map(struct dag_handle *h)
+{
+	return h->priv;
+}
+
+
+static void mem_close(struct dag_handle *h)
+{
+	if (munmap(h->priv, mem_bytes(h)) < 0)
+		perror("munmap");
+}
+
+
+const struct dagio_ops dagio_mem_ops = {
+	.name		= "mem",
+	.files		= 0,
+	.rdwr		= 0,
+	.direct		= 0,
+	.open		= mem_open,
+	.read_lines	= mem_read,
+	.write_lines	= mem_write,
+	.map		= mem_map,
+	.close		= mem_close,
+};
@@ -0,0 +1,218 @@
+/*
+ * dagiommap.c - DAG I/O backend: shared mappings of the files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagiobe.h"
+
+
+/*
+ * Each file is mapped on its own. If stripes are page-aligned (or there is
+ * only one file), we also map the stripes next to each other, which gives
+ * a contiguous view of the DAG at no extra memory cost.
+ */
+
+struct mmap_priv {
+	uint8_t		**base;		/* per file */
+	size_t		*length;	/* per file */
+	uint8_t		*view;		/* contiguous, NULL if none */
+	size_t		view_length;
+};
+
+
+static size_t map_length(const struct dag_handle *h, unsigned i)
+{
+	uint64_t bytes = dagio_file_bytes(h, i);
+
+	return bytes ? bytes : 1;
+}
+
+
+static uint8_t *make_view(struct dag_handle *h, struct mmap_priv *p,
+    int prot)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t stripe = (size_t) h->stripe_lines * DAG_LINE_BYTES;
+	uint32_t line;
+	uint64_t pos;
+	unsigned file;
+	uint8_t *view;
+	void *q;
+
+	if (h->files == 1)
+		return p->base[0];
+	if (stripe % page)
+		return NULL;
+	p->view_length = (size_t) h->full_lines * DAG_LINE_BYTES;
+	view = mmap(NULL, p->view_length, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (view == MAP_FAILED)
+		return NULL;
+	for (line = 0; line < h->full_lines; line += h->stripe_lines) {
+		file = dagio_locate(h, line, &pos);
+		q = mmap(view + (size_t) line * DAG_LINE_BYTES,
+		    (size_t) dagio_stripe_left(h, line) * DAG_LINE_BYTES, prot,
+		    MAP_SHARED | MAP_FIXED, h->fd[file], pos);
+		if (q == MAP_FAILED) {
+			munmap(view, p->view_length);
+			return NULL;
+		}
+	}
+	return view;
+}
+
+
+static int mmap_open(struct dag_handle *h)
+{
+	struct mmap_priv *p = alloc_type(struct mmap_priv);
+	bool rw = (h->mode & O_ACCMODE) != O_RDONLY;
+	int prot = PROT_READ | (rw ? PROT_WRITE : 0);
+	struct stat st;
+	unsigned i;
+	int err;
+
+	p->base = alloc_size(sizeof(uint8_t *) * (h->files ? h->files : 1));
+	p->length = alloc_size(sizeof(size_t) * (h->files ? h->files : 1));
+	for (i = 0; i != h->files; i++)
+		p->base[i] = MAP_FAILED;
+	for (i = 0; i != h->files; i++) {
+		p->length[i] = map_length(h, i);
+		if (rw) {
+			if (ftruncate(h->fd[i], dagio_file_bytes(h, i)) < 0)
+				goto fail;
+		} else {
+			/* accessing beyond the end would SIGBUS */
+			if (fstat(h->fd[i], &st) < 0)
+				goto fail;
+			if ((uint64_t) st.st_size < dagio_file_bytes(h, i)) {
+				errno = EINVAL;
+				goto fail;
+			}
+		}
+		p->base[i] = mmap(NULL, p->length[i], prot, MAP_SHARED,
+		    h->fd[i], 0);
+		if (p->base[i] == MAP_FAILED)
+			goto fail;
+	}
+	p->view = make_view(h, p, prot);
+	h->priv = p;
+	return 0;
+
+fail:
+	err = errno;
+	for (i = 0; i != h->files; i++)
+		if (p->base[i] != MAP_FAILED)
+			munmap(p->base[i], p->length[i]);
+	free(p->base);
+	free(p->length);
+	free(p);
+	errno = err;
+	return -1;
+}
+
+
+static void mmap_rw(struct dag_handle *h, uint8_t *buf, uint32_t lines,
+    uint32_t dag_line, bool write)
+{
+	const struct mmap_priv *p = h->priv;
+	uint8_t *q;
+	uint32_t n;
+	uint64_t pos;
+	unsigned file;
+	size_t bytes;
+
+	while (lines) {
+		file = dagio_locate(h, dag_line, &pos);
+		n = dagio_stripe_left(h, dag_line);
+		if (n > lines)
+			n = lines;
+		bytes = (size_t) n * DAG_LINE_BYTES;
+		q = p->base[file] + pos;
+		if (write)
+			memcpy(q, buf, bytes);
+		else
+			memcpy(buf, q, bytes);
+		buf += bytes;
+		dag_line += n;
+		lines -= n;
+	}
+}
+
+
+static void mmap_read(struct dag_handle *h, void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	const struct mmap_priv *p = h->priv;
+
+	if (p->view)
+		memcpy(buf, p->view + (size_t) dag_line * DAG_LINE_BYTES,
+		    (size_t) lines * DAG_LINE_BYTES);
+	else
+		mmap_rw(h, buf, lines, dag_line, 0);
+}
+
+
+static void mmap_write(struct dag_handle *h, const void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	mmap_rw(h, (uint8_t *) buf, lines, dag_line, 1);
+}
+
+
+static const void *mmap_map(struct dag_handle *h)
+{
+	const struct mmap_priv *p = h->priv;
+
+	return p->view;
+}
+
+
+static void mmap_close(struct dag_handle *h)
+{
+	struct mmap_priv *p = h->priv;
+	unsigned i;
+
+	if (p->view && h->files > 1)
+		if (munmap(p->view, p->view_length) < 0)
+			perror("munmap");
+	for (i = 0; i != h->files; i++)
+		if (munmap(p->base[i], p->length[i]) < 0)
+			perror(h->name[i]);
+	free(p->base);
+	free(p->length);
+	free(p);
+}
+
+
+const struct dagio_ops dagio_mmap_ops = {
+	.name		= "mmap",
+	.files		= 1,
+	.rdwr		= 1,
+	.direct		= 0,
+	.open		= mmap_open,
+	.read_lines	= mmap_read,
+	.write_lines	= mmap_write,
+	.map		= mmap_map,
+	.close		= mmap_close,
+};
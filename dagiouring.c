@@ -0,0 +1,339 @@
+/*
+ * dagiouring.c - DAG I/O backend: io_uring
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * We talk to the kernel directly, so that we don't depend on liburing. Each
+ * request is split into per-file segments, which are all submitted at once,
+ * so a large request on a striped DAG keeps all the disks busy.
+ *
+ * A ring can only be used by one thread at a time. Threads pick one of
+ * several rings per handle, so that readers (e.g., dagverify) don't have to
+ * wait for each other.
+ */
+
+#define _GNU_SOURCE	/* for syscall */
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagiobe.h"
+
+
+#define	RINGS		8
+#define	QUEUE_DEPTH	64
+
+
+struct ring {
+	pthread_mutex_t	mutex;
+	int		fd;
+	unsigned	entries;
+
+	unsigned	*sq_tail;
+	unsigned	*sq_mask;
+	unsigned	*sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned	*cq_head;
+	unsigned	*cq_tail;
+	unsigned	*cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void		*sq_ring;
+	size_t		sq_ring_bytes;
+	void		*cq_ring;	/* may be the same as sq_ring */
+	size_t		cq_ring_bytes;
+	size_t		sqes_bytes;
+};
+
+struct uring_priv {
+	struct ring	ring[RINGS];
+	unsigned	next;		/* ring to try first */
+};
+
+
+/* ----- Ring setup -------------------------------------------------------- */
+
+
+static int ring_setup(struct ring *r)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &p);
+	if (r->fd < 0)
+		return -1;
+	r->entries = p.sq_entries;
+
+	r->sq_ring_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_bytes = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_bytes > r->sq_ring_bytes)
+			r->sq_ring_bytes = r->cq_ring_bytes;
+		r->cq_ring_bytes = r->sq_ring_bytes;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_bytes, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_bytes,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+		    IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+	r->sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_bytes, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+	pthread_mutex_init(&r->mutex, NULL);
+	return 0;
+
+fail_cq:
+	err = errno;
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_bytes);
+	errno = err;
+fail_sq:
+	err = errno;
+	munmap(r->sq_ring, r->sq_ring_bytes);
+	errno = err;
+fail:
+	err = errno;
+	(void) close(r->fd);
+	errno = err;
+	return -1;
+}
+
+
+static void ring_free(struct ring *r)
+{
+	munmap(r->sqes, r->sqes_bytes);
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_bytes);
+	munmap(r->sq_ring, r->sq_ring_bytes);
+	(void) close(r->fd);
+	pthread_mutex_destroy(&r->mutex);
+}
+
+
+/* ----- I/O --------------------------------------------------------------- */
+
+
+static struct ring *get_ring(struct uring_priv *p)
+{
+	unsigned first = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+	unsigned i;
+	struct ring *r;
+
+	for (i = 0; i != RINGS; i++) {
+		r = p->ring + (first + i) % RINGS;
+		if (!pthread_mutex_trylock(&r->mutex))
+			return r;
+	}
+	r = p->ring + first % RINGS;
+	pthread_mutex_lock(&r->mutex);
+	return r;
+}
+
+
+static void queue(const struct dag_handle *h, struct ring *r,
+    const struct dagio_segment *s, unsigned i, bool write)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = r->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = h->fd[s->file];
+	sqe->addr = (uintptr_t) s->buf;
+	sqe->len = s->bytes;
+	sqe->off = s->pos;
+	sqe->user_data = i;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Like read(2) and write(2), a request can complete with fewer bytes than
+ * asked for. We then queue the rest of the segment again, advancing it in
+ * place.
+ */
+
+static void submit_wait(const struct dag_handle *h, struct ring *r,
+    struct dagio_segment *seg, unsigned n, bool write)
+{
+	unsigned head, done, again, i;
+	const struct io_uring_cqe *cqe;
+	struct dagio_segment *s;
+	int got;
+
+	for (i = 0; i != n; i++)
+		queue(h, r, seg + i, i, write);
+
+	got = syscall(__NR_io_uring_enter, r->fd, n, n,
+	    IORING_ENTER_GETEVENTS, NULL, 0);
+	for (done = 0; done != n; ) {
+		if (got < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+		again = 0;
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = r->cqes + (head & *r->cq_mask);
+			s = seg + cqe->user_data;
+			if (cqe->res < 0) {
+				fprintf(stderr, "%s: %s\n", h->name[s->file],
+				    strerror(-cqe->res));
+				exit(1);
+			}
+			if (!cqe->res) {
+				fprintf(stderr, "%s: short %s (at %llu)\n",
+				    h->name[s->file],
+				    write ? "write" : "read",
+				    (unsigned long long) s->pos);
+				exit(1);
+			}
+			if ((size_t) cqe->res != s->bytes) {
+				s->buf += cqe->res;
+				s->pos += cqe->res;
+				s->bytes -= cqe->res;
+				queue(h, r, s, cqe->user_data, write);
+				again++;
+			} else {
+				done++;
+			}
+			head++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		if (done != n)
+			got = syscall(__NR_io_uring_enter, r->fd, again,
+			    n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+}
+
+
+static void uring_rw(struct dag_handle *h, uint8_t *buf, uint32_t lines,
+    uint32_t dag_line, bool write)
+{
+	struct dagio_segment seg_buf[4];
+	struct dagio_segment *seg = seg_buf;
+	unsigned max = dagio_max_segments(h, lines);
+	struct ring *r;
+	unsigned n, i, batch;
+
+	if (max > sizeof(seg_buf) / sizeof(*seg_buf))
+		seg = alloc_size(sizeof(struct dagio_segment) * max);
+	n = dagio_segments(h, seg, buf, lines, dag_line);
+	r = get_ring(h->priv);
+	for (i = 0; i < n; i += batch) {
+		batch = n - i < r->entries ? n - i : r->entries;
+		submit_wait(h, r, seg + i, batch, write);
+	}
+	pthread_mutex_unlock(&r->mutex);
+	if (seg != seg_buf)
+		free(seg);
+}
+
+
+/* ----- Operations -------------------------------------------------------- */
+
+
+static int uring_open(struct dag_handle *h)
+{
+	struct uring_priv *p = alloc_type(struct uring_priv);
+	unsigned i;
+	int err;
+
+	for (i = 0; i != RINGS; i++)
+		if (ring_setup(p->ring + i) < 0) {
+			err = errno;
+			while (i--)
+				ring_free(p->ring + i);
+			free(p);
+			errno = err;
+			return -1;
+		}
+	p->next = 0;
+	h->priv = p;
+	return 0;
+}
+
+
+static void uring_read(struct dag_handle *h, void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	uring_rw(h, buf, lines, dag_line, 0);
+}
+
+
+static void uring_write(struct dag_handle *h, const void *buf,
+    uint32_t lines, uint32_t dag_line)
+{
+	uring_rw(h, (uint8_t *) buf, lines, dag_line, 1);
+}
+
+
+static const void *uring_map(struct dag_handle *h)
+{
+	return NULL;
+}
+
+
+static void uring_close(struct dag_handle *h)
+{
+	struct uring_priv *p = h->priv;
+	unsigned i;
+
+	for (i = 0; i != RINGS; i++)
+		ring_free(p->ring + i);
+	free(p);
+}
+
+
+const struct dagio_ops dagio_uring_ops = {
+	.name		= "uring",
+	.files		= 1,
+	.rdwr		= 0,
+	.direct		= 1,
+	.open		= uring_open,
+	.read_lines	= uring_read,
+	.write_lines	= uring_write,
+	.map		= uring_map,
+	.close		= uring_close,
+};
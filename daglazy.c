@@ -0,0 +1,333 @@
+/*
+ * daglazy.c - DAG generated on demand, through userfaultfd
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "daglazy.h"
+
+
+#ifndef UFFD_USER_MODE_ONLY
+#define	UFFD_USER_MODE_ONLY	1	/* Linux 5.11 */
+#endif
+
+
+struct daglazy {
+	uint8_t		*dag;
+	size_t		length;		/* mapped, multiple of page */
+	unsigned	full_lines;
+	const uint8_t	*cache;
+	unsigned	cache_bytes;
+	size_t		page;
+	uint64_t	pages;
+	uint8_t		*present;	/* per page, set once it's filled */
+	int		uffd;
+	int		stop[2];	/* pipe to stop the fault handler */
+
+	pthread_t	handler;
+	pthread_t	*fillers;
+	unsigned	threads;
+	uint64_t	next;		/* next page to fill */
+	unsigned	running;	/* fillers still running */
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+
+	uint64_t	demand;
+	uint64_t	background;
+};
+
+
+/* ----- Filling pages ----------------------------------------------------- */
+
+
+/*
+ * Generate one page into "buf" and move it into place. Returns 1 if we
+ * placed the page, 0 if it was already there.
+ */
+
+static bool fill(struct daglazy *l, uint64_t n, uint8_t *buf)
+{
+	unsigned lines = l->page / DAG_LINE_BYTES;
+	unsigned first = n * lines;
+	struct uffdio_copy copy = {
+		.dst	= (uintptr_t) l->dag + n * l->page,
+		.src	= (uintptr_t) buf,
+		.len	= l->page,
+		.mode	= 0,
+	};
+	struct uffdio_range range = {
+		.start	= copy.dst,
+		.len	= l->page,
+	};
+
+	if (first + lines > l->full_lines) {
+		/* last page, beyond the end of the DAG */
+		lines = l->full_lines - first;
+		memset(buf + lines * DAG_LINE_BYTES, 0,
+		    l->page - lines * DAG_LINE_BYTES);
+	}
+	calc_dataset_range(buf, first, lines, l->cache, l->cache_bytes);
+	if (!ioctl(l->uffd, UFFDIO_COPY, &copy)) {
+		__atomic_store_n(l->present + n, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if (errno != EEXIST) {
+		perror("UFFDIO_COPY");
+		exit(1);
+	}
+	/*
+	 * Someone else was faster. A thread waiting for this page may have
+	 * been woken already, but waking it again does no harm.
+	 */
+	if (ioctl(l->uffd, UFFDIO_WAKE, &range) < 0) {
+		perror("UFFDIO_WAKE");
+		exit(1);
+	}
+	return 0;
+}
+
+
+static void *handler_thread(void *arg)
+{
+	struct daglazy *l = arg;
+	uint8_t *buf = alloc_size(l->page);
+	struct pollfd fds[2] = {
+		{ .fd = l->uffd,	.events = POLLIN },
+		{ .fd = l->stop[0],	.events = POLLIN },
+	};
+	struct uffd_msg msg;
+	ssize_t got;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+		if (fds[1].revents)
+			break;
+		got = read(l->uffd, &msg, sizeof(msg));
+		if (got < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("userfaultfd");
+			exit(1);
+		}
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+		if (fill(l, (msg.arg.pagefault.address - (uintptr_t) l->dag) /
+		    l->page, buf))
+			__atomic_add_fetch(&l->demand, 1, __ATOMIC_RELAXED);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+static void *fill_thread(void *arg)
+{
+	struct daglazy *l = arg;
+	uint8_t *buf = alloc_size(l->page);
+	uint64_t n;
+
+	while (1) {
+		n = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+		if (n >= l->pages)
+			break;
+		if (__atomic_load_n(l->present + n, __ATOMIC_RELAXED))
+			continue;
+		if (fill(l, n, buf))
+			__atomic_add_fetch(&l->background, 1,
+			    __ATOMIC_RELAXED);
+	}
+	free(buf);
+
+	pthread_mutex_lock(&l->mutex);
+	if (!--l->running)
+		pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->mutex);
+	return NULL;
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+static int open_uffd(void)
+{
+	struct uffdio_api api = {
+		.api		= UFFD_API,
+		.features	= 0,
+	};
+	int fd, err;
+
+	/*
+	 * Handling faults from the kernel too (e.g., write(2) from the DAG)
+	 * may need privilege. Without it, we settle for user space faults.
+	 */
+	fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0 && errno == EPERM)
+		fd = syscall(SYS_userfaultfd,
+		    O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, UFFDIO_API, &api) < 0) {
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+
+static void start(pthread_t *t, void *(*fn)(void *), void *arg)
+{
+	int err;
+
+	err = pthread_create(t, NULL, fn, arg);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+}
+
+
+struct daglazy *daglazy_new(unsigned full_lines, const uint8_t *cache,
+    unsigned cache_bytes, unsigned threads)
+{
+	struct daglazy *l;
+	struct uffdio_register reg;
+	size_t bytes = (size_t) full_lines * DAG_LINE_BYTES;
+	unsigned i;
+	int err;
+
+	l = alloc_type(struct daglazy);
+	l->page = sysconf(_SC_PAGESIZE);
+	l->length = (bytes + l->page - 1) / l->page * l->page;
+	l->pages = l->length / l->page;
+	l->full_lines = full_lines;
+	l->cache = cache;
+	l->cache_bytes = cache_bytes;
+
+	l->uffd = open_uffd();
+	if (l->uffd < 0)
+		goto fail;
+	l->dag = mmap(NULL, l->length, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (l->dag == MAP_FAILED)
+		goto fail_uffd;
+	reg.range.start = (uintptr_t) l->dag;
+	reg.range.len = l->length;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if (ioctl(l->uffd, UFFDIO_REGISTER, &reg) < 0)
+		goto fail_map;
+	if (pipe(l->stop) < 0)
+		goto fail_map;
+
+	l->present = alloc_size(l->pages);
+	memset(l->present, 0, l->pages);
+	l->demand = l->background = 0;
+	l->next = 0;
+	pthread_mutex_init(&l->mutex, NULL);
+	pthread_cond_init(&l->cond, NULL);
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!threads)
+		threads = 1;
+	l->threads = l->running = threads;
+	start(&l->handler, handler_thread, l);
+	l->fillers = alloc_size(sizeof(pthread_t) * threads);
+	for (i = 0; i != threads; i++)
+		start(l->fillers + i, fill_thread, l);
+	return l;
+
+fail_map:
+	err = errno;
+	munmap(l->dag, l->length);
+	errno = err;
+fail_uffd:
+	err = errno;
+	(void) close(l->uffd);
+	errno = err;
+fail:
+	free(l);
+	return NULL;
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+const uint8_t *daglazy_addr(const struct daglazy *l)
+{
+	return l->dag;
+}
+
+
+void daglazy_wait(struct daglazy *l)
+{
+	pthread_mutex_lock(&l->mutex);
+	while (l->running)
+		pthread_cond_wait(&l->cond, &l->mutex);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+
+void daglazy_stats(const struct daglazy *l, struct daglazy_stats *s)
+{
+	s->demand = __atomic_load_n(&l->demand, __ATOMIC_RELAXED);
+	s->background = __atomic_load_n(&l->background, __ATOMIC_RELAXED);
+	s->pages = l->pages;
+}
+
+
+void daglazy_free(struct daglazy *l)
+{
+	unsigned i;
+
+	/* stop filling early */
+	__atomic_store_n(&l->next, l->pages, __ATOMIC_RELAXED);
+	for (i = 0; i != l->threads; i++)
+		pthread_join(l->fillers[i], NULL);
+	if (write(l->stop[1], "", 1) != 1) {
+		perror("write");
+		exit(1);
+	}
+	pthread_join(l->handler, NULL);
+
+	(void) close(l->stop[0]);
+	(void) close(l->stop[1]);
+	(void) close(l->uffd);
+	if (munmap(l->dag, l->length) < 0)
+		perror("munmap");
+	pthread_cond_destroy(&l->cond);
+	pthread_mutex_destroy(&l->mutex);
+	free(l->fillers);
+	free(l->present);
+	free(l);
+}
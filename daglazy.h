@@ -0,0 +1,58 @@
+/*
+ * daglazy.h - DAG generated on demand, through userfaultfd
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGLAZY_H
+#define	LIBDAG_DAGLAZY_H
+
+/*
+ * A lazy DAG can be used as soon as it is created. Background threads fill
+ * it from start to end. If a hashing thread touches a page that isn't there
+ * yet, it is suspended until the page has been generated for it.
+ *
+ * The DAG is a plain pointer, so hashimoto and friends don't need to know.
+ *
+ * This includes access by the kernel, e.g., write(2) or O_DIRECT I/O from
+ * the DAG, unless the process may not handle kernel page faults (no
+ * CAP_SYS_PTRACE, and vm.unprivileged_userfaultfd = 0). Then such system
+ * calls fail with EFAULT on pages that aren't there yet, and callers have to
+ * daglazy_wait first.
+ */
+
+#include <stdint.h>
+
+
+struct daglazy;
+
+struct daglazy_stats {
+	uint64_t	demand;		/* pages generated for a page fault */
+	uint64_t	background;	/* pages filled in the background */
+	uint64_t	pages;		/* total pages */
+};
+
+
+/*
+ * "threads" is the number of background threads, 0 for one per CPU. The
+ * cache must remain valid until the DAG is freed. Returns NULL and sets
+ * errno if userfaultfd is not available.
+ */
+struct daglazy *daglazy_new(unsigned full_lines, const uint8_t *cache,
+    unsigned cache_bytes, unsigned threads);
+
+const uint8_t *daglazy_addr(const struct daglazy *l);
+
+/*
+ * Wait until the background threads have filled the whole DAG.
+ */
+void daglazy_wait(struct daglazy *l);
+
+void daglazy_stats(const struct daglazy *l, struct daglazy_stats *s);
+
+void daglazy_free(struct daglazy *l);
+
+#endif /* !LIBDAG_DAGLAZY_H */
@@ -0,0 +1,450 @@
+/*
+ * dagmeta.c - Self-describing DAG metadata with per-chunk checksums
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "dagio.h"
+#include "dagmeta.h"
+#include "dagprof.h"
+
+
+/* ----- XXH64 ------------------------------------------------------------- */
+
+/*
+ * XXH64 by Yann Collet, https://github.com/Cyan4973/xxHash
+ * Only the one-shot variant, and only for little-endian hosts.
+ */
+
+#define	P64_1	0x9e3779b185ebca87ULL
+#define	P64_2	0xc2b2ae3d27d4eb4fULL
+#define	P64_3	0x165667b19e3779f9ULL
+#define	P64_4	0x85ebca77c2b2ae63ULL
+#define	P64_5	0x27d4eb2f165667c5ULL
+
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * P64_2;
+	acc = rotl64(acc, 31);
+	return acc * P64_1;
+}
+
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * P64_1 + P64_4;
+}
+
+
+uint64_t dagmeta_checksum(const void *buf, size_t bytes)
+{
+	const uint8_t *p = buf;
+	const uint8_t *end = p + bytes;
+	uint64_t h;
+
+	if (bytes >= 32) {
+		uint64_t v1 = P64_1 + P64_2;
+		uint64_t v2 = P64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -P64_1;
+
+		while (p + 32 <= end) {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) +
+		    rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = P64_5;
+	}
+	h += bytes;
+	while (p + 8 <= end) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * P64_1 + P64_4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t) read32(p) * P64_1;
+		h = rotl64(h, 23) * P64_2 + P64_3;
+		p += 4;
+	}
+	while (p != end) {
+		h ^= *p++ * P64_5;
+		h = rotl64(h, 11) * P64_1;
+	}
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+/* ----- Metadata ---------------------------------------------------------- */
+
+
+char *dagmeta_path(const char *dag_name)
+{
+	char *s;
+
+	if (asprintf(&s, "%s.meta", dag_name) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return s;
+}
+
+
+static unsigned chunks(unsigned full_lines, unsigned chunk_lines)
+{
+	return (full_lines + chunk_lines - 1) / chunk_lines;
+}
+
+
+struct dagmeta *dagmeta_new(enum dag_algo algo, unsigned epoch,
+    unsigned full_lines, const uint8_t *seedhash, unsigned chunk_lines)
+{
+	struct dagmeta *m = alloc_type(struct dagmeta);
+	struct dagmeta_header *hdr = &m->hdr;
+
+	if (!chunk_lines)
+		chunk_lines = DAGMETA_CHUNK_LINES;
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, DAGMETA_MAGIC, sizeof(hdr->magic));
+	hdr->version = DAGMETA_VERSION;
+	hdr->algo = algo;
+	hdr->epoch = epoch;
+	hdr->full_lines = full_lines;
+	hdr->chunk_lines = chunk_lines;
+	hdr->chunks = chunks(full_lines, chunk_lines);
+	memcpy(hdr->seedhash, seedhash, SEED_BYTES);
+	m->sum = alloc_size(sizeof(uint64_t) * hdr->chunks);
+	memset(m->sum, 0, sizeof(uint64_t) * hdr->chunks);
+	return m;
+}
+
+
+void dagmeta_free(struct dagmeta *m)
+{
+	free(m->sum);
+	free(m);
+}
+
+
+void dagmeta_sum(struct dagmeta *m, const void *buf, uint32_t lines,
+    uint32_t dag_line)
+{
+	unsigned chunk_lines = m->hdr.chunk_lines;
+	unsigned n;
+
+	assert(!(dag_line % chunk_lines));
+	assert(dag_line + lines <= m->hdr.full_lines);
+	while (lines) {
+		n = lines < chunk_lines ? lines : chunk_lines;
+		assert(n == chunk_lines || dag_line + n == m->hdr.full_lines);
+		m->sum[dag_line / chunk_lines] =
+		    dagmeta_checksum(buf, (size_t) n * DAG_LINE_BYTES);
+		buf += (size_t) n * DAG_LINE_BYTES;
+		dag_line += n;
+		lines -= n;
+	}
+}
+
+
+static uint64_t table_sum(const struct dagmeta *m)
+{
+	size_t table = sizeof(uint64_t) * m->hdr.chunks;
+	uint8_t *tmp = alloc_size(sizeof(m->hdr) + table);
+	uint64_t sum;
+
+	memcpy(tmp, &m->hdr, sizeof(m->hdr));
+	memcpy(tmp + sizeof(m->hdr), m->sum, table);
+	sum = dagmeta_checksum(tmp, sizeof(m->hdr) + table);
+	free(tmp);
+	return sum;
+}
+
+
+void dagmeta_write(const struct dagmeta *m, const char *path)
+{
+	uint64_t sum = table_sum(m);
+	FILE *file;
+
+	file = fopen(path, "w");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	if (fwrite(&m->hdr, sizeof(m->hdr), 1, file) != 1 ||
+	    fwrite(m->sum, sizeof(uint64_t), m->hdr.chunks, file) !=
+	    m->hdr.chunks ||
+	    fwrite(&sum, sizeof(sum), 1, file) != 1) {
+		perror(path);
+		exit(1);
+	}
+	if (fclose(file) < 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+
+void dagmeta_remove(const char *path)
+{
+	if (unlink(path) < 0 && errno != ENOENT) {
+		perror(path);
+		exit(1);
+	}
+}
+
+
+static bool valid_header(const struct dagmeta_header *hdr)
+{
+	return !memcmp(hdr->magic, DAGMETA_MAGIC, sizeof(hdr->magic)) &&
+	    hdr->version == DAGMETA_VERSION && hdr->algo < dag_algos &&
+	    hdr->chunk_lines &&
+	    hdr->chunks == chunks(hdr->full_lines, hdr->chunk_lines);
+}
+
+
+struct dagmeta *dagmeta_read(const char *path)
+{
+	struct dagmeta *m;
+	struct dagmeta_header hdr;
+	uint64_t sum;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		return NULL;
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1)
+		goto invalid;
+	if (!valid_header(&hdr))
+		goto invalid;
+
+	m = alloc_type(struct dagmeta);
+	m->hdr = hdr;
+	m->sum = alloc_size(sizeof(uint64_t) * hdr.chunks);
+	if (fread(m->sum, sizeof(uint64_t), hdr.chunks, file) != hdr.chunks ||
+	    fread(&sum, sizeof(sum), 1, file) != 1 || sum != table_sum(m)) {
+		dagmeta_free(m);
+		goto invalid;
+	}
+	fclose(file);
+	return m;
+
+invalid:
+	fclose(file);
+	errno = EINVAL;
+	return NULL;
+}
+
+
+void *dagmeta_pack(const struct dagmeta *m, size_t *bytes)
+{
+	size_t table = sizeof(uint64_t) * m->hdr.chunks;
+	uint64_t sum = table_sum(m);
+	uint8_t *buf;
+
+	*bytes = sizeof(m->hdr) + table + sizeof(sum);
+	buf = alloc_size(*bytes);
+	memcpy(buf, &m->hdr, sizeof(m->hdr));
+	memcpy(buf + sizeof(m->hdr), m->sum, table);
+	memcpy(buf + sizeof(m->hdr) + table, &sum, sizeof(sum));
+	return buf;
+}
+
+
+struct dagmeta *dagmeta_unpack(const void *buf, size_t bytes)
+{
+	const uint8_t *p = buf;
+	struct dagmeta *m;
+	struct dagmeta_header hdr;
+	size_t table;
+	uint64_t sum;
+
+	if (bytes < sizeof(hdr))
+		goto invalid;
+	memcpy(&hdr, p, sizeof(hdr));
+	if (!valid_header(&hdr))
+		goto invalid;
+	table = sizeof(uint64_t) * hdr.chunks;
+	if (bytes != sizeof(hdr) + table + sizeof(sum))
+		goto invalid;
+
+	m = alloc_type(struct dagmeta);
+	m->hdr = hdr;
+	m->sum = alloc_size(table);
+	memcpy(m->sum, p + sizeof(hdr), table);
+	memcpy(&sum, p + sizeof(hdr) + table, sizeof(sum));
+	if (sum != table_sum(m)) {
+		dagmeta_free(m);
+		goto invalid;
+	}
+	return m;
+
+invalid:
+	errno = EINVAL;
+	return NULL;
+}
+
+
+bool dagmeta_match(const struct dagmeta *m, enum dag_algo algo,
+    unsigned epoch, unsigned full_lines)
+{
+	return m->hdr.algo == algo && m->hdr.epoch == epoch &&
+	    m->hdr.full_lines == full_lines;
+}
+
+
+/* ----- Parallel verification --------------------------------------------- */
+
+
+struct verify {
+	const struct dagmeta *m;
+	const uint8_t	*dag;		/* memory-based DAG, or ... */
+	struct dag_handle *h;		/* ... file-based DAG */
+	unsigned	next;		/* next chunk to check */
+	unsigned	bad_chunks;
+	pthread_mutex_t	mutex;
+	void (*bad)(void *user, uint32_t dag_line, uint32_t lines);
+	void		*user;
+};
+
+
+static void *verify_thread(void *arg)
+{
+	struct verify *v = arg;
+	const struct dagmeta_header *hdr = &v->m->hdr;
+	uint8_t *buf = NULL;
+	const uint8_t *p;
+	unsigned chunk, lines;
+	uint32_t dag_line;
+
+	if (v->h)
+		buf = alloc_size((size_t) hdr->chunk_lines * DAG_LINE_BYTES);
+	dagprof_begin(dp_verify);
+	while (1) {
+		chunk = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED);
+		if (chunk >= hdr->chunks)
+			break;
+		dag_line = chunk * hdr->chunk_lines;
+		lines = hdr->full_lines - dag_line;
+		if (lines > hdr->chunk_lines)
+			lines = hdr->chunk_lines;
+		if (v->h) {
+			dagio_pread(v->h, buf, lines, dag_line);
+			p = buf;
+		} else {
+			p = v->dag + (size_t) dag_line * DAG_LINE_BYTES;
+		}
+		if (dagmeta_checksum(p, (size_t) lines * DAG_LINE_BYTES) ==
+		    v->m->sum[chunk])
+			continue;
+		pthread_mutex_lock(&v->mutex);
+		v->bad_chunks++;
+		if (v->bad)
+			v->bad(v->user, dag_line, lines);
+		pthread_mutex_unlock(&v->mutex);
+	}
+	dagprof_end(dp_verify);
+	free(buf);
+	return NULL;
+}
+
+
+static unsigned verify(struct verify *v, unsigned threads)
+{
+	pthread_t *t;
+	unsigned i;
+	int err;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!threads)
+		threads = 1;
+	v->next = 0;
+	v->bad_chunks = 0;
+	pthread_mutex_init(&v->mutex, NULL);
+	t = alloc_size(sizeof(pthread_t) * threads);
+	for (i = 0; i != threads; i++) {
+		err = pthread_create(t + i, NULL, verify_thread, v);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+	pthread_mutex_destroy(&v->mutex);
+	return v->bad_chunks;
+}
+
+
+unsigned dagmeta_verify_mem(const struct dagmeta *m, const void *dag,
+    unsigned threads,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user)
+{
+	struct verify v = {
+		.m	= m,
+		.dag	= dag,
+		.h	= NULL,
+		.bad	= bad,
+		.user	= user,
+	};
+
+	return verify(&v, threads);
+}
+
+
+unsigned dagmeta_verify_dh(const struct dagmeta *m, struct dag_handle *h,
+    unsigned threads,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user)
+{
+	struct verify v = {
+		.m	= m,
+		.dag	= NULL,
+		.h	= h,
+		.bad	= bad,
+		.user	= user,
+	};
+
+	return verify(&v, threads);
+}
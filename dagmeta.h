@@ -0,0 +1,119 @@
+/*
+ * dagmeta.h - Self-describing DAG metadata with per-chunk checksums
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGMETA_H
+#define	LIBDAG_DAGMETA_H
+
+/*
+ * The metadata lives in a sidecar file next to the DAG, "<dag-file>.meta",
+ * so that the DAG files themselves keep their raw layout. The sidecar
+ * contains a struct dagmeta_header, followed by one 64-bit checksum per
+ * chunk, followed by a checksum of everything before it. All fields are
+ * little-endian.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dag.h"
+#include "dagalgo.h"
+
+
+#define	DAGMETA_MAGIC		"LDAGMETA"
+#define	DAGMETA_VERSION		1
+#define	DAGMETA_CHUNK_LINES	(1 << 15)	/* 4 MB */
+
+
+struct dag_handle;
+
+struct dagmeta_header {
+	char		magic[8];	/* DAGMETA_MAGIC, not NUL-terminated */
+	uint32_t	version;	/* DAGMETA_VERSION */
+	uint32_t	algo;		/* enum dag_algo */
+	uint32_t	epoch;		/* epoch of "algo" */
+	uint32_t	full_lines;
+	uint32_t	chunk_lines;
+	uint32_t	chunks;
+	uint8_t		seedhash[SEED_BYTES];
+};
+
+struct dagmeta {
+	struct dagmeta_header hdr;
+	uint64_t	*sum;		/* hdr.chunks entries */
+};
+
+
+/*
+ * Checksum of a block of data (XXH64, seed 0).
+ */
+uint64_t dagmeta_checksum(const void *buf, size_t bytes);
+
+/*
+ * Returns the name of the sidecar file. The caller has to free it.
+ */
+char *dagmeta_path(const char *dag_name);
+
+/*
+ * chunk_lines = 0 selects DAGMETA_CHUNK_LINES.
+ */
+struct dagmeta *dagmeta_new(enum dag_algo algo, unsigned epoch,
+    unsigned full_lines, const uint8_t *seedhash, unsigned chunk_lines);
+void dagmeta_free(struct dagmeta *m);
+
+/*
+ * Record the checksums of freshly generated lines. "dag_line" must be at a
+ * chunk boundary, and "lines" must cover whole chunks, except for the last
+ * chunk of the DAG.
+ */
+void dagmeta_sum(struct dagmeta *m, const void *buf, uint32_t lines,
+    uint32_t dag_line);
+
+void dagmeta_write(const struct dagmeta *m, const char *path);
+
+/*
+ * Remove the sidecar, if there is one. Tools that rewrite a DAG without
+ * describing it must do this, or the old sidecar would still match the new
+ * DAG's size.
+ */
+void dagmeta_remove(const char *path);
+
+/*
+ * Returns NULL and sets errno if the file can't be read, or if it is not a
+ * valid sidecar (EINVAL).
+ */
+struct dagmeta *dagmeta_read(const char *path);
+
+/*
+ * The sidecar format in memory, e.g., for sending it over the network. The
+ * caller has to free the buffer. dagmeta_unpack returns NULL and sets errno
+ * to EINVAL if the data is not valid.
+ */
+void *dagmeta_pack(const struct dagmeta *m, size_t *bytes);
+struct dagmeta *dagmeta_unpack(const void *buf, size_t bytes);
+
+/*
+ * Check if metadata describes the DAG we expect.
+ */
+bool dagmeta_match(const struct dagmeta *m, enum dag_algo algo,
+    unsigned epoch, unsigned full_lines);
+
+/*
+ * Verify the DAG against the checksums, with "threads" threads (0 for one
+ * per CPU). For each bad chunk, "bad" is called (serialized) with the range
+ * of lines it covers. Returns the number of bad chunks.
+ */
+unsigned dagmeta_verify_mem(const struct dagmeta *m, const void *dag,
+    unsigned threads,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user);
+unsigned dagmeta_verify_dh(const struct dagmeta *m, struct dag_handle *h,
+    unsigned threads,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user);
+
+#endif /* !LIBDAG_DAGMETA_H */
@@ -0,0 +1,634 @@
+/*
+ * dagnet.c - Distribute DAGs over TCP
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for MSG_NOSIGNAL */
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagio.h"
+#include "dagiobe.h"
+#include "dagmeta.h"
+#include "dagreg.h"
+#include "dagnet.h"
+
+
+struct request {
+	uint32_t	magic;
+	uint32_t	op;
+	uint32_t	first;
+	uint32_t	lines;
+};
+
+struct response {
+	uint32_t	status;
+	uint32_t	zero;
+	uint64_t	bytes;
+};
+
+
+/* ----- Socket helpers ---------------------------------------------------- */
+
+
+static bool send_all(int fd, const void *buf, size_t bytes)
+{
+	const uint8_t *p = buf;
+	ssize_t sent;
+
+	while (bytes) {
+		sent = send(fd, p, bytes, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return 0;
+		p += sent;
+		bytes -= sent;
+	}
+	return 1;
+}
+
+
+static bool recv_all(int fd, void *buf, size_t bytes)
+{
+	uint8_t *p = buf;
+	ssize_t got;
+
+	while (bytes) {
+		got = recv(fd, p, bytes, MSG_WAITALL);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return 0;
+		p += got;
+		bytes -= got;
+	}
+	return 1;
+}
+
+
+/* ----- Server ------------------------------------------------------------ */
+
+
+/*
+ * Connection threads are detached. When done, each removes its connection
+ * from the list, closes the socket and frees the connection, all under the
+ * mutex. dagnet_server_stop shuts down the sockets still on the list, and
+ * waits until the list is empty.
+ */
+
+struct conn {
+	struct dagnet_server *s;
+	int		fd;
+	struct conn	*next;
+};
+
+struct dagnet_server {
+	struct dag_handle *h;
+	const struct dagmeta *m;
+	void		*meta;		/* packed sidecar */
+	size_t		meta_bytes;
+	uint8_t		*bad;		/* per chunk */
+	unsigned	bad_chunks;
+	int		fd;
+	unsigned	port;
+	pthread_t	thread;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;		/* a connection has ended */
+	bool		stop;
+	struct conn	*conns;
+};
+
+
+static void mark_bad(void *user, uint32_t dag_line, uint32_t lines)
+{
+	struct dagnet_server *s = user;
+
+	s->bad[dag_line / s->m->hdr.chunk_lines] = 1;
+	s->bad_chunks++;
+}
+
+
+static bool range_ok(const struct dagnet_server *s, uint32_t first,
+    uint32_t lines)
+{
+	unsigned chunk_lines = s->m->hdr.chunk_lines;
+	unsigned c;
+
+	for (c = first / chunk_lines; c <= (first + lines - 1) / chunk_lines;
+	    c++)
+		if (s->bad[c])
+			return 0;
+	return 1;
+}
+
+
+/*
+ * Zero-copy if the backend has files. Otherwise, e.g., with "mem", we read
+ * and send. conn_thread limits requests to one chunk, which bounds the
+ * buffer.
+ */
+
+static bool send_lines(struct dagnet_server *s, int fd, uint32_t first,
+    uint32_t lines)
+{
+	struct dag_handle *h = s->h;
+	struct dagio_segment *seg, *sg;
+	unsigned n;
+	bool ok = 1;
+	off_t pos;
+	ssize_t sent;
+	size_t left;
+	uint8_t *buf;
+
+	if (!h->ops->files) {
+		buf = alloc_size((size_t) lines * DAG_LINE_BYTES);
+		dagio_pread(h, buf, lines, first);
+		ok = send_all(fd, buf, (size_t) lines * DAG_LINE_BYTES);
+		free(buf);
+		return ok;
+	}
+	seg = alloc_size(sizeof(struct dagio_segment) *
+	    dagio_max_segments(h, lines));
+	n = dagio_segments(h, seg, NULL, lines, first);
+	for (sg = seg; ok && sg != seg + n; sg++) {
+		pos = sg->pos;
+		left = sg->bytes;
+		while (left) {
+			sent = sendfile(fd, h->fd[sg->file], &pos, left);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0) {
+				ok = 0;
+				break;
+			}
+			left -= sent;
+		}
+	}
+	free(seg);
+	return ok;
+}
+
+
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+	struct dagnet_server *s = c->s;
+	struct conn **anchor;
+	struct request req;
+	struct response res;
+
+	while (recv_all(c->fd, &req, sizeof(req))) {
+		memset(&res, 0, sizeof(res));
+		if (req.magic != DAGNET_MAGIC) {
+			break;
+		} else if (req.op == DAGNET_OP_META) {
+			res.status = DAGNET_OK;
+			res.bytes = s->meta_bytes;
+			if (!send_all(c->fd, &res, sizeof(res)) ||
+			    !send_all(c->fd, s->meta, s->meta_bytes))
+				break;
+		} else if (req.op == DAGNET_OP_LINES && req.lines &&
+		    req.lines <= s->m->hdr.chunk_lines &&
+		    req.first < s->m->hdr.full_lines &&
+		    req.lines <= s->m->hdr.full_lines - req.first) {
+			if (!range_ok(s, req.first, req.lines)) {
+				res.status = DAGNET_BAD;
+				if (!send_all(c->fd, &res, sizeof(res)))
+					break;
+				continue;
+			}
+			res.status = DAGNET_OK;
+			res.bytes = (uint64_t) req.lines * DAG_LINE_BYTES;
+			if (!send_all(c->fd, &res, sizeof(res)) ||
+			    !send_lines(s, c->fd, req.first, req.lines))
+				break;
+		} else {
+			res.status = DAGNET_INVALID;
+			if (!send_all(c->fd, &res, sizeof(res)))
+				break;
+		}
+	}
+
+	pthread_mutex_lock(&s->mutex);
+	for (anchor = &s->conns; *anchor != c; anchor = &(*anchor)->next);
+	*anchor = c->next;
+	(void) close(c->fd);
+	free(c);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+	return NULL;
+}
+
+
+static void *accept_thread(void *arg)
+{
+	struct dagnet_server *s = arg;
+	struct conn *c;
+	pthread_t thread;
+	int fd, one = 1, err;
+
+	while (1) {
+		fd = accept(s->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;	/* stopped */
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c = alloc_type(struct conn);
+		c->s = s;
+		c->fd = fd;
+		pthread_mutex_lock(&s->mutex);
+		if (s->stop) {
+			pthread_mutex_unlock(&s->mutex);
+			(void) close(fd);
+			free(c);
+			break;
+		}
+		c->next = s->conns;
+		s->conns = c;
+		err = pthread_create(&thread, NULL, conn_thread, c);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+		pthread_detach(thread);
+		pthread_mutex_unlock(&s->mutex);
+	}
+	return NULL;
+}
+
+
+static int listen_on(const char *port, unsigned *bound)
+{
+	struct addrinfo hints = {
+		.ai_family	= AF_UNSPEC,
+		.ai_socktype	= SOCK_STREAM,
+		.ai_flags	= AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	int fd = -1, one = 1, err;
+
+	err = getaddrinfo(NULL, port ? port : DAGNET_PORT, &hints, &res);
+	if (err) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+			break;
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		return -1;
+	if (getsockname(fd, (struct sockaddr *) &ss, &len) < 0) {
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		return -1;
+	}
+	*bound = ntohs(ss.ss_family == AF_INET6 ?
+	    ((struct sockaddr_in6 *) &ss)->sin6_port :
+	    ((struct sockaddr_in *) &ss)->sin_port);
+	return fd;
+}
+
+
+struct dagnet_server *dagnet_server_start(struct dag_handle *h,
+    const struct dagmeta *m, const char *port, unsigned threads)
+{
+	struct dagnet_server *s = alloc_type(struct dagnet_server);
+	int err;
+
+	s->fd = listen_on(port, &s->port);
+	if (s->fd < 0) {
+		free(s);
+		return NULL;
+	}
+	s->h = h;
+	s->m = m;
+	s->meta = dagmeta_pack(m, &s->meta_bytes);
+	s->bad = alloc_size(m->hdr.chunks ? m->hdr.chunks : 1);
+	memset(s->bad, 0, m->hdr.chunks);
+	s->bad_chunks = 0;
+	dagmeta_verify_dh(m, h, threads, mark_bad, s);
+	pthread_mutex_init(&s->mutex, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->stop = 0;
+	s->conns = NULL;
+	err = pthread_create(&s->thread, NULL, accept_thread, s);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+	return s;
+}
+
+
+unsigned dagnet_server_port(const struct dagnet_server *s)
+{
+	return s->port;
+}
+
+
+unsigned dagnet_server_bad(const struct dagnet_server *s)
+{
+	return s->bad_chunks;
+}
+
+
+void dagnet_server_stop(struct dagnet_server *s)
+{
+	struct conn *c;
+
+	pthread_mutex_lock(&s->mutex);
+	s->stop = 1;
+	pthread_mutex_unlock(&s->mutex);
+	shutdown(s->fd, SHUT_RDWR);
+	pthread_join(s->thread, NULL);
+	(void) close(s->fd);
+
+	/* no new connections now */
+	pthread_mutex_lock(&s->mutex);
+	for (c = s->conns; c; c = c->next)
+		shutdown(c->fd, SHUT_RDWR);
+	while (s->conns)
+		pthread_cond_wait(&s->cond, &s->mutex);
+	pthread_mutex_unlock(&s->mutex);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->mutex);
+	free(s->meta);
+	free(s->bad);
+	free(s);
+}
+
+
+/* ----- Client ------------------------------------------------------------ */
+
+
+struct fetch {
+	const char	*host;
+	const char	*port;
+	enum dag_algo	algo;
+	unsigned	epoch;
+	struct dag_handle *h;
+	struct dagmeta	*m;
+	bool		remote;		/* "m" came from the server */
+	uint8_t		*map;		/* writable view of "h", or NULL */
+	unsigned	next;		/* next chunk */
+	pthread_mutex_t	mutex;
+	const struct dagreg_entry *cache;
+	unsigned	fetched;
+	unsigned	computed;
+};
+
+struct worker {
+	struct fetch	*f;
+	pthread_t	thread;
+};
+
+
+static int connect_to(const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family	= AF_UNSPEC,
+		.ai_socktype	= SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1;
+
+	if (getaddrinfo(host, port ? port : DAGNET_PORT, &hints, &res))
+		return -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		(void) close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+
+static bool request(int fd, uint32_t op, uint32_t first, uint32_t lines,
+    struct response *res)
+{
+	struct request req = {
+		.magic	= DAGNET_MAGIC,
+		.op	= op,
+		.first	= first,
+		.lines	= lines,
+	};
+
+	return send_all(fd, &req, sizeof(req)) &&
+	    recv_all(fd, res, sizeof(*res));
+}
+
+
+static struct dagmeta *fetch_meta(const char *host, const char *port)
+{
+	struct response res;
+	struct dagmeta *m = NULL;
+	void *buf;
+	int fd;
+
+	fd = connect_to(host, port);
+	if (fd < 0)
+		return NULL;
+	if (request(fd, DAGNET_OP_META, 0, 0, &res) &&
+	    res.status == DAGNET_OK && res.bytes < (1 << 24)) {
+		buf = alloc_size(res.bytes);
+		if (recv_all(fd, buf, res.bytes))
+			m = dagmeta_unpack(buf, res.bytes);
+		free(buf);
+	}
+	(void) close(fd);
+	return m;
+}
+
+
+/*
+ * Returns 1 if the chunk arrived and matches its checksum. On connection
+ * errors, we close the connection and set *fd to -1.
+ */
+
+static bool fetch_chunk(struct fetch *f, int *fd, uint8_t *buf,
+    uint32_t first, uint32_t lines, unsigned chunk)
+{
+	size_t bytes = (size_t) lines * DAG_LINE_BYTES;
+	struct response res;
+
+	if (!request(*fd, DAGNET_OP_LINES, first, lines, &res))
+		goto broken;
+	if (res.status != DAGNET_OK)
+		return 0;
+	if (res.bytes != bytes || !recv_all(*fd, buf, bytes))
+		goto broken;
+	return dagmeta_checksum(buf, bytes) == f->m->sum[chunk];
+
+broken:
+	(void) close(*fd);
+	*fd = -1;
+	return 0;
+}
+
+
+static void compute_chunk(struct fetch *f, uint8_t *buf, uint32_t first,
+    uint32_t lines)
+{
+	const struct dagreg_entry *e;
+
+	pthread_mutex_lock(&f->mutex);
+	if (!f->cache)
+		f->cache = dagreg_cache(f->algo, f->epoch);
+	e = f->cache;
+	pthread_mutex_unlock(&f->mutex);
+	calc_dataset_range(buf, first, lines, e->cache, e->cache_bytes);
+
+	/* what we computed is right, whatever the server said */
+	dagmeta_sum(f->m, buf, lines, first);
+}
+
+
+static void *fetch_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct fetch *f = w->f;
+	unsigned chunk_lines = f->m->hdr.chunk_lines;
+	uint8_t *tmp = NULL;
+	uint8_t *buf;
+	uint32_t first, lines;
+	unsigned chunk;
+	int fd = -1;
+
+	if (f->remote)
+		fd = connect_to(f->host, f->port);
+	if (!f->map)
+		tmp = alloc_size((size_t) chunk_lines * DAG_LINE_BYTES);
+	while (1) {
+		chunk = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED);
+		if (chunk >= f->m->hdr.chunks)
+			break;
+		first = chunk * chunk_lines;
+		lines = f->m->hdr.full_lines - first;
+		if (lines > chunk_lines)
+			lines = chunk_lines;
+		buf = f->map ? f->map + (size_t) first * DAG_LINE_BYTES : tmp;
+		if (fd >= 0 && fetch_chunk(f, &fd, buf, first, lines, chunk)) {
+			__atomic_add_fetch(&f->fetched, 1, __ATOMIC_RELAXED);
+		} else {
+			compute_chunk(f, buf, first, lines);
+			__atomic_add_fetch(&f->computed, 1, __ATOMIC_RELAXED);
+		}
+		if (!f->map)
+			dagio_pwrite(f->h, buf, lines, first);
+	}
+	if (fd >= 0)
+		(void) close(fd);
+	free(tmp);
+	return NULL;
+}
+
+
+struct dagmeta *dagnet_fetch(const char *host, const char *port,
+    enum dag_algo algo, unsigned epoch, struct dag_handle *h,
+    unsigned connections, struct dagnet_fetch_result *res)
+{
+	struct fetch f = {
+		.host		= host,
+		.port		= port,
+		.algo		= algo,
+		.epoch		= epoch,
+		.h		= h,
+		.next		= 0,
+		.cache		= NULL,
+		.fetched	= 0,
+		.computed	= 0,
+	};
+	unsigned full_lines = dagio_full_lines(h);
+	uint8_t seed[SEED_BYTES];
+	struct worker *w;
+	unsigned i;
+	int err;
+
+	f.m = fetch_meta(host, port);
+	if (f.m && !dagmeta_match(f.m, algo, epoch, full_lines)) {
+		dagmeta_free(f.m);
+		f.m = NULL;
+	}
+	f.remote = f.m;
+	if (!f.m) {
+		get_seedhash_algo(seed, algo, epoch);
+		f.m = dagmeta_new(algo, epoch, full_lines, seed, 0);
+	}
+	/* we can only write through the view if the mapping is writable */
+	f.map = (h->mode & O_ACCMODE) == O_RDONLY ? NULL :
+	    (uint8_t *) dagio_map(h);
+	pthread_mutex_init(&f.mutex, NULL);
+
+	if (!connections)
+		connections = 1;
+	w = alloc_size(sizeof(struct worker) * connections);
+	for (i = 0; i != connections; i++) {
+		w[i].f = &f;
+		err = pthread_create(&w[i].thread, NULL, fetch_thread, w + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != connections; i++)
+		pthread_join(w[i].thread, NULL);
+	free(w);
+
+	if (f.cache)
+		dagreg_release_cache(f.cache);
+	pthread_mutex_destroy(&f.mutex);
+	if (res) {
+		res->chunks = f.m->hdr.chunks;
+		res->fetched = f.fetched;
+		res->computed = f.computed;
+	}
+	return f.m;
+}
@@ -0,0 +1,81 @@
+/*
+ * dagnet.h - Distribute DAGs over TCP
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGNET_H
+#define	LIBDAG_DAGNET_H
+
+/*
+ * One node generates the DAG and serves it, the others fetch it. The server
+ * checks the DAG against its sidecar (dagmeta.h) before serving, and sends
+ * lines with sendfile. The client fetches chunks over several connections
+ * in parallel, checks each of them against the sidecar, and computes any
+ * chunk it can't get, or that arrives damaged, itself.
+ *
+ * Protocol (all little-endian): the client sends a request,
+ *
+ *   uint32 magic, uint32 op, uint32 first line, uint32 lines
+ *
+ * and the server answers with
+ *
+ *   uint32 status, uint32 zero, uint64 bytes
+ *
+ * followed by "bytes" bytes: the packed sidecar for DAGNET_OP_META, the
+ * lines for DAGNET_OP_LINES. A DAGNET_OP_LINES request can cover at most one
+ * chunk's worth of lines (chunk_lines in the sidecar).
+ */
+
+#include <stdint.h>
+
+#include "dagalgo.h"
+#include "dagmeta.h"
+
+
+#define	DAGNET_MAGIC		0x52474144	/* "DAGR" */
+#define	DAGNET_PORT		"8546"
+
+#define	DAGNET_OP_META		1
+#define	DAGNET_OP_LINES		2
+
+#define	DAGNET_OK		0
+#define	DAGNET_INVALID		1	/* bad request */
+#define	DAGNET_BAD		2	/* range includes bad chunks */
+
+
+struct dag_handle;
+struct dagnet_server;
+
+struct dagnet_fetch_result {
+	unsigned	chunks;
+	unsigned	fetched;	/* received and good */
+	unsigned	computed;	/* computed locally */
+};
+
+
+/*
+ * Serve the DAG in "h", as described by "m", on "port" (NULL for
+ * DAGNET_PORT, "0" for any). "threads" is for verifying the DAG first (0 for
+ * one per CPU). Returns NULL and sets errno on failure.
+ */
+struct dagnet_server *dagnet_server_start(struct dag_handle *h,
+    const struct dagmeta *m, const char *port, unsigned threads);
+unsigned dagnet_server_port(const struct dagnet_server *s);
+unsigned dagnet_server_bad(const struct dagnet_server *s);
+void dagnet_server_stop(struct dagnet_server *s);
+
+/*
+ * Fill "h" (opened for writing, with the full size of the DAG) with the DAG
+ * of (algo, epoch), using "connections" connections. Returns the sidecar
+ * of the DAG we wrote, which is computed locally if the server can't be
+ * reached.
+ */
+struct dagmeta *dagnet_fetch(const char *host, const char *port,
+    enum dag_algo algo, unsigned epoch, struct dag_handle *h,
+    unsigned connections, struct dagnet_fetch_result *res);
+
+#endif /* !LIBDAG_DAGNET_H */
@@ -0,0 +1,599 @@
+/*
+ * dagnuma.c - NUMA-aware placement of light cache and DAG
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Placement uses libnuma if built with USE_LIBNUMA, else the raw mbind and
+ * set_mempolicy system calls plus the node topology in sysfs. Either way, a
+ * host without NUMA (or where we can't tell) looks like a single node, and
+ * all the placement operations silently become no-ops.
+ */
+
+#define _GNU_SOURCE	/* for sched_setaffinity, CPU_SET */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#ifdef USE_LIBNUMA
+#include <numa.h>
+#else
+#include <linux/mempolicy.h>
+#endif
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagnuma.h"
+
+
+/*
+ * Partitions are rounded to 2 MB, so that transparent huge pages don't
+ * straddle node boundaries.
+ */
+
+#define	PARTITION_LINES	((2 << 20) / DAG_LINE_BYTES)
+
+
+/* ----- Mode names -------------------------------------------------------- */
+
+
+const char *dagnuma_name(enum dagnuma_mode mode)
+{
+	switch (mode) {
+	case dnm_off:
+		return "off";
+	case dnm_partition:
+		return "partition";
+	case dnm_replicate:
+		return "replicate";
+	default:
+		fprintf(stderr, "unknown NUMA mode %u\n", mode);
+		abort();
+	}
+}
+
+
+int dagnuma_code(const char *name)
+{
+	if (!strcmp(name, "off"))
+		return dnm_off;
+	if (!strcmp(name, "partition"))
+		return dnm_partition;
+	if (!strcmp(name, "replicate"))
+		return dnm_replicate;
+	return -1;
+}
+
+
+/* ----- Topology and placement (libnuma) ---------------------------------- */
+
+
+#ifdef USE_LIBNUMA
+
+
+static unsigned sys_nodes(void)
+{
+	if (numa_available() < 0)
+		return 1;
+	return numa_max_node() + 1;
+}
+
+
+static int sys_node(void)
+{
+	int cpu = sched_getcpu();
+
+	return cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+}
+
+
+static unsigned sys_node_cpus(unsigned node, cpu_set_t *set)
+{
+	struct bitmask *mask = numa_allocate_cpumask();
+	unsigned i, n = 0;
+
+	CPU_ZERO(set);
+	if (numa_node_to_cpus(node, mask) == 0)
+		for (i = 0; i != mask->size && i != CPU_SETSIZE; i++)
+			if (numa_bitmask_isbitset(mask, i)) {
+				CPU_SET(i, set);
+				n++;
+			}
+	numa_free_cpumask(mask);
+	return n;
+}
+
+
+static int sys_bind(unsigned node)
+{
+	if (numa_run_on_node(node) < 0)
+		return -1;
+	numa_set_preferred(node);
+	return 0;
+}
+
+
+static void sys_place(void *p, size_t bytes, unsigned node)
+{
+	numa_tonode_memory(p, bytes, node);
+}
+
+
+#else /* USE_LIBNUMA */
+
+
+/*
+ * Parse a sysfs list like "0-3,8-11". If "set" is non-NULL, the entries are
+ * added to it. Returns the number of entries, and the highest entry plus one
+ * in *end.
+ */
+
+static unsigned read_list(const char *path, cpu_set_t *set, unsigned *end)
+{
+	FILE *file;
+	unsigned a, b, i, n = 0;
+	int c;
+
+	*end = 0;
+	file = fopen(path, "r");
+	if (!file)
+		return 0;
+	while (fscanf(file, "%u", &a) == 1) {
+		b = a;
+		c = fgetc(file);
+		if (c == '-') {
+			if (fscanf(file, "%u", &b) != 1)
+				break;
+			c = fgetc(file);
+		}
+		for (i = a; i <= b; i++) {
+			if (set && i < CPU_SETSIZE)
+				CPU_SET(i, set);
+			n++;
+		}
+		if (b + 1 > *end)
+			*end = b + 1;
+		if (c != ',')
+			break;
+	}
+	fclose(file);
+	return n;
+}
+
+
+static unsigned sys_nodes(void)
+{
+	unsigned end;
+
+	if (!read_list("/sys/devices/system/node/online", NULL, &end))
+		return 1;
+	return end;
+}
+
+
+static int sys_node(void)
+{
+	unsigned cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return -1;
+	return node;
+}
+
+
+static unsigned sys_node_cpus(unsigned node, cpu_set_t *set)
+{
+	char path[64];
+	unsigned end;
+
+	CPU_ZERO(set);
+	sprintf(path, "/sys/devices/system/node/node%u/cpulist", node);
+	return read_list(path, set, &end);
+}
+
+
+static int sys_bind(unsigned node)
+{
+	unsigned long mask = 1UL << node;
+	cpu_set_t set;
+
+	if (!sys_node_cpus(node, &set))
+		return -1;
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		return -1;
+	/* failure only means allocations may land elsewhere */
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+	    sizeof(mask) * 8 + 1);
+	return 0;
+}
+
+
+static void sys_place(void *p, size_t bytes, unsigned node)
+{
+	unsigned long mask = 1UL << node;
+
+	syscall(SYS_mbind, p, bytes, MPOL_BIND, &mask, sizeof(mask) * 8 + 1,
+	    0);
+}
+
+
+#endif /* !USE_LIBNUMA */
+
+
+/* ----- Topology and placement -------------------------------------------- */
+
+
+unsigned dagnuma_nodes(void)
+{
+	static unsigned nodes = 0;
+
+	if (!nodes) {
+		nodes = sys_nodes();
+		if (!nodes)
+			nodes = 1;
+		if (nodes > DAGNUMA_MAX_NODES)
+			nodes = DAGNUMA_MAX_NODES;
+	}
+	return nodes;
+}
+
+
+unsigned dagnuma_node(void)
+{
+	int node;
+
+	if (dagnuma_nodes() == 1)
+		return 0;
+	node = sys_node();
+	return node < 0 || (unsigned) node >= dagnuma_nodes() ? 0 : node;
+}
+
+
+int dagnuma_bind(unsigned node)
+{
+	if (dagnuma_nodes() == 1)
+		return 0;
+	return sys_bind(node);
+}
+
+
+void *dagnuma_alloc(size_t bytes, int node)
+{
+	void *p;
+
+	p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	if (node >= 0 && dagnuma_nodes() > 1)
+		sys_place(p, bytes, node);
+	return p;
+}
+
+
+void dagnuma_free(void *p, size_t bytes)
+{
+	if (munmap(p, bytes) < 0) {
+		perror("munmap");
+		exit(1);
+	}
+}
+
+
+/* ----- Replication ------------------------------------------------------- */
+
+
+static struct dagnuma_copies *new_copies(enum dagnuma_mode mode,
+    size_t bytes)
+{
+	struct dagnuma_copies *c = alloc_type(struct dagnuma_copies);
+	unsigned i;
+
+	if (dagnuma_nodes() == 1)
+		mode = dnm_off;
+	c->mode = mode;
+	c->nodes = dagnuma_nodes();
+	c->bytes = bytes;
+	for (i = 0; i != c->nodes; i++)
+		if (mode == dnm_replicate)
+			c->copy[i] = dagnuma_alloc(bytes, i);
+		else
+			c->copy[i] = i ? c->copy[0] : dagnuma_alloc(bytes, -1);
+	return c;
+}
+
+
+struct dagnuma_copies *dagnuma_replicate(const void *src, size_t bytes)
+{
+	struct dagnuma_copies *c = new_copies(dnm_replicate, bytes);
+	unsigned i;
+
+	/* mbind places the pages, no matter who touches them */
+	for (i = 0; i != c->nodes; i++)
+		if (!i || c->copy[i] != c->copy[0])
+			memcpy(c->copy[i], src, bytes);
+	return c;
+}
+
+
+const void *dagnuma_local(const struct dagnuma_copies *c)
+{
+	return c->copy[c->mode == dnm_replicate ? dagnuma_node() : 0];
+}
+
+
+void dagnuma_release(struct dagnuma_copies *c)
+{
+	unsigned i;
+
+	for (i = 0; i != c->nodes; i++)
+		if (!i || c->copy[i] != c->copy[0])
+			dagnuma_free(c->copy[i], c->bytes);
+	free(c);
+}
+
+
+/* ----- Background priority ---------------------------------------------- */
+
+
+#define	BACKGROUND_NICE	19
+
+
+static __thread const bool *urgent;	/* NULL if not in the background */
+static bool boost_failed = 0;
+
+
+static bool set_nice(int nice)
+{
+	return setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) == 0;
+}
+
+
+void dagnuma_background(const bool *flag)
+{
+	urgent = flag;
+	if (!set_nice(BACKGROUND_NICE))
+		perror("setpriority");
+}
+
+
+bool dagnuma_boost(void)
+{
+	if (!urgent || !__atomic_load_n(urgent, __ATOMIC_RELAXED))
+		return 1;
+	urgent = NULL;
+	if (set_nice(0))
+		return 1;
+	if (!__atomic_exchange_n(&boost_failed, 1, __ATOMIC_RELAXED))
+		fprintf(stderr, "setpriority: %s (DAG generation stays at "
+		    "nice %d)\n", strerror(errno), BACKGROUND_NICE);
+	return 0;
+}
+
+
+/* ----- DAG generation ---------------------------------------------------- */
+
+
+/*
+ * Generator threads check for a boost after each slice of this many lines,
+ * i.e., every few milliseconds.
+ */
+
+#define	BOOST_LINES	1024
+
+
+struct gen_thread {
+	pthread_t	thread;
+	const struct dagnuma_copies *dag;
+	const struct dagnuma_copies *cache;
+	unsigned	cache_bytes;
+	unsigned	node;
+	unsigned	nodes;
+	unsigned	index;		/* thread number within node */
+	unsigned	threads;	/* threads on this node */
+	const unsigned	*part;		/* first line of each node, nodes + 1 */
+	bool		copy;		/* phase 2: copy other partitions */
+	const bool	*urgent;	/* of the thread that started us */
+};
+
+
+static void slice(const struct gen_thread *t, unsigned node,
+    unsigned *start, unsigned *lines)
+{
+	unsigned from = t->part[node];
+	unsigned n = t->part[node + 1] - from;
+
+	*start = from + (uint64_t) n * t->index / t->threads;
+	*lines = from + (uint64_t) n * (t->index + 1) / t->threads - *start;
+}
+
+
+static void *gen_thread(void *arg)
+{
+	const struct gen_thread *t = arg;
+	uint8_t *dag = t->dag->copy[t->node];
+	unsigned start, lines, n, i;
+
+	urgent = t->urgent;
+	dagnuma_bind(t->node);
+	if (!t->copy) {
+		slice(t, t->node, &start, &lines);
+		while (lines) {
+			n = lines < BOOST_LINES ? lines : BOOST_LINES;
+			calc_dataset_range(dag + (size_t) start *
+			    DAG_LINE_BYTES, start, n, t->cache->copy[t->node],
+			    t->cache_bytes);
+			start += n;
+			lines -= n;
+			dagnuma_boost();
+		}
+		return NULL;
+	}
+	for (i = 0; i != t->nodes; i++) {
+		if (i == t->node)
+			continue;
+		slice(t, i, &start, &lines);
+		memcpy(dag + (size_t) start * DAG_LINE_BYTES,
+		    (const uint8_t *) t->dag->copy[i] +
+		    (size_t) start * DAG_LINE_BYTES,
+		    (size_t) lines * DAG_LINE_BYTES);
+	}
+	return NULL;
+}
+
+
+static void run_threads(struct gen_thread *t, unsigned n)
+{
+	unsigned i;
+	int err;
+
+	for (i = 0; i != n; i++) {
+		err = pthread_create(&t[i].thread, NULL, gen_thread, t + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != n; i++)
+		pthread_join(t[i].thread, NULL);
+}
+
+
+static void generate(struct dagnuma_copies *dc, unsigned full_lines,
+    const uint8_t *cache, unsigned cache_bytes, unsigned threads)
+{
+	enum dagnuma_mode mode = dc->mode;
+	unsigned nodes = mode == dnm_off ? 1 : dc->nodes;
+	struct dagnuma_copies *cc;
+	unsigned per_node[DAGNUMA_MAX_NODES];
+	unsigned part[DAGNUMA_MAX_NODES + 1];
+	struct gen_thread *t;
+	unsigned total = 0, i, j, n;
+	cpu_set_t set;
+
+	/* if we're already late, start the generators at normal priority */
+	dagnuma_boost();
+
+	for (i = 0; i != nodes; i++) {
+		per_node[i] = nodes == 1 ? sysconf(_SC_NPROCESSORS_ONLN) :
+		    sys_node_cpus(i, &set);
+		total += per_node[i];
+	}
+	if (!total) {
+		per_node[0] = total = 1;
+		nodes = 1;
+	}
+	if (threads) {
+		/* distribute requested threads in proportion to CPUs */
+		n = 0;
+		for (i = 0; i != nodes; i++) {
+			j = (uint64_t) threads * (per_node[i] + n) / total -
+			    (uint64_t) threads * n / total;
+			n += per_node[i];
+			per_node[i] = j;
+		}
+		total = threads;
+	}
+	/* in replicate mode, each copy needs at least one thread to fill */
+	if (mode == dnm_replicate)
+		for (i = 0; i != nodes; i++)
+			if (!per_node[i] && sys_node_cpus(i, &set)) {
+				per_node[i] = 1;
+				total++;
+			}
+
+	/* partition the DAG in proportion to threads per node */
+	n = 0;
+	for (i = 0; i != nodes; i++) {
+		part[i] = (uint64_t) full_lines * n / total /
+		    PARTITION_LINES * PARTITION_LINES;
+		n += per_node[i];
+	}
+	part[nodes] = full_lines;
+
+	cc = nodes == 1 ? NULL : dagnuma_replicate(cache, cache_bytes);
+
+	t = alloc_size(sizeof(struct gen_thread) * total);
+	n = 0;
+	for (i = 0; i != nodes; i++)
+		for (j = 0; j != per_node[i]; j++) {
+			t[n].dag = dc;
+			t[n].cache = cc;
+			t[n].cache_bytes = cache_bytes;
+			t[n].node = i;
+			t[n].nodes = nodes;
+			t[n].index = j;
+			t[n].threads = per_node[i];
+			t[n].part = part;
+			t[n].copy = 0;
+			t[n].urgent = urgent;
+			n++;
+		}
+
+	if (cc) {
+		run_threads(t, total);
+		if (mode == dnm_replicate) {
+			for (i = 0; i != total; i++)
+				t[i].copy = 1;
+			run_threads(t, total);
+		}
+		dagnuma_release(cc);
+	} else {
+		struct dagnuma_copies local = {
+			.mode	= dnm_off,
+			.nodes	= 1,
+			.copy	= { (void *) cache },
+		};
+
+		for (i = 0; i != total; i++)
+			t[i].cache = &local;
+		run_threads(t, total);
+	}
+	free(t);
+}
+
+
+struct dagnuma_copies *dagnuma_dataset(enum dagnuma_mode mode,
+    unsigned full_lines, const uint8_t *cache, unsigned cache_bytes,
+    unsigned threads)
+{
+	struct dagnuma_copies *dc;
+
+	dc = new_copies(mode, (size_t) full_lines * DAG_LINE_BYTES);
+	generate(dc, full_lines, cache, cache_bytes, threads);
+	return dc;
+}
+
+
+void dagnuma_fill(uint8_t *dag, unsigned full_lines, const uint8_t *cache,
+    unsigned cache_bytes, unsigned threads)
+{
+	struct dagnuma_copies dc = {
+		.mode	= dagnuma_nodes() == 1 ? dnm_off : dnm_partition,
+		.nodes	= dagnuma_nodes(),
+		.bytes	= (size_t) full_lines * DAG_LINE_BYTES,
+	};
+	unsigned i;
+
+	for (i = 0; i != dc.nodes; i++)
+		dc.copy[i] = dag;
+	generate(&dc, full_lines, cache, cache_bytes, threads);
+}
@@ -0,0 +1,116 @@
+/*
+ * dagnuma.h - NUMA-aware placement of light cache and DAG
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGNUMA_H
+#define	LIBDAG_DAGNUMA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define	DAGNUMA_MAX_NODES	64
+
+
+enum dagnuma_mode {
+	dnm_off		= 0,	/* no placement, single copy */
+	dnm_partition	= 1,	/* single copy, first-touch partitioned */
+	dnm_replicate	= 2,	/* one full copy per node */
+};
+
+
+/*
+ * A set of per-node copies of the same data. In modes that don't replicate,
+ * all entries of "copy" point to the same memory.
+ */
+
+struct dagnuma_copies {
+	enum dagnuma_mode mode;
+	unsigned	nodes;
+	size_t		bytes;
+	void		*copy[DAGNUMA_MAX_NODES];
+};
+
+
+const char *dagnuma_name(enum dagnuma_mode mode);
+
+/*
+ * Returns enum dagnuma_mode, -1 if no such mode is known.
+ */
+int dagnuma_code(const char *name);
+
+/*
+ * Number of NUMA nodes. This is 1 if the host has no NUMA or if we can't
+ * find out.
+ */
+unsigned dagnuma_nodes(void);
+
+/*
+ * Node the calling thread is running on, 0 if unknown.
+ */
+unsigned dagnuma_node(void);
+
+/*
+ * Bind the calling thread (CPUs and memory allocation) to a node. Returns 0
+ * on success, -1 (and errno) on failure. Binding to node 0 on a single-node
+ * host always succeeds.
+ */
+int dagnuma_bind(unsigned node);
+
+/*
+ * Allocate zero-filled, page-aligned memory on "node". With node < 0, memory
+ * is not bound and pages land where they are first touched.
+ */
+void *dagnuma_alloc(size_t bytes, int node);
+void dagnuma_free(void *p, size_t bytes);
+
+/*
+ * Replicate read-only data (e.g., the light cache) on all nodes.
+ */
+struct dagnuma_copies *dagnuma_replicate(const void *src, size_t bytes);
+
+/*
+ * Generate the full DAG with "threads" threads (0 for one per CPU), spread
+ * over all nodes. Each thread uses a copy of the light cache on its own node.
+ */
+struct dagnuma_copies *dagnuma_dataset(enum dagnuma_mode mode,
+    unsigned full_lines, const uint8_t *cache, unsigned cache_bytes,
+    unsigned threads);
+
+/*
+ * Generate the full DAG into memory provided by the caller, e.g., a shared
+ * mapping. Threads are spread over all nodes, in partition mode. Pages the
+ * caller has already touched stay where they are.
+ */
+void dagnuma_fill(uint8_t *dag, unsigned full_lines, const uint8_t *cache,
+    unsigned cache_bytes, unsigned threads);
+
+/*
+ * Background generation. After dagnuma_background, the calling thread runs at
+ * nice 19, and so do the generator threads dagnuma_dataset and dagnuma_fill
+ * start from it. Unlike SCHED_IDLE, this still makes progress on a fully
+ * loaded host. Once *urgent is set, each of these threads returns to nice 0
+ * at its next check: generators check between slices, and other threads can
+ * call dagnuma_boost. "urgent" must stay valid until generation is done.
+ *
+ * Leaving nice 19 needs CAP_SYS_NICE or a sufficient RLIMIT_NICE. If that
+ * fails, dagnuma_boost reports it once and returns 0.
+ */
+void dagnuma_background(const bool *urgent);
+bool dagnuma_boost(void);
+
+/*
+ * Copy for the node of the calling thread. Threads that hash should first
+ * use dagnuma_bind to stay on that node.
+ */
+const void *dagnuma_local(const struct dagnuma_copies *c);
+
+void dagnuma_release(struct dagnuma_copies *c);
+
+#endif /* !LIBDAG_DAGNUMA_H */
@@ -0,0 +1,329 @@
+/*
+ * dagprof.c - Profiling of DAG generation phases
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "linzhi/alloc.h"
+
+#include "dagprof.h"
+
+
+#define	MAX_DEPTH	16
+
+
+struct frame {
+	enum dagprof_phase phase;
+	uint64_t	t0;		/* ns */
+	uint64_t	child_ns;	/* time in nested phases */
+	uint64_t	c0[dagprof_counters];
+};
+
+struct thread_state {
+	int		fd[dagprof_counters];
+	unsigned	depth;
+	struct frame	stack[MAX_DEPTH];
+};
+
+struct total {
+	uint64_t	calls;
+	uint64_t	ns;
+	uint64_t	self_ns;
+	uint64_t	count[dagprof_counters];
+};
+
+
+static const char *phase_names[] = {
+	[dp_seedhash]		= "seedhash",
+	[dp_mkcache_init]	= "mkcache_init",
+	[dp_mkcache_round]	= "mkcache_round",
+	[dp_dataset]		= "dataset",
+	[dp_write]		= "write",
+	[dp_verify]		= "verify",
+};
+
+static const char *counter_names[] = {
+	[dpc_cycles]		= "cycles",
+	[dpc_instructions]	= "instructions",
+	[dpc_llc_misses]	= "llc_misses",
+	[dpc_dtlb_misses]	= "dtlb_misses",
+};
+
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} counter_events[] = {
+	[dpc_cycles]		= { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_CPU_CYCLES },
+	[dpc_instructions]	= { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_INSTRUCTIONS },
+	[dpc_llc_misses]	= { PERF_TYPE_HARDWARE,
+				    PERF_COUNT_HW_CACHE_MISSES },
+	[dpc_dtlb_misses]	= { PERF_TYPE_HW_CACHE,
+				    PERF_COUNT_HW_CACHE_DTLB |
+				    PERF_COUNT_HW_CACHE_OP_READ << 8 |
+				    PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+
+
+static bool enabled = 0;
+static bool use_counters = 0;
+static unsigned have_mask = 0;	/* counters opened by at least one thread */
+static struct total totals[dagprof_phases];
+
+static __thread struct thread_state *state;
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+
+
+/* ----- Names ------------------------------------------------------------- */
+
+
+const char *dagprof_name(enum dagprof_phase phase)
+{
+	return phase < dagprof_phases ? phase_names[phase] : "???";
+}
+
+
+int dagprof_code(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i != dagprof_phases; i++)
+		if (!strcmp(phase_names[i], name))
+			return i;
+	return -1;
+}
+
+
+const char *dagprof_counter_name(enum dagprof_counter counter)
+{
+	return counter < dagprof_counters ? counter_names[counter] : "???";
+}
+
+
+/* ----- Clock and counters ------------------------------------------------ */
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int counter_open(enum dagprof_counter c)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counter_events[c].type;
+	attr.config = counter_events[c].config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static void counters_read(const struct thread_state *s, uint64_t *res)
+{
+	unsigned i;
+
+	for (i = 0; i != dagprof_counters; i++) {
+		res[i] = 0;
+		if (s->fd[i] >= 0 &&
+		    read(s->fd[i], res + i, sizeof(uint64_t)) !=
+		    sizeof(uint64_t))
+			res[i] = 0;
+	}
+}
+
+
+/* ----- Per-thread state -------------------------------------------------- */
+
+
+static void state_destroy(void *arg)
+{
+	struct thread_state *s = arg;
+	unsigned i;
+
+	for (i = 0; i != dagprof_counters; i++)
+		if (s->fd[i] >= 0)
+			close(s->fd[i]);
+	free(s);
+}
+
+
+static void state_key_create(void)
+{
+	pthread_key_create(&state_key, state_destroy);
+}
+
+
+static struct thread_state *get_state(void)
+{
+	struct thread_state *s = state;
+	unsigned i;
+
+	if (s)
+		return s;
+	s = alloc_type(struct thread_state);
+	s->depth = 0;
+	for (i = 0; i != dagprof_counters; i++) {
+		s->fd[i] = use_counters ? counter_open(i) : -1;
+		if (s->fd[i] >= 0)
+			__atomic_or_fetch(&have_mask, 1 << i, __ATOMIC_RELAXED);
+	}
+	pthread_once(&state_once, state_key_create);
+	pthread_setspecific(state_key, s);
+	state = s;
+	return s;
+}
+
+
+/* ----- Phases ------------------------------------------------------------ */
+
+
+void dagprof_begin(enum dagprof_phase phase)
+{
+	struct thread_state *s;
+	struct frame *f;
+
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+		return;
+	s = get_state();
+	if (s->depth++ >= MAX_DEPTH)
+		return;
+	f = s->stack + s->depth - 1;
+	f->phase = phase;
+	f->child_ns = 0;
+	counters_read(s, f->c0);
+	f->t0 = now_ns();
+}
+
+
+void dagprof_end(enum dagprof_phase phase)
+{
+	struct thread_state *s = state;
+	struct total *t = totals + phase;
+	uint64_t c1[dagprof_counters];
+	const struct frame *f;
+	uint64_t dt;
+	unsigned i;
+
+	/* phases that began while profiling was disabled aren't on the stack */
+	if (!s || !s->depth)
+		return;
+	if (s->depth > MAX_DEPTH) {
+		s->depth--;
+		return;
+	}
+	f = s->stack + s->depth - 1;
+	if (f->phase != phase)
+		return;
+	dt = now_ns() - f->t0;
+	counters_read(s, c1);
+	s->depth--;
+
+	__atomic_add_fetch(&t->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->ns, dt, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->self_ns, dt - f->child_ns, __ATOMIC_RELAXED);
+	for (i = 0; i != dagprof_counters; i++)
+		if (s->fd[i] >= 0)
+			__atomic_add_fetch(&t->count[i], c1[i] - f->c0[i],
+			    __ATOMIC_RELAXED);
+	if (s->depth && s->depth <= MAX_DEPTH)
+		s->stack[s->depth - 1].child_ns += dt;
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+void dagprof_enable(bool enable, bool counters)
+{
+	use_counters = counters;
+	__atomic_store_n(&enabled, enable, __ATOMIC_RELAXED);
+}
+
+
+void dagprof_get(struct dagprof_stats *res)
+{
+	unsigned have = __atomic_load_n(&have_mask, __ATOMIC_RELAXED);
+	unsigned i, j;
+
+	for (i = 0; i != dagprof_phases; i++) {
+		const struct total *t = totals + i;
+
+		res[i].calls = __atomic_load_n(&t->calls, __ATOMIC_RELAXED);
+		res[i].seconds =
+		    __atomic_load_n(&t->ns, __ATOMIC_RELAXED) * 1e-9;
+		res[i].self_seconds =
+		    __atomic_load_n(&t->self_ns, __ATOMIC_RELAXED) * 1e-9;
+		for (j = 0; j != dagprof_counters; j++) {
+			res[i].have[j] = (have >> j) & 1;
+			res[i].count[j] =
+			    __atomic_load_n(&t->count[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+void dagprof_reset(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i != dagprof_phases; i++) {
+		struct total *t = totals + i;
+
+		__atomic_store_n(&t->calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->self_ns, 0, __ATOMIC_RELAXED);
+		for (j = 0; j != dagprof_counters; j++)
+			__atomic_store_n(&t->count[j], 0, __ATOMIC_RELAXED);
+	}
+}
+
+
+void dagprof_json(FILE *file)
+{
+	struct dagprof_stats st[dagprof_phases];
+	unsigned i, j;
+
+	dagprof_get(st);
+	fprintf(file, "{\n  \"phases\": [\n");
+	for (i = 0; i != dagprof_phases; i++) {
+		fprintf(file, "    { \"name\": \"%s\", \"calls\": %llu, "
+		    "\"seconds\": %.9f, \"self_seconds\": %.9f",
+		    phase_names[i], (unsigned long long) st[i].calls,
+		    st[i].seconds, st[i].self_seconds);
+		for (j = 0; j != dagprof_counters; j++)
+			if (st[i].have[j])
+				fprintf(file, ", \"%s\": %llu",
+				    counter_names[j],
+				    (unsigned long long) st[i].count[j]);
+			else
+				fprintf(file, ", \"%s\": null",
+				    counter_names[j]);
+		fprintf(file, " }%s\n", i == dagprof_phases - 1 ? "" : ",");
+	}
+	fprintf(file, "  ]\n}\n");
+}
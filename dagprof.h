@@ -0,0 +1,85 @@
+/*
+ * dagprof.h - Profiling of DAG generation phases
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGPROF_H
+#define	LIBDAG_DAGPROF_H
+
+/*
+ * The library brackets its main phases with dagprof_begin and dagprof_end.
+ * When profiling is enabled, each thread measures its phases with the
+ * monotonic clock and, optionally, with hardware performance counters of
+ * that thread. Results are summed over all threads.
+ *
+ * Phases nest: "seconds" includes nested phases, "self_seconds" doesn't.
+ * Counters include nested phases.
+ *
+ * When profiling is disabled (the default), dagprof_begin and dagprof_end
+ * only check a flag.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+enum dagprof_phase {
+	dp_seedhash,
+	dp_mkcache_init,
+	dp_mkcache_round,
+	dp_dataset,
+	dp_write,
+	dp_verify,
+	dagprof_phases
+};
+
+enum dagprof_counter {
+	dpc_cycles,
+	dpc_instructions,
+	dpc_llc_misses,
+	dpc_dtlb_misses,
+	dagprof_counters
+};
+
+struct dagprof_stats {
+	uint64_t	calls;
+	double		seconds;
+	double		self_seconds;
+	bool		have[dagprof_counters];	/* counter is available */
+	uint64_t	count[dagprof_counters];
+};
+
+
+const char *dagprof_name(enum dagprof_phase phase);
+
+/*
+ * Returns enum dagprof_phase, -1 if no such phase is known.
+ */
+int dagprof_code(const char *name);
+
+const char *dagprof_counter_name(enum dagprof_counter counter);
+
+/*
+ * Enable or disable profiling. With "counters", each thread opens its
+ * performance counters when it first begins a phase. Counters that can't be
+ * opened (no PMU, perf_event_paranoid, ...) are reported as unavailable.
+ */
+void dagprof_enable(bool enable, bool counters);
+
+void dagprof_begin(enum dagprof_phase phase);
+void dagprof_end(enum dagprof_phase phase);
+
+/*
+ * Totals since the last reset. "res" has dagprof_phases entries.
+ */
+void dagprof_get(struct dagprof_stats *res);
+void dagprof_reset(void);
+
+void dagprof_json(FILE *file);
+
+#endif /* !LIBDAG_DAGPROF_H */
@@ -0,0 +1,173 @@
+/*
+ * dagreg.c - In-process registry of shared light caches and DAGs
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagnuma.h"
+#include "dagreg.h"
+
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct dagreg_entry *entries = NULL;
+
+static unsigned dag_threads = 0;
+static enum dagnuma_mode dag_numa = dnm_off;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+void dagreg_setup(unsigned threads, enum dagnuma_mode numa)
+{
+	pthread_mutex_lock(&mutex);
+	dag_threads = threads;
+	dag_numa = numa;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+/* ----- Cache ------------------------------------------------------------- */
+
+
+/*
+ * Build outside the lock, so that other keys aren't held up. The building
+ * flag keeps everyone else asking for the same key waiting.
+ */
+
+const struct dagreg_entry *dagreg_cache(enum dag_algo algo, unsigned epoch)
+{
+	struct dagreg_entry *e;
+	uint8_t seed[SEED_BYTES];
+	uint8_t *cache;
+
+	pthread_mutex_lock(&mutex);
+	for (e = entries; e; e = e->next)
+		if (e->algo == algo && e->epoch == epoch)
+			break;
+	if (!e) {
+		e = alloc_type(struct dagreg_entry);
+		e->algo = algo;
+		e->epoch = epoch;
+		e->cache_bytes = get_cache_size(epoch);
+		e->full_lines = get_full_lines(epoch);
+		e->cache = NULL;
+		e->dag = NULL;
+		e->copies = NULL;
+		e->refs = 0;
+		e->dag_refs = 0;
+		e->cache_building = 0;
+		e->dag_building = 0;
+		e->next = entries;
+		entries = e;
+	}
+	e->refs++;
+	while (!e->cache) {
+		if (e->cache_building) {
+			pthread_cond_wait(&cond, &mutex);
+			continue;
+		}
+		e->cache_building = 1;
+		pthread_mutex_unlock(&mutex);
+
+		dagnuma_boost();
+		get_seedhash_algo(seed, algo, epoch);
+		cache = alloc_size(e->cache_bytes);
+		mkcache_algo(algo, cache, e->cache_bytes, seed);
+
+		pthread_mutex_lock(&mutex);
+		e->cache = cache;
+		e->cache_building = 0;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return e;
+}
+
+
+void dagreg_release_cache(const struct dagreg_entry *ce)
+{
+	struct dagreg_entry *e = (struct dagreg_entry *) ce;
+	struct dagreg_entry **anchor;
+
+	pthread_mutex_lock(&mutex);
+	if (--e->refs) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	for (anchor = &entries; *anchor != e; anchor = &(*anchor)->next);
+	*anchor = e->next;
+	pthread_mutex_unlock(&mutex);
+
+	free((uint8_t *) e->cache);
+	free(e);
+}
+
+
+/* ----- DAG --------------------------------------------------------------- */
+
+
+const struct dagreg_entry *dagreg_dag(enum dag_algo algo, unsigned epoch)
+{
+	struct dagreg_entry *e = (struct dagreg_entry *) dagreg_cache(algo,
+	    epoch);
+	struct dagnuma_copies *copies;
+	enum dagnuma_mode numa;
+	unsigned threads;
+
+	pthread_mutex_lock(&mutex);
+	e->dag_refs++;
+	while (!e->copies) {
+		if (e->dag_building) {
+			pthread_cond_wait(&cond, &mutex);
+			continue;
+		}
+		e->dag_building = 1;
+		threads = dag_threads;
+		numa = dag_numa;
+		pthread_mutex_unlock(&mutex);
+
+		copies = dagnuma_dataset(numa, e->full_lines, e->cache,
+		    e->cache_bytes, threads);
+
+		pthread_mutex_lock(&mutex);
+		e->copies = copies;
+		e->dag = copies->copy[0];
+		e->dag_building = 0;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return e;
+}
+
+
+void dagreg_release_dag(const struct dagreg_entry *ce)
+{
+	struct dagreg_entry *e = (struct dagreg_entry *) ce;
+	struct dagnuma_copies *copies = NULL;
+
+	pthread_mutex_lock(&mutex);
+	if (!--e->dag_refs) {
+		copies = e->copies;
+		e->copies = NULL;
+		e->dag = NULL;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (copies)
+		dagnuma_release(copies);
+	dagreg_release_cache(e);
+}
@@ -0,0 +1,59 @@
+/*
+ * dagreg.h - In-process registry of shared light caches and DAGs
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGREG_H
+#define	LIBDAG_DAGREG_H
+
+/*
+ * Coins that map to the same (algorithm, epoch) need the same light cache
+ * and DAG. The registry builds each of them only once per process, even if
+ * several threads ask for it at the same time, and frees it when the last
+ * user has released it.
+ *
+ * A DAG reference includes a reference to the cache it was built from.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dagalgo.h"
+#include "dagnuma.h"
+
+
+struct dagreg_entry {
+	enum dag_algo	algo;
+	unsigned	epoch;		/* epoch of "algo" */
+	unsigned	cache_bytes;
+	unsigned	full_lines;
+	const uint8_t	*cache;
+	const uint8_t	*dag;		/* only valid with a DAG reference */
+	struct dagnuma_copies *copies;	/* per-node copies of "dag" */
+
+	/* private */
+	unsigned	refs;		/* cache and DAG users */
+	unsigned	dag_refs;	/* DAG users */
+	bool		cache_building;
+	bool		dag_building;
+	struct dagreg_entry *next;
+};
+
+
+/*
+ * How DAGs are built. Takes effect for DAGs built afterwards. The default is
+ * one thread per CPU and dnm_off.
+ */
+void dagreg_setup(unsigned threads, enum dagnuma_mode numa);
+
+const struct dagreg_entry *dagreg_cache(enum dag_algo algo, unsigned epoch);
+const struct dagreg_entry *dagreg_dag(enum dag_algo algo, unsigned epoch);
+
+void dagreg_release_cache(const struct dagreg_entry *e);
+void dagreg_release_dag(const struct dagreg_entry *e);
+
+#endif /* !LIBDAG_DAGREG_H */
@@ -0,0 +1,190 @@
+/*
+ * dagreplay.c - Run a recorded DAG access trace through a DRAM model
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * The model maps consecutive rows of "row_bytes" round-robin to "banks"
+ * banks, keeps one row open per bank, and counts how often an access finds
+ * its row already open. It also counts how evenly accesses spread over the
+ * banks, and how many distinct DAG lines the trace touches.
+ *
+ * Example (16 banks with 2 kB rows, then 32 banks):
+ * ./dagreplay trace400
+ * ./dagreplay -b 32 trace400
+ *
+ * For timing on real memory, see membench -r.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagtrace.h"
+
+
+struct model {
+	unsigned	banks;
+	unsigned	lines_per_row;
+	uint32_t	*open_row;	/* per bank, ~0 if none is open */
+	uint64_t	*bank_accesses;
+	uint8_t		*seen;		/* bitmap of lines */
+	uint64_t	accesses;
+	uint64_t	row_hits;
+	uint64_t	distinct;
+	uint64_t	min_nonce, max_nonce;
+	uint64_t	nonces;
+};
+
+
+/* ----- Model ------------------------------------------------------------- */
+
+
+static void model_nonce(void *user, uint64_t nonce)
+{
+	struct model *m = user;
+
+	/* blocks of different capture threads can be in any order */
+	if (!m->nonces++ || nonce < m->min_nonce)
+		m->min_nonce = nonce;
+	if (nonce > m->max_nonce)
+		m->max_nonce = nonce;
+}
+
+
+static void model_access(void *user, unsigned round, uint32_t line,
+    const uint8_t *mix)
+{
+	struct model *m = user;
+	uint32_t row = line / m->lines_per_row;
+	unsigned bank = row % m->banks;
+
+	(void) round;
+	(void) mix;
+	m->accesses++;
+	m->bank_accesses[bank]++;
+	if (m->open_row[bank] == row)
+		m->row_hits++;
+	m->open_row[bank] = row;
+	if (!(m->seen[line >> 3] & 1 << (line & 7))) {
+		m->seen[line >> 3] |= 1 << (line & 7);
+		m->distinct++;
+	}
+}
+
+
+static void report(const struct model *m, unsigned full_lines)
+{
+	uint64_t min = ~(uint64_t) 0, max = 0;
+	unsigned i;
+
+	for (i = 0; i != m->banks; i++) {
+		if (m->bank_accesses[i] < min)
+			min = m->bank_accesses[i];
+		if (m->bank_accesses[i] > max)
+			max = m->bank_accesses[i];
+	}
+	printf("nonces %llu (0x%llx-0x%llx)\n", (unsigned long long) m->nonces,
+	    (unsigned long long) m->min_nonce,
+	    (unsigned long long) m->max_nonce);
+	if (!m->accesses)
+		return;
+	printf("accesses %llu\n", (unsigned long long) m->accesses);
+	printf("distinct lines %llu (%.2f%% of %u)\n",
+	    (unsigned long long) m->distinct, 100.0 * m->distinct / full_lines,
+	    full_lines);
+	printf("row hits %llu (%.3f%%)\n", (unsigned long long) m->row_hits,
+	    100.0 * m->row_hits / m->accesses);
+	printf("bank accesses min %llu max %llu (max/mean %.3f)\n",
+	    (unsigned long long) min, (unsigned long long) max,
+	    (double) max * m->banks / m->accesses);
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-b banks] [-r row_bytes] trace_file\n\n"
+"  -b banks\n"
+"      number of DRAM banks (default: 16)\n"
+"  -r row_bytes\n"
+"      DRAM row size, a multiple of %u (default: 2048)\n"
+	    , name, DAG_LINE_BYTES);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct model m = {
+		.banks		= 16,
+	};
+	const struct dagtrace_model model = {
+		.nonce	= model_nonce,
+		.access	= model_access,
+		.user	= &m,
+	};
+	unsigned row_bytes = 2048;
+	const struct dagtrace_info *info;
+	struct dagtrace_reader *r;
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:r:")) != EOF)
+		switch (c) {
+		case 'b':
+			m.banks = strtoul(optarg, &end, 0);
+			if (*end || !m.banks)
+				usage(*argv);
+			break;
+		case 'r':
+			row_bytes = strtoul(optarg, &end, 0);
+			if (*end || !row_bytes || row_bytes % DAG_LINE_BYTES)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc - optind != 1)
+		usage(*argv);
+
+	r = dagtrace_open(argv[optind]);
+	if (!r) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	info = dagtrace_info(r);
+
+	m.lines_per_row = row_bytes / DAG_LINE_BYTES;
+	m.open_row = alloc_size(sizeof(uint32_t) * m.banks);
+	memset(m.open_row, 0xff, sizeof(uint32_t) * m.banks);
+	m.bank_accesses = alloc_size(sizeof(uint64_t) * m.banks);
+	memset(m.bank_accesses, 0, sizeof(uint64_t) * m.banks);
+	m.seen = alloc_size((info->full_lines + 7) / 8);
+	memset(m.seen, 0, (info->full_lines + 7) / 8);
+
+	printf("DAG %u lines, %u banks, %u byte rows%s%s\n", info->full_lines,
+	    m.banks, row_bytes,
+	    info->flags & DAGTRACE_DELTA ? ", packed" : "",
+	    info->flags & DAGTRACE_MIX ? ", with mix" : "");
+	dagtrace_replay(r, &model);
+	dagtrace_reader_close(r);
+	report(&m, info->full_lines);
+
+	free(m.open_row);
+	free(m.bank_accesses);
+	free(m.seen);
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * dagserve.c - Serve a DAG in dagio files over TCP
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (serve, and fetch over loopback):
+ * ./mkdag 100 /tmp/dag
+ * ./dagserve -p 8546 100 /tmp/dag &
+ * ./dagfetch -c 4 localhost 8546 100 /tmp/dag-copy
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagio.h"
+#include "dagmeta.h"
+#include "dagnet.h"
+
+
+static uint32_t stripe_lines = 0;
+static enum dagio_backend backend = dbe_file;
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-a algo] [-B backend] [-b stripe_kB] [-f dag_lines] [-p port]\n"
+"       %*s[-q] [-t threads] epoch dag-file ...\n\n"
+"  -a algo\n"
+"      DAG algorithm (ethash, etchash, ubqhash; default: ethash)\n"
+"  -B backend\n"
+"      storage backend (file, mmap, mem, uring; default: file)\n"
+"  -b stripe_kB\n"
+"      the DAG is striped over the dag-files, in stripes of this size\n"
+"  -f dag_lines\n"
+"      override the DAG size\n"
+"  -p port\n"
+"      TCP port (default: %s)\n"
+"  -q  quiet operation\n"
+"  -t threads\n"
+"      threads for verifying the DAG (default: one per CPU)\n"
+	    , name, (int) strlen(name) + 1, "", DAGNET_PORT);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct dag_handle *h;
+	struct dagnet_server *s;
+	struct dagmeta *m;
+	const char *port = NULL;
+	unsigned full_lines = 0;
+	unsigned threads = 0;
+	unsigned epoch;
+	bool quiet = 0;
+	char *meta_path;
+	char *end;
+	sigset_t set;
+	int c, code;
+
+	while ((c = getopt(argc, argv, "a:B:b:f:p:qt:")) != EOF)
+		switch (c) {
+		case 'a':
+			code = dagalgo_code(optarg);
+			if (code < 0)
+				usage(*argv);
+			dag_algo = code;
+			break;
+		case 'B':
+			code = dagio_backend_code(optarg);
+			if (code < 0)
+				usage(*argv);
+			backend = code;
+			break;
+		case 'b':
+			stripe_lines = (strtoul(optarg, &end, 0) << 10) /
+			    DAG_LINE_BYTES;
+			if (*end || !stripe_lines)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 't':
+			threads = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind < 2)
+		usage(*argv);
+	if (!stripe_lines && argc - optind != 2)
+		usage(*argv);
+	epoch = strtoul(argv[optind], &end, 0);
+	if (*end)
+		usage(*argv);
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+
+	meta_path = dagmeta_path(argv[optind + 1]);
+	m = dagmeta_read(meta_path);
+	if (!m) {
+		perror(meta_path);
+		exit(1);
+	}
+	if (!dagmeta_match(m, dag_algo, epoch, full_lines)) {
+		fprintf(stderr, "%s: does not match the DAG\n", meta_path);
+		exit(1);
+	}
+	free(meta_path);
+
+	h = dagio_open_backend(backend, (const char *const *) argv + optind + 1,
+	    argc - optind - 1, O_RDONLY, full_lines, stripe_lines);
+
+	/* block the signals we wait for, before any threads are created */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	s = dagnet_server_start(h, m, port, threads);
+	if (!s) {
+		perror(port ? port : DAGNET_PORT);
+		exit(1);
+	}
+	if (!quiet)
+		printf("%s epoch %u: serving on port %u, %u bad chunk%s\n",
+		    dagalgo_name(dag_algo), epoch, dagnet_server_port(s),
+		    dagnet_server_bad(s), dagnet_server_bad(s) == 1 ? "" : "s");
+	fflush(stdout);
+
+	sigwait(&set, &c);
+
+	dagnet_server_stop(s);
+	dagio_close(h);
+	dagmeta_free(m);
+	return 0;
+}
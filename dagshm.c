@@ -0,0 +1,250 @@
+/*
+ * dagshm.c - Share DAGs between processes through shm or hugetlbfs files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagnuma.h"
+#include "dagreg.h"
+#include "dagshm.h"
+
+
+struct dagshm {
+	void		*addr;
+	size_t		length;		/* mapped; rounded up to f_bsize */
+	unsigned	full_lines;
+};
+
+
+/* ----- Names ------------------------------------------------------------- */
+
+
+static char *shm_path(const char *dir, enum dag_algo algo, unsigned epoch,
+    const char *ext)
+{
+	char *s;
+
+	if (asprintf(&s, "%s/libdag-%s-%u%s", dir ? dir : DAGSHM_DIR,
+	    dagalgo_name(algo), epoch, ext) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return s;
+}
+
+
+/*
+ * hugetlbfs only accepts sizes and mappings that are multiples of the huge
+ * page size, which it reports as the block size.
+ */
+
+static size_t rounded(int fd, size_t bytes)
+{
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs) < 0 || sfs.f_bsize <= 0)
+		return bytes;
+	return (bytes + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+}
+
+
+/* ----- Attach ------------------------------------------------------------ */
+
+
+static int map_fd(struct dagshm **res, int fd, unsigned full_lines)
+{
+	size_t bytes = (size_t) full_lines * DAG_LINE_BYTES;
+	struct dagshm *s;
+	struct stat st;
+	void *addr;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+	if ((size_t) st.st_size < bytes)
+		return -EINVAL;
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	s = alloc_type(struct dagshm);
+	s->addr = addr;
+	s->length = st.st_size;
+	s->full_lines = full_lines;
+	*res = s;
+	return 0;
+}
+
+
+int dagshm_attach(struct dagshm **res, const char *dir, enum dag_algo algo,
+    unsigned epoch)
+{
+	char *path = shm_path(dir, algo, epoch, "");
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -errno;
+	err = map_fd(res, fd, get_full_lines(epoch));
+	(void) close(fd);
+	return err;
+}
+
+
+/* ----- Publish ----------------------------------------------------------- */
+
+
+static int generate(const char *tmp, enum dag_algo algo, unsigned epoch,
+    unsigned threads)
+{
+	const struct dagreg_entry *e;
+	size_t bytes, length;
+	void *addr;
+	int fd, err;
+
+	/* a leftover from a generator that died is incomplete */
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	e = dagreg_cache(algo, epoch);
+	bytes = (size_t) e->full_lines * DAG_LINE_BYTES;
+	length = rounded(fd, bytes);
+
+	/*
+	 * ftruncate alone reserves nothing on tmpfs, and running out of space
+	 * while filling the mapping would kill us with SIGBUS.
+	 */
+	err = posix_fallocate(fd, 0, length);
+	if (err) {
+		errno = err;
+		goto fail;
+	}
+	addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto fail;
+	dagnuma_fill(addr, e->full_lines, e->cache, e->cache_bytes, threads);
+	if (munmap(addr, length) < 0)
+		goto fail;
+	dagreg_release_cache(e);
+	if (close(fd) < 0)
+		return -errno;
+	return 0;
+
+fail:
+	err = errno;
+	dagreg_release_cache(e);
+	(void) close(fd);
+	(void) unlink(tmp);
+	return -err;
+}
+
+
+int dagshm_get(struct dagshm **res, const char *dir, enum dag_algo algo,
+    unsigned epoch, unsigned threads)
+{
+	char *path, *lock, *tmp;
+	int lock_fd, err;
+
+	err = dagshm_attach(res, dir, algo, epoch);
+	if (err != -ENOENT)
+		return err;
+
+	path = shm_path(dir, algo, epoch, "");
+	lock = shm_path(dir, algo, epoch, ".lock");
+	tmp = shm_path(dir, algo, epoch, ".tmp");
+
+	lock_fd = open(lock, O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0) {
+		err = -errno;
+		goto out;
+	}
+	if (flock(lock_fd, LOCK_EX) < 0) {
+		err = -errno;
+		goto out_lock;
+	}
+
+	/* someone else may have published it while we were waiting */
+	err = dagshm_attach(res, dir, algo, epoch);
+	if (err != -ENOENT)
+		goto out_lock;
+
+	err = generate(tmp, algo, epoch, threads);
+	if (err)
+		goto out_lock;
+	if (rename(tmp, path) < 0) {
+		err = -errno;
+		(void) unlink(tmp);
+		goto out_lock;
+	}
+	err = dagshm_attach(res, dir, algo, epoch);
+
+out_lock:
+	/* closing drops the lock */
+	(void) close(lock_fd);
+out:
+	free(path);
+	free(lock);
+	free(tmp);
+	return err;
+}
+
+
+int dagshm_unpublish(const char *dir, enum dag_algo algo, unsigned epoch)
+{
+	char *path = shm_path(dir, algo, epoch, "");
+	int err = 0;
+
+	/*
+	 * We keep the lock file. If we removed it, a process still waiting on
+	 * the old one could generate alongside one that locked a new one.
+	 */
+	if (unlink(path) < 0)
+		err = -errno;
+	free(path);
+	return err;
+}
+
+
+/* ----- Access ------------------------------------------------------------ */
+
+
+const void *dagshm_addr(const struct dagshm *s)
+{
+	return s->addr;
+}
+
+
+unsigned dagshm_lines(const struct dagshm *s)
+{
+	return s->full_lines;
+}
+
+
+void dagshm_detach(struct dagshm *s)
+{
+	if (munmap(s->addr, s->length) < 0)
+		perror("munmap");
+	free(s);
+}
@@ -0,0 +1,59 @@
+/*
+ * dagshm.h - Share DAGs between processes through shm or hugetlbfs files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGSHM_H
+#define	LIBDAG_DAGSHM_H
+
+/*
+ * A DAG is published as the file <dir>/libdag-<algo>-<epoch>, where "dir" is
+ * a tmpfs (e.g., /dev/shm) or a hugetlbfs mount. Other processes map it
+ * read-only and share the same pages.
+ *
+ * Only one process generates a given DAG: it holds an exclusive flock on
+ * <name>.lock, generates into <name>.tmp, and then renames the file to its
+ * final name. Processes that want the same DAG wait for the lock and then
+ * find the DAG published.
+ */
+
+#include "dagalgo.h"
+
+
+#define	DAGSHM_DIR	"/dev/shm"
+
+
+struct dagshm;
+
+
+/*
+ * "dir" may be NULL for DAGSHM_DIR. These functions return 0 on success, a
+ * negative errno value on failure. dagshm_attach returns -ENOENT if the DAG
+ * has not been published.
+ */
+int dagshm_attach(struct dagshm **res, const char *dir, enum dag_algo algo,
+    unsigned epoch);
+
+/*
+ * Attach, or generate and publish the DAG if nobody has done so yet. The
+ * light cache comes from the registry (dagreg.h). "threads" is as for
+ * dagnuma_fill. Returns -ENOSPC if "dir" can't hold the DAG.
+ */
+int dagshm_get(struct dagshm **res, const char *dir, enum dag_algo algo,
+    unsigned epoch, unsigned threads);
+
+const void *dagshm_addr(const struct dagshm *s);
+unsigned dagshm_lines(const struct dagshm *s);
+void dagshm_detach(struct dagshm *s);
+
+/*
+ * Remove the name. Processes still attached keep their mapping, and memory is
+ * freed when the last of them detaches.
+ */
+int dagshm_unpublish(const char *dir, enum dag_algo algo, unsigned epoch);
+
+#endif /* !LIBDAG_DAGSHM_H */
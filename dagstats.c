@@ -0,0 +1,138 @@
+/*
+ * dagstats.c - Runtime statistics counters
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dagstats.h"
+#include "dagcount.h"
+
+
+static const char *names[] = {
+	[ls_hashimoto]		= "hashimoto",
+	[ls_hashimoto_fd]	= "hashimoto_fd",
+	[ls_hashimoto_dh]	= "hashimoto_dh",
+	[ls_hashimoto_light]	= "hashimoto_light",
+	[ls_dag_lines_read]	= "dag_lines_read",
+	[ls_preads]		= "preads",
+	[ls_dataset_items]	= "dataset_items",
+	[ls_bytes_written]	= "bytes_written",
+};
+
+
+const char *libdag_stat_name(enum libdag_stat stat)
+{
+	return stat < libdag_stat_kinds ? names[stat] : "???";
+}
+
+
+#ifdef NO_STATS
+
+
+bool libdag_stats_enabled(void)
+{
+	return 0;
+}
+
+
+void libdag_stats_snapshot(struct libdag_stats *res)
+{
+	memset(res, 0, sizeof(*res));
+}
+
+
+#else /* NO_STATS */
+
+
+__thread struct dagcount_slot *dagcount_slot;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dagcount_slot *slots = NULL;	/* live threads */
+static uint64_t retired[libdag_stat_kinds];	/* threads that have exited */
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+
+/* ----- Slots ------------------------------------------------------------- */
+
+
+static void retire(void *arg)
+{
+	struct dagcount_slot *s = arg;
+	struct dagcount_slot **anchor;
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	for (anchor = &slots; *anchor != s; anchor = &(*anchor)->next);
+	*anchor = s->next;
+	for (i = 0; i != libdag_stat_kinds; i++)
+		retired[i] += s->count[i];
+	pthread_mutex_unlock(&mutex);
+	free(s);
+	dagcount_slot = NULL;
+}
+
+
+static void key_create(void)
+{
+	pthread_key_create(&key, retire);
+}
+
+
+struct dagcount_slot *dagcount_register(void)
+{
+	struct dagcount_slot *s;
+
+	if (posix_memalign((void **) &s, DAGCOUNT_LINE_BYTES, sizeof(*s))) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(s, 0, sizeof(*s));
+	pthread_once(&once, key_create);
+	pthread_setspecific(key, s);
+
+	pthread_mutex_lock(&mutex);
+	s->next = slots;
+	slots = s;
+	pthread_mutex_unlock(&mutex);
+	dagcount_slot = s;
+	return s;
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+bool libdag_stats_enabled(void)
+{
+	return 1;
+}
+
+
+void libdag_stats_snapshot(struct libdag_stats *res)
+{
+	const struct dagcount_slot *s;
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i != libdag_stat_kinds; i++)
+		res->count[i] = retired[i];
+	for (s = slots; s; s = s->next)
+		for (i = 0; i != libdag_stat_kinds; i++)
+			res->count[i] +=
+			    __atomic_load_n(&s->count[i], __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mutex);
+}
+
+#endif /* !NO_STATS */
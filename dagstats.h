@@ -0,0 +1,56 @@
+/*
+ * dagstats.h - Runtime statistics counters
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGSTATS_H
+#define	LIBDAG_DAGSTATS_H
+
+/*
+ * Counters are kept per thread, in cache-line-sized slots, so counting
+ * costs a thread-local add and never bounces cache lines between CPUs. A
+ * snapshot sums all slots, including those of threads that have exited.
+ *
+ * Counters are monotonic, which is what Prometheus expects of a "counter".
+ * libdag built with NO_STATS=1 counts nothing, and snapshots are all zero.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+enum libdag_stat {
+	ls_hashimoto,		/* hashes computed, per variant */
+	ls_hashimoto_fd,
+	ls_hashimoto_dh,
+	ls_hashimoto_light,
+	ls_dag_lines_read,	/* DAG lines read by hashimoto variants */
+	ls_preads,		/* pread system calls by dagio */
+	ls_dataset_items,	/* DAG items generated (two per line) */
+	ls_bytes_written,	/* DAG bytes written through dagio */
+	libdag_stat_kinds
+};
+
+struct libdag_stats {
+	uint64_t	count[libdag_stat_kinds];
+};
+
+
+/*
+ * Names are suitable as metric name suffixes, e.g., "libdag_" + name +
+ * "_total".
+ */
+const char *libdag_stat_name(enum libdag_stat stat);
+
+/*
+ * Returns 0 if libdag was built with NO_STATS.
+ */
+bool libdag_stats_enabled(void);
+
+void libdag_stats_snapshot(struct libdag_stats *res);
+
+#endif /* !LIBDAG_DAGSTATS_H */
@@ -0,0 +1,497 @@
+/*
+ * dagstripe.c - Split a DAG into per-channel memory images
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "dagio.h"
+#include "dagstripe.h"
+
+
+#define	BATCH_LINES	(1 << 16)	/* 8 MB */
+#define	LINE_WORDS	(DAG_LINE_BYTES / WORD_BYTES)
+
+
+struct export {
+	const struct dagstripe_cfg *cfg;
+	const uint8_t	*src;		/* current batch */
+	uint32_t	first;		/* first line of the batch */
+	uint32_t	n;		/* lines in the batch */
+	bool		done;
+	pthread_barrier_t barrier;
+};
+
+struct channel {
+	struct export	*e;
+	unsigned	index;
+	const char	*path;
+	int		fd;
+	uint8_t		*buf;
+	pthread_t	thread;
+};
+
+struct dagstripe_stats {
+	struct dagstripe_cfg cfg;
+	uint64_t	*count;		/* [channel * banks + bank] */
+	unsigned	*per_ch;	/* accesses of this nonce */
+	uint64_t	nonces;
+	uint64_t	sum_max;	/* sum of per-nonce channel maxima */
+	unsigned	worst_max;
+};
+
+
+static const char *mode_names[] = {
+	[dsm_line]	= "line",
+	[dsm_word]	= "word",
+	[dsm_bit]	= "bit",
+};
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+const char *dagstripe_mode_name(enum dagstripe_mode mode)
+{
+	return mode < dagstripe_modes ? mode_names[mode] : "???";
+}
+
+
+int dagstripe_mode_code(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i != dagstripe_modes; i++)
+		if (!strcmp(name, mode_names[i]))
+			return i;
+	return -1;
+}
+
+
+static void defaults(struct dagstripe_cfg *res, const struct dagstripe_cfg *cfg)
+{
+	*res = *cfg;
+	if (!res->granule)
+		res->granule = 1;
+	if (!res->banks)
+		res->banks = 16;
+	if (!res->row_bytes)
+		res->row_bytes = 2048;
+}
+
+
+bool dagstripe_check(const struct dagstripe_cfg *cfg)
+{
+	struct dagstripe_cfg c;
+
+	defaults(&c, cfg);
+	if (!c.channels)
+		return 0;
+	switch (c.mode) {
+	case dsm_line:
+		return 1;
+	case dsm_word:
+		return c.channels * c.granule <= LINE_WORDS &&
+		    !(LINE_WORDS % (c.channels * c.granule));
+	case dsm_bit:
+		return c.channels <= 32 && !(32 % c.channels);
+	default:
+		return 0;
+	}
+}
+
+
+uint64_t dagstripe_channel_bytes(const struct dagstripe_cfg *cfg,
+    uint32_t full_lines, unsigned channel)
+{
+	struct dagstripe_cfg c;
+	uint32_t units, rest;
+	uint64_t lines;
+
+	defaults(&c, cfg);
+	if (c.mode != dsm_line)
+		return (uint64_t) full_lines * DAG_LINE_BYTES / c.channels;
+
+	units = full_lines / c.granule;
+	rest = full_lines % c.granule;
+	lines = (uint64_t) (units / c.channels +
+	    (channel < units % c.channels)) * c.granule;
+	if (rest && units % c.channels == channel)
+		lines += rest;
+	return lines * DAG_LINE_BYTES;
+}
+
+
+static void checked(struct dagstripe_cfg *res, const struct dagstripe_cfg *cfg)
+{
+	if (!dagstripe_check(cfg)) {
+		fprintf(stderr, "invalid %s interleave\n",
+		    dagstripe_mode_name(cfg->mode));
+		exit(1);
+	}
+	defaults(res, cfg);
+}
+
+
+/* ----- Extraction -------------------------------------------------------- */
+
+
+/*
+ * Line batches start at a multiple of granule * channels, so unit "u" of
+ * the batch belongs to channel u % channels. With any interleave, a batch
+ * yields the same number of bytes, batch / channels lines, for each channel.
+ */
+
+static size_t extract_line(const struct dagstripe_cfg *cfg, unsigned ch,
+    uint8_t *out, const uint8_t *src, uint32_t n)
+{
+	size_t unit = (size_t) cfg->granule * DAG_LINE_BYTES;
+	size_t bytes = (size_t) n * DAG_LINE_BYTES;
+	size_t pos, k;
+	uint8_t *p = out;
+
+	for (pos = unit * ch; pos < bytes; pos += unit * cfg->channels) {
+		k = bytes - pos < unit ? bytes - pos : unit;
+		memcpy(p, src + pos, k);
+		p += k;
+	}
+	return p - out;
+}
+
+
+static size_t extract_word(const struct dagstripe_cfg *cfg, unsigned ch,
+    uint8_t *out, const uint8_t *src, uint32_t n)
+{
+	size_t chunk = (size_t) cfg->granule * WORD_BYTES;
+	uint8_t *p = out;
+	uint32_t i;
+	unsigned j;
+
+	for (i = 0; i != n; i++) {
+		for (j = ch * cfg->granule; j < LINE_WORDS;
+		    j += cfg->channels * cfg->granule) {
+			memcpy(p, src + j * WORD_BYTES, chunk);
+			p += chunk;
+		}
+		src += DAG_LINE_BYTES;
+	}
+	return p - out;
+}
+
+
+static size_t extract_bit(const struct dagstripe_cfg *cfg, unsigned ch,
+    uint8_t *out, const uint8_t *src, uint32_t n)
+{
+	uint8_t *p = out;
+	uint64_t acc = 0;
+	unsigned have = 0;
+	uint32_t v;
+	size_t i;
+	unsigned b;
+
+	for (i = 0; i != (size_t) n * LINE_WORDS; i++) {
+		v = read32(src + i * WORD_BYTES) >> ch;
+		for (b = ch; b < 32; b += cfg->channels) {
+			acc |= (uint64_t) (v & 1) << have;
+			v >>= cfg->channels;
+			if (++have == 64) {
+				write64(p, acc);
+				p += 8;
+				acc = 0;
+				have = 0;
+			}
+		}
+	}
+	/* a line is 1024 / channels bits, so this is a whole number of bytes */
+	while (have) {
+		*p++ = acc;
+		acc >>= 8;
+		have -= 8;
+	}
+	return p - out;
+}
+
+
+/* ----- Export ------------------------------------------------------------ */
+
+
+static void write_all(const struct channel *c, const uint8_t *buf,
+    size_t bytes)
+{
+	ssize_t got;
+
+	while (bytes) {
+		got = write(c->fd, buf, bytes);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(c->path);
+			exit(1);
+		}
+		buf += got;
+		bytes -= got;
+	}
+}
+
+
+static void *channel_thread(void *arg)
+{
+	struct channel *c = arg;
+	struct export *e = c->e;
+	size_t bytes;
+
+	while (1) {
+		pthread_barrier_wait(&e->barrier);
+		if (e->done)
+			break;
+		switch (e->cfg->mode) {
+		case dsm_line:
+			bytes = extract_line(e->cfg, c->index, c->buf, e->src,
+			    e->n);
+			break;
+		case dsm_word:
+			bytes = extract_word(e->cfg, c->index, c->buf, e->src,
+			    e->n);
+			break;
+		case dsm_bit:
+			bytes = extract_bit(e->cfg, c->index, c->buf, e->src,
+			    e->n);
+			break;
+		default:
+			abort();
+		}
+		write_all(c, c->buf, bytes);
+		pthread_barrier_wait(&e->barrier);
+	}
+	return NULL;
+}
+
+
+static void export(const struct dagstripe_cfg *cfg, const uint8_t *dag,
+    struct dag_handle *h, uint32_t full_lines, char *const *paths)
+{
+	struct dagstripe_cfg c;
+	struct export e;
+	struct channel *ch;
+	uint8_t *buf = NULL;
+	uint32_t batch, n;
+	unsigned i;
+	int err;
+
+	checked(&c, cfg);
+
+	batch = BATCH_LINES;
+	if (c.mode == dsm_line) {
+		batch = BATCH_LINES / (c.granule * c.channels);
+		batch = (batch ? batch : 1) * c.granule * c.channels;
+	}
+	if (!dag)
+		buf = alloc_size((size_t) batch * DAG_LINE_BYTES);
+
+	e.cfg = &c;
+	e.done = 0;
+	pthread_barrier_init(&e.barrier, NULL, c.channels + 1);
+
+	ch = alloc_size(sizeof(struct channel) * c.channels);
+	for (i = 0; i != c.channels; i++) {
+		ch[i].e = &e;
+		ch[i].index = i;
+		ch[i].path = paths[i];
+		ch[i].fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (ch[i].fd < 0) {
+			perror(paths[i]);
+			exit(1);
+		}
+		ch[i].buf = alloc_size((size_t) batch * DAG_LINE_BYTES /
+		    c.channels);
+		err = pthread_create(&ch[i].thread, NULL, channel_thread,
+		    ch + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	for (e.first = 0; e.first != full_lines; e.first += n) {
+		n = full_lines - e.first < batch ? full_lines - e.first : batch;
+		if (dag) {
+			e.src = dag + (size_t) e.first * DAG_LINE_BYTES;
+		} else {
+			dagio_pread(h, buf, n, e.first);
+			e.src = buf;
+		}
+		e.n = n;
+		pthread_barrier_wait(&e.barrier);	/* start */
+		pthread_barrier_wait(&e.barrier);	/* written */
+	}
+	e.done = 1;
+	pthread_barrier_wait(&e.barrier);
+
+	for (i = 0; i != c.channels; i++) {
+		pthread_join(ch[i].thread, NULL);
+		if (close(ch[i].fd) < 0) {
+			perror(ch[i].path);
+			exit(1);
+		}
+		free(ch[i].buf);
+	}
+	pthread_barrier_destroy(&e.barrier);
+	free(ch);
+	free(buf);
+}
+
+
+void dagstripe_export_mem(const struct dagstripe_cfg *cfg, const void *dag,
+    uint32_t full_lines, char *const *paths)
+{
+	export(cfg, dag, NULL, full_lines, paths);
+}
+
+
+void dagstripe_export(const struct dagstripe_cfg *cfg, struct dag_handle *h,
+    char *const *paths)
+{
+	export(cfg, NULL, h, dagio_full_lines(h), paths);
+}
+
+
+/* ----- Access analysis --------------------------------------------------- */
+
+
+struct dagstripe_stats *dagstripe_stats_new(const struct dagstripe_cfg *cfg)
+{
+	struct dagstripe_stats *s = alloc_type(struct dagstripe_stats);
+	size_t bytes;
+
+	checked(&s->cfg, cfg);
+	bytes = sizeof(uint64_t) * s->cfg.channels * s->cfg.banks;
+	s->count = alloc_size(bytes);
+	memset(s->count, 0, bytes);
+	s->per_ch = alloc_size(sizeof(unsigned) * s->cfg.channels);
+	s->nonces = 0;
+	s->sum_max = 0;
+	s->worst_max = 0;
+	return s;
+}
+
+
+/*
+ * Line interleaves send each access to one channel. Word and bit interleaves
+ * read a slice of the line from every channel, at the same offset.
+ */
+
+void dagstripe_account(struct dagstripe_stats *s, const uint32_t *line)
+{
+	const struct dagstripe_cfg *c = &s->cfg;
+	unsigned *per_ch = s->per_ch;
+	unsigned max = 0;
+	uint32_t unit;
+	uint64_t off;
+	unsigned i, ch, bank;
+
+	memset(per_ch, 0, sizeof(unsigned) * c->channels);
+	for (i = 0; i != ACCESSES; i++) {
+		if (c->mode == dsm_line) {
+			unit = line[i] / c->granule;
+			ch = unit % c->channels;
+			off = ((uint64_t) (unit / c->channels) * c->granule +
+			    line[i] % c->granule) * DAG_LINE_BYTES;
+			bank = off / c->row_bytes % c->banks;
+			s->count[ch * c->banks + bank]++;
+			per_ch[ch]++;
+		} else {
+			off = (uint64_t) line[i] * DAG_LINE_BYTES / c->channels;
+			bank = off / c->row_bytes % c->banks;
+			for (ch = 0; ch != c->channels; ch++) {
+				s->count[ch * c->banks + bank]++;
+				per_ch[ch]++;
+			}
+		}
+	}
+	for (ch = 0; ch != c->channels; ch++)
+		if (per_ch[ch] > max)
+			max = per_ch[ch];
+	s->sum_max += max;
+	if (max > s->worst_max)
+		s->worst_max = max;
+	s->nonces++;
+}
+
+
+void dagstripe_report(const struct dagstripe_stats *s, FILE *file)
+{
+	const struct dagstripe_cfg *c = &s->cfg;
+	uint64_t total = 0, max_ch = 0, max_bank = 0, sum;
+	unsigned ch, bank, max_ch_i = 0, max_bank_i = 0;
+	double mean;
+
+	fprintf(file, "%s interleave, %u channels",
+	    dagstripe_mode_name(c->mode), c->channels);
+	if (c->mode != dsm_bit)
+		fprintf(file, ", granule %u %s%s", c->granule,
+		    dagstripe_mode_name(c->mode), c->granule == 1 ? "" : "s");
+	fprintf(file, ", %u banks, %u byte rows\n", c->banks, c->row_bytes);
+	fprintf(file, "%llu nonces\n", (unsigned long long) s->nonces);
+	if (!s->nonces)
+		return;
+
+	for (ch = 0; ch != c->channels; ch++)
+		for (bank = 0; bank != c->banks; bank++)
+			total += s->count[ch * c->banks + bank];
+
+	fprintf(file, "\n%-8s %14s %8s\n", "channel", "accesses", "share");
+	for (ch = 0; ch != c->channels; ch++) {
+		sum = 0;
+		for (bank = 0; bank != c->banks; bank++) {
+			sum += s->count[ch * c->banks + bank];
+			if (s->count[ch * c->banks + bank] > max_bank) {
+				max_bank = s->count[ch * c->banks + bank];
+				max_bank_i = ch * c->banks + bank;
+			}
+		}
+		if (sum > max_ch) {
+			max_ch = sum;
+			max_ch_i = ch;
+		}
+		fprintf(file, "%-8u %14llu %7.3f%%\n", ch,
+		    (unsigned long long) sum, 100.0 * sum / total);
+	}
+
+	/* per-nonce means are in accesses that reach a channel */
+	mean = (double) total / s->nonces / c->channels;
+	fprintf(file, "\nchannel max/mean %.4f (channel %u)\n",
+	    (double) max_ch * c->channels / total, max_ch_i);
+	fprintf(file, "bank max/mean %.4f (channel %u bank %u)\n",
+	    (double) max_bank * c->channels * c->banks / total,
+	    max_bank_i / c->banks, max_bank_i % c->banks);
+	fprintf(file, "per nonce, busiest channel/mean: average %.3f, "
+	    "worst %.3f\n", s->sum_max / (double) s->nonces / mean,
+	    s->worst_max / mean);
+}
+
+
+void dagstripe_stats_free(struct dagstripe_stats *s)
+{
+	free(s->count);
+	free(s->per_ch);
+	free(s);
+}
@@ -0,0 +1,100 @@
+/*
+ * dagstripe.h - Split a DAG into per-channel memory images
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGSTRIPE_H
+#define	LIBDAG_DAGSTRIPE_H
+
+/*
+ * Interleaves:
+ *
+ * line	DAG lines go round-robin to the channels, "granule" lines at a time.
+ *	Each access reads from one channel.
+ * word	The 32-bit words of each line go round-robin to the channels,
+ *	"granule" words at a time. channels * granule must divide 32, so each
+ *	channel gets the same part of every line, and each access reads from
+ *	all channels.
+ * bit	Bit k of each 32-bit word goes to channel k % channels, and the bits
+ *	a channel gets are packed LSB first. "channels" must divide 32.
+ *
+ * Within a channel, consecutive rows of "row_bytes" go round-robin to the
+ * "banks" banks. The bank layout only matters for the access analysis.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+struct dag_handle;
+struct dagstripe_stats;
+
+
+enum dagstripe_mode {
+	dsm_line	= 0,
+	dsm_word	= 1,
+	dsm_bit		= 2,
+	dagstripe_modes	= 3	/* must be last */
+};
+
+struct dagstripe_cfg {
+	enum dagstripe_mode mode;
+	unsigned	channels;
+	unsigned	granule;	/* lines or words, 0 for 1 */
+	unsigned	banks;		/* per channel, 0 for 16 */
+	unsigned	row_bytes;	/* 0 for 2048 */
+};
+
+
+const char *dagstripe_mode_name(enum dagstripe_mode mode);
+
+/*
+ * Returns enum dagstripe_mode, -1 if no such mode is known.
+ */
+int dagstripe_mode_code(const char *name);
+
+/*
+ * Returns 0 if the configuration can't be used.
+ */
+bool dagstripe_check(const struct dagstripe_cfg *cfg);
+
+/*
+ * Bytes of a channel image. Line interleaves can leave channels with
+ * different sizes.
+ */
+uint64_t dagstripe_channel_bytes(const struct dagstripe_cfg *cfg,
+    uint32_t full_lines, unsigned channel);
+
+
+/* ----- Export ------------------------------------------------------------ */
+
+/*
+ * Write one image per channel, to paths[0] ... paths[channels - 1], with one
+ * thread per image. The source is read once, in batches, from memory (e.g.,
+ * mdag_addr) or a dagio handle. Both exit on error, including an invalid
+ * configuration.
+ */
+void dagstripe_export_mem(const struct dagstripe_cfg *cfg, const void *dag,
+    uint32_t full_lines, char *const *paths);
+void dagstripe_export(const struct dagstripe_cfg *cfg, struct dag_handle *h,
+    char *const *paths);
+
+
+/* ----- Access analysis --------------------------------------------------- */
+
+/*
+ * dagstripe_account takes the ACCESSES lines of one nonce, e.g., from
+ * mix_dag_line or a dagtrace record. The report shows how accesses spread
+ * over channels and banks, overall and per nonce.
+ */
+struct dagstripe_stats *dagstripe_stats_new(const struct dagstripe_cfg *cfg);
+void dagstripe_account(struct dagstripe_stats *s, const uint32_t *line);
+void dagstripe_report(const struct dagstripe_stats *s, FILE *file);
+void dagstripe_stats_free(struct dagstripe_stats *s);
+
+#endif /* !LIBDAG_DAGSTRIPE_H */
@@ -0,0 +1,210 @@
+/*
+ * dagthrottle.c - DAG generation in the background, within a CPU budget
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for SCHED_IDLE */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagthrottle.h"
+
+
+#define	DEFAULT_SLICE	64
+#define	DEFAULT_INTERVAL_MS 100
+
+
+struct throttle {
+	uint8_t		*dag;
+	unsigned	start;
+	unsigned	lines;
+	const uint8_t	*cache;
+	unsigned	cache_bytes;
+	unsigned	slice;
+	unsigned	rate;
+	bool		idle;
+	int		nice;
+	double		t0;
+
+	unsigned	next;		/* next line to claim, relative */
+	unsigned	duty;		/* current duty cycle */
+	unsigned	running;	/* threads still running */
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static void sleep_until(double t)
+{
+	struct timespec ts = {
+		.tv_sec		= t,
+		.tv_nsec	= (t - (time_t) t) * 1e9,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+}
+
+
+/* ----- Workers ----------------------------------------------------------- */
+
+
+static void lower_priority(const struct throttle *t)
+{
+	struct sched_param sp = { .sched_priority = 0 };
+
+	if (t->idle)
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+	else if (t->nice)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), t->nice);
+}
+
+
+static void *throttle_thread(void *arg)
+{
+	struct throttle *t = arg;
+	unsigned pos, n, duty;
+	double a, b, wake;
+
+	lower_priority(t);
+	while (1) {
+		pos = __atomic_fetch_add(&t->next, t->slice, __ATOMIC_RELAXED);
+		if (pos >= t->lines)
+			break;
+		n = t->lines - pos < t->slice ? t->lines - pos : t->slice;
+
+		a = now();
+		calc_dataset_range(t->dag + (size_t) pos * DAG_LINE_BYTES,
+		    t->start + pos, n, t->cache, t->cache_bytes);
+		b = now();
+
+		/*
+		 * Slices are claimed in order, so the slice ending at line
+		 * "pos + n" must not finish before (pos + n) / rate.
+		 */
+		wake = b;
+		duty = __atomic_load_n(&t->duty, __ATOMIC_RELAXED);
+		if (duty < 100)
+			wake = b + (b - a) * (100 - duty) / duty;
+		if (t->rate && wake < t->t0 + (double) (pos + n) / t->rate)
+			wake = t->t0 + (double) (pos + n) / t->rate;
+		if (wake > b)
+			sleep_until(wake);
+	}
+	__atomic_sub_fetch(&t->running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+/* ----- Duty cycle control ------------------------------------------------ */
+
+
+/*
+ * AIMD: back off quickly when the foreground suffers, recover slowly.
+ */
+
+static unsigned adapt(unsigned duty, unsigned max, unsigned latency,
+    unsigned target)
+{
+	unsigned step = max / 10 ? max / 10 : 1;
+
+	if (!latency)
+		return duty;
+	if (latency > target)
+		return duty > 1 ? duty / 2 : 1;
+	return duty + step < max ? duty + step : max;
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+void dagthrottle_range(uint8_t *dag, unsigned start, unsigned lines,
+    const uint8_t *cache, unsigned cache_bytes,
+    const struct dagthrottle_cfg *cfg, struct dagthrottle_stats *stats)
+{
+	unsigned threads = cfg->threads ? cfg->threads : 1;
+	unsigned max_duty = cfg->duty && cfg->duty < 100 ? cfg->duty : 100;
+	unsigned interval = cfg->interval_ms ? cfg->interval_ms :
+	    DEFAULT_INTERVAL_MS;
+	struct throttle t = {
+		.dag		= dag,
+		.start		= start,
+		.lines		= lines,
+		.cache		= cache,
+		.cache_bytes	= cache_bytes,
+		.slice		= cfg->slice_lines ? cfg->slice_lines :
+				    DEFAULT_SLICE,
+		.rate		= cfg->rate,
+		.idle		= cfg->idle,
+		.nice		= cfg->nice,
+		.next		= 0,
+		.duty		= max_duty,
+		.running	= threads,
+	};
+	unsigned min_duty = max_duty;
+	unsigned duty;
+	double duty_time = 0;
+	double last, tick, t1;
+	pthread_t *tids;
+	unsigned i;
+	int err;
+
+	t.t0 = last = tick = now();
+	tids = alloc_size(sizeof(pthread_t) * threads);
+	for (i = 0; i != threads; i++) {
+		err = pthread_create(tids + i, NULL, throttle_thread, &t);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	/* without a probe, there's nothing to adapt, so just wait */
+	while (cfg->latency && __atomic_load_n(&t.running, __ATOMIC_ACQUIRE)) {
+		sleep_until(tick += interval * 1e-3);
+		duty = adapt(t.duty, max_duty, cfg->latency(cfg->user),
+		    cfg->target_us);
+		t1 = now();
+		duty_time += t.duty * (t1 - last);
+		last = t1;
+		if (duty < min_duty)
+			min_duty = duty;
+		__atomic_store_n(&t.duty, duty, __ATOMIC_RELAXED);
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	if (stats) {
+		t1 = now();
+		duty_time += t.duty * (t1 - last);
+		stats->seconds = t1 - t.t0;
+		stats->min_duty = min_duty;
+		stats->avg_duty = stats->seconds > 0 ?
+		    duty_time / stats->seconds + 0.5 : max_duty;
+	}
+}
@@ -0,0 +1,69 @@
+/*
+ * dagthrottle.h - DAG generation in the background, within a CPU budget
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGTHROTTLE_H
+#define	LIBDAG_DAGTHROTTLE_H
+
+/*
+ * Generating a DAG on a host that is also hashing takes cores and DRAM
+ * bandwidth away from the foreground work. Throttled generation runs on a
+ * fixed number of threads at low priority, and works in small slices. After
+ * each slice, a thread sleeps long enough to stay within its duty cycle and
+ * the overall line rate.
+ *
+ * If the caller provides a latency probe, the duty cycle adapts: it is
+ * halved whenever the foreground latency exceeds the target, and grows back
+ * slowly (by a tenth of the configured duty cycle) while it doesn't.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+struct dagthrottle_cfg {
+	unsigned	threads;	/* 0 for 1 */
+	unsigned	duty;		/* percent of the time each thread
+					   computes, 0 for 100 */
+	unsigned	slice_lines;	/* lines per slice, 0 for 64 */
+	/*
+	 * Upper limit for the lines generated per second, by all threads
+	 * together, 0 for unlimited. Each line reads
+	 * 2 * DATASET_PARENTS * HASH_BYTES (32 kB) from the light cache, so
+	 * this also limits memory traffic.
+	 */
+	unsigned	rate;
+	bool		idle;		/* SCHED_IDLE */
+	int		nice;		/* if not "idle", 0 to leave as is */
+
+	/*
+	 * Foreground latency, in microseconds, 0 if unknown. Called from the
+	 * calling thread about every "interval_ms".
+	 */
+	unsigned (*latency)(void *user);
+	void		*user;
+	unsigned	target_us;
+	unsigned	interval_ms;	/* 0 for 100 ms */
+};
+
+struct dagthrottle_stats {
+	double		seconds;
+	unsigned	min_duty;	/* lowest duty cycle reached */
+	unsigned	avg_duty;	/* time-weighted */
+};
+
+
+/*
+ * Like calc_dataset_range, i.e., "dag" receives line "start" at offset 0.
+ * Returns when all lines have been generated. "stats" can be NULL.
+ */
+void dagthrottle_range(uint8_t *dag, unsigned start, unsigned lines,
+    const uint8_t *cache, unsigned cache_bytes,
+    const struct dagthrottle_cfg *cfg, struct dagthrottle_stats *stats);
+
+#endif /* !LIBDAG_DAGTHROTTLE_H */
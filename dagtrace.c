@@ -0,0 +1,474 @@
+/*
+ * dagtrace.c - Binary DAG access traces
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "mine.h"
+#include "dagtrace.h"
+
+
+#define	MAGIC		"DAGTRACE"
+#define	VERSION		1
+#define	HDR_BYTES	64
+#define	BLOCK_HDR_BYTES	16
+#define	BLOCK_BYTES	(1 << 20)	/* target size of a block */
+#define	CAPTURE_CHUNK	256		/* nonces a thread takes at a time */
+
+
+struct dagtrace_writer {
+	const char	*path;
+	int		fd;
+	struct dagtrace_info info;
+	pthread_mutex_t	mutex;
+};
+
+struct dagtrace_buf {
+	struct dagtrace_writer *w;
+	unsigned	max_records;
+	unsigned	records;
+	uint64_t	first_nonce;
+	uint64_t	last_nonce;
+	uint8_t		*buf;		/* block header and records */
+};
+
+struct dagtrace_reader {
+	const char	*path;
+	FILE		*file;
+	struct dagtrace_info info;
+	unsigned	left;		/* records left in this block */
+	uint64_t	last_nonce;
+	uint8_t		*buf;		/* one record */
+};
+
+
+/* ----- Layout ------------------------------------------------------------ */
+
+
+static unsigned line_bits(unsigned full_lines)
+{
+	unsigned bits = 1;
+
+	while (bits < 32 && (full_lines - 1) >> bits)
+		bits++;
+	return bits;
+}
+
+
+static unsigned record_bytes(unsigned flags, unsigned bits)
+{
+	unsigned bytes;
+
+	if (flags & DAGTRACE_DELTA)
+		bytes = 4 + (ACCESSES * bits + 7) / 8;
+	else
+		bytes = 8 + ACCESSES * 4;
+	if (flags & DAGTRACE_MIX)
+		bytes += ACCESSES * MIX_BYTES;
+	return bytes;
+}
+
+
+static void pack_lines(uint8_t *p, const uint32_t *line, unsigned bits)
+{
+	uint64_t acc = 0;
+	unsigned have = 0;
+	unsigned i;
+
+	for (i = 0; i != ACCESSES; i++) {
+		acc |= (uint64_t) line[i] << have;
+		have += bits;
+		while (have >= 8) {
+			*p++ = acc;
+			acc >>= 8;
+			have -= 8;
+		}
+	}
+	if (have)
+		*p = acc;
+}
+
+
+static void unpack_lines(uint32_t *line, const uint8_t *p, unsigned bits)
+{
+	uint32_t mask = bits == 32 ? ~0u : (1u << bits) - 1;
+	uint64_t acc = 0;
+	unsigned have = 0;
+	unsigned i;
+
+	for (i = 0; i != ACCESSES; i++) {
+		while (have < bits) {
+			acc |= (uint64_t) *p++ << have;
+			have += 8;
+		}
+		line[i] = acc & mask;
+		acc >>= bits;
+		have -= bits;
+	}
+}
+
+
+/* ----- Writing ----------------------------------------------------------- */
+
+
+static void write_all(const struct dagtrace_writer *w, const void *buf,
+    size_t bytes)
+{
+	ssize_t got;
+
+	while (bytes) {
+		got = write(w->fd, buf, bytes);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(w->path);
+			exit(1);
+		}
+		buf = (const uint8_t *) buf + got;
+		bytes -= got;
+	}
+}
+
+
+struct dagtrace_writer *dagtrace_create(const char *path, unsigned flags,
+    unsigned full_lines, const uint8_t *header_hash)
+{
+	struct dagtrace_writer *w = alloc_type(struct dagtrace_writer);
+	uint8_t hdr[HDR_BYTES];
+
+	w->path = path;
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (w->fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	w->info.flags = flags;
+	w->info.full_lines = full_lines;
+	w->info.line_bits = line_bits(full_lines);
+	w->info.record_bytes = record_bytes(flags, w->info.line_bits);
+	memcpy(w->info.header_hash, header_hash, HEADER_HASH_BYTES);
+	pthread_mutex_init(&w->mutex, NULL);
+
+	memcpy(hdr, MAGIC, 8);
+	write32(hdr + 8, VERSION);
+	write32(hdr + 12, flags);
+	write32(hdr + 16, full_lines);
+	write32(hdr + 20, ACCESSES);
+	write32(hdr + 24, w->info.record_bytes);
+	write32(hdr + 28, w->info.line_bits);
+	memcpy(hdr + 32, header_hash, HEADER_HASH_BYTES);
+	write_all(w, hdr, HDR_BYTES);
+	return w;
+}
+
+
+void dagtrace_writer_close(struct dagtrace_writer *w)
+{
+	if (close(w->fd) < 0) {
+		perror(w->path);
+		exit(1);
+	}
+	pthread_mutex_destroy(&w->mutex);
+	free(w);
+}
+
+
+struct dagtrace_buf *dagtrace_buf_new(struct dagtrace_writer *w)
+{
+	struct dagtrace_buf *b = alloc_type(struct dagtrace_buf);
+
+	b->w = w;
+	b->max_records = BLOCK_BYTES / w->info.record_bytes;
+	if (!b->max_records)
+		b->max_records = 1;
+	b->records = 0;
+	b->buf = alloc_size(BLOCK_HDR_BYTES +
+	    (size_t) w->info.record_bytes * b->max_records);
+	return b;
+}
+
+
+static void flush(struct dagtrace_buf *b)
+{
+	struct dagtrace_writer *w = b->w;
+
+	if (!b->records)
+		return;
+	write32(b->buf, b->records);
+	write32(b->buf + 4, 0);
+	write64(b->buf + 8, b->first_nonce);
+	pthread_mutex_lock(&w->mutex);
+	write_all(w, b->buf,
+	    BLOCK_HDR_BYTES + (size_t) w->info.record_bytes * b->records);
+	pthread_mutex_unlock(&w->mutex);
+	b->records = 0;
+}
+
+
+void dagtrace_add(struct dagtrace_buf *b, const struct dagtrace_record *rec)
+{
+	const struct dagtrace_info *info = &b->w->info;
+	uint8_t *p;
+
+	if (b->records == b->max_records)
+		flush(b);
+	if (b->records && (info->flags & DAGTRACE_DELTA) &&
+	    (rec->nonce < b->last_nonce ||
+	    rec->nonce - b->last_nonce > UINT32_MAX))
+		flush(b);
+	if (!b->records)
+		b->first_nonce = b->last_nonce = rec->nonce;
+
+	p = b->buf + BLOCK_HDR_BYTES + (size_t) info->record_bytes * b->records;
+	if (info->flags & DAGTRACE_DELTA) {
+		write32(p, rec->nonce - b->last_nonce);
+		pack_lines(p + 4, rec->line, info->line_bits);
+		p += 4 + (ACCESSES * info->line_bits + 7) / 8;
+	} else {
+		unsigned i;
+
+		write64(p, rec->nonce);
+		for (i = 0; i != ACCESSES; i++)
+			write32(p + 8 + 4 * i, rec->line[i]);
+		p += 8 + ACCESSES * 4;
+	}
+	if (info->flags & DAGTRACE_MIX)
+		memcpy(p, rec->mix, ACCESSES * MIX_BYTES);
+	b->last_nonce = rec->nonce;
+	b->records++;
+}
+
+
+void dagtrace_buf_free(struct dagtrace_buf *b)
+{
+	flush(b);
+	free(b->buf);
+	free(b);
+}
+
+
+/* ----- Capture ----------------------------------------------------------- */
+
+
+struct capture {
+	struct dagtrace_writer *w;
+	const uint8_t	*dag;
+	uint64_t	next;		/* next nonce to hand out */
+	uint64_t	end;
+};
+
+
+static void *capture_thread(void *arg)
+{
+	struct capture *c = arg;
+	struct dagtrace_buf *b = dagtrace_buf_new(c->w);
+	bool mix_too = c->w->info.flags & DAGTRACE_MIX;
+	unsigned full_lines = c->w->info.full_lines;
+	struct dagtrace_record *rec = alloc_type(struct dagtrace_record);
+	uint8_t s[HASH_BYTES];
+	uint8_t mix[MIX_BYTES];
+	uint64_t nonce, end;
+	uint32_t line;
+	unsigned i;
+
+	while (1) {
+		nonce = __atomic_fetch_add(&c->next, CAPTURE_CHUNK,
+		    __ATOMIC_RELAXED);
+		if (nonce >= c->end)
+			break;
+		end = c->end - nonce < CAPTURE_CHUNK ? c->end :
+		    nonce + CAPTURE_CHUNK;
+		while (nonce != end) {
+			mix_setup(mix, s, c->w->info.header_hash, nonce);
+			for (i = 0; i != ACCESSES; i++) {
+				line = mix_dag_line(i, mix, s, full_lines);
+				mix_do_mix(mix,
+				    c->dag + (size_t) line * DAG_LINE_BYTES);
+				rec->line[i] = line;
+				if (mix_too)
+					memcpy(rec->mix[i], mix, MIX_BYTES);
+			}
+			rec->nonce = nonce++;
+			dagtrace_add(b, rec);
+		}
+	}
+	free(rec);
+	dagtrace_buf_free(b);
+	return NULL;
+}
+
+
+void dagtrace_capture(struct dagtrace_writer *w, const uint8_t *dag,
+    uint64_t nonce, uint64_t count, unsigned threads)
+{
+	struct capture c = {
+		.w	= w,
+		.dag	= dag,
+		.next	= nonce,
+		.end	= nonce + count,
+	};
+	pthread_t *tids;
+	unsigned i;
+	int err;
+
+	if (!threads)
+		threads = 1;
+	tids = alloc_size(sizeof(pthread_t) * threads);
+	for (i = 0; i != threads; i++) {
+		err = pthread_create(tids + i, NULL, capture_thread, &c);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+}
+
+
+/* ----- Reading ----------------------------------------------------------- */
+
+
+struct dagtrace_reader *dagtrace_open(const char *path)
+{
+	struct dagtrace_reader *r;
+	uint8_t hdr[HDR_BYTES];
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		return NULL;
+	if (fread(hdr, 1, HDR_BYTES, file) != HDR_BYTES ||
+	    memcmp(hdr, MAGIC, 8) || read32(hdr + 8) != VERSION ||
+	    read32(hdr + 20) != ACCESSES || !read32(hdr + 16) ||
+	    read32(hdr + 28) != line_bits(read32(hdr + 16)) ||
+	    read32(hdr + 24) != record_bytes(read32(hdr + 12),
+	    read32(hdr + 28))) {
+		fclose(file);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r = alloc_type(struct dagtrace_reader);
+	r->path = path;
+	r->file = file;
+	r->info.flags = read32(hdr + 12);
+	r->info.full_lines = read32(hdr + 16);
+	r->info.record_bytes = read32(hdr + 24);
+	r->info.line_bits = read32(hdr + 28);
+	memcpy(r->info.header_hash, hdr + 32, HEADER_HASH_BYTES);
+	r->left = 0;
+	r->buf = alloc_size(r->info.record_bytes);
+	return r;
+}
+
+
+const struct dagtrace_info *dagtrace_info(const struct dagtrace_reader *r)
+{
+	return &r->info;
+}
+
+
+static void truncated(const struct dagtrace_reader *r)
+{
+	if (ferror(r->file))
+		perror(r->path);
+	else
+		fprintf(stderr, "%s: truncated trace\n", r->path);
+	exit(1);
+}
+
+
+bool dagtrace_read(struct dagtrace_reader *r, struct dagtrace_record *rec)
+{
+	const struct dagtrace_info *info = &r->info;
+	uint8_t hdr[BLOCK_HDR_BYTES];
+	const uint8_t *p = r->buf;
+	size_t got;
+	unsigned i;
+
+	while (!r->left) {
+		got = fread(hdr, 1, BLOCK_HDR_BYTES, r->file);
+		if (!got && feof(r->file))
+			return 0;
+		if (got != BLOCK_HDR_BYTES)
+			truncated(r);
+		r->left = read32(hdr);
+		r->last_nonce = read64(hdr + 8);
+	}
+	if (fread(r->buf, 1, info->record_bytes, r->file) != info->record_bytes)
+		truncated(r);
+	r->left--;
+
+	if (info->flags & DAGTRACE_DELTA) {
+		rec->nonce = r->last_nonce + read32(p);
+		unpack_lines(rec->line, p + 4, info->line_bits);
+		p += 4 + (ACCESSES * info->line_bits + 7) / 8;
+	} else {
+		rec->nonce = read64(p);
+		for (i = 0; i != ACCESSES; i++)
+			rec->line[i] = read32(p + 8 + 4 * i);
+		p += 8 + ACCESSES * 4;
+	}
+	for (i = 0; i != ACCESSES; i++)
+		if (rec->line[i] >= info->full_lines) {
+			fprintf(stderr, "%s: line %u beyond the DAG\n",
+			    r->path, rec->line[i]);
+			exit(1);
+		}
+	if (info->flags & DAGTRACE_MIX)
+		memcpy(rec->mix, p, ACCESSES * MIX_BYTES);
+	r->last_nonce = rec->nonce;
+	return 1;
+}
+
+
+uint64_t dagtrace_replay(struct dagtrace_reader *r,
+    const struct dagtrace_model *m)
+{
+	struct dagtrace_record *rec = alloc_type(struct dagtrace_record);
+	bool mix = r->info.flags & DAGTRACE_MIX;
+	uint64_t n = 0;
+	unsigned i;
+
+	while (dagtrace_read(r, rec)) {
+		if (m->nonce)
+			m->nonce(m->user, rec->nonce);
+		if (m->access)
+			for (i = 0; i != ACCESSES; i++)
+				m->access(m->user, i, rec->line[i],
+				    mix ? rec->mix[i] : NULL);
+		n++;
+	}
+	free(rec);
+	return n;
+}
+
+
+void dagtrace_reader_close(struct dagtrace_reader *r)
+{
+	fclose(r->file);
+	free(r->buf);
+	free(r);
+}
@@ -0,0 +1,137 @@
+/*
+ * dagtrace.h - Binary DAG access traces
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGTRACE_H
+#define	LIBDAG_DAGTRACE_H
+
+/*
+ * A trace records, for each nonce, the DAG line each of the ACCESSES rounds
+ * reads, and optionally the mix after each round.
+ *
+ * File layout (all integers little-endian):
+ *
+ * Header (64 bytes):
+ *	magic "DAGTRACE", u32 version, u32 flags, u32 full_lines,
+ *	u32 accesses, u32 record_bytes, u32 line_bits, header_hash[32]
+ *
+ * Blocks, until the end of the file:
+ *	u32 records, u32 reserved (0), u64 first_nonce,
+ *	then "records" records of record_bytes each
+ *
+ * Record, plain:
+ *	u64 nonce, u32 line[accesses]
+ * Record, with DAGTRACE_DELTA:
+ *	u32 nonce - previous nonce (the first record holds nonce - first_nonce),
+ *	line[accesses] packed LSB first into line_bits each
+ * If DAGTRACE_MIX is set, either kind is followed by accesses * MIX_BYTES of
+ * mix, as it is after each round.
+ *
+ * DAG lines are uniformly distributed, so there's nothing to gain from
+ * encoding them as differences. DAGTRACE_DELTA stores them with just as many
+ * bits as full_lines needs (e.g., 24 instead of 32 for current epochs), and
+ * nonces, which are mostly consecutive, as differences.
+ *
+ * Each thread fills its own block buffer and only takes the file lock to
+ * write a full block, so blocks of different threads appear in any order.
+ * Records within a block are in the order they were added.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "dag.h"
+#include "mine.h"
+
+
+#define	DAGTRACE_DELTA	(1 << 0)	/* packed lines, nonce differences */
+#define	DAGTRACE_MIX	(1 << 1)	/* record the mix after each round */
+
+
+struct dagtrace_info {
+	unsigned	flags;
+	unsigned	full_lines;
+	unsigned	record_bytes;
+	unsigned	line_bits;
+	uint8_t		header_hash[HEADER_HASH_BYTES];
+};
+
+struct dagtrace_record {
+	uint64_t	nonce;
+	uint32_t	line[ACCESSES];
+	uint8_t		mix[ACCESSES][MIX_BYTES];	/* if DAGTRACE_MIX */
+};
+
+/*
+ * Trace model for replay. "nonce" is called before the accesses of each
+ * record, "access" for each access. "mix" is NULL unless the trace has
+ * DAGTRACE_MIX. Either callback can be NULL.
+ */
+
+struct dagtrace_model {
+	void (*nonce)(void *user, uint64_t nonce);
+	void (*access)(void *user, unsigned round, uint32_t line,
+	    const uint8_t *mix);
+	void	*user;
+};
+
+
+struct dagtrace_writer;
+struct dagtrace_buf;
+struct dagtrace_reader;
+
+
+/* ----- Writing ----------------------------------------------------------- */
+
+/*
+ * dagtrace_create exits on error.
+ */
+struct dagtrace_writer *dagtrace_create(const char *path, unsigned flags,
+    unsigned full_lines, const uint8_t *header_hash);
+void dagtrace_writer_close(struct dagtrace_writer *w);
+
+/*
+ * Per-thread buffer. dagtrace_buf_free writes what is left.
+ */
+struct dagtrace_buf *dagtrace_buf_new(struct dagtrace_writer *w);
+void dagtrace_add(struct dagtrace_buf *b, const struct dagtrace_record *rec);
+void dagtrace_buf_free(struct dagtrace_buf *b);
+
+/*
+ * Run hashimoto on "count" nonces starting at "nonce", with "threads"
+ * threads (0 for 1), and record their accesses. The final KEC-256 doesn't
+ * affect the accesses, so it is skipped.
+ */
+void dagtrace_capture(struct dagtrace_writer *w, const uint8_t *dag,
+    uint64_t nonce, uint64_t count, unsigned threads);
+
+
+/* ----- Reading ----------------------------------------------------------- */
+
+/*
+ * dagtrace_open returns NULL and sets errno if the file can't be opened or
+ * is not a trace.
+ */
+struct dagtrace_reader *dagtrace_open(const char *path);
+const struct dagtrace_info *dagtrace_info(const struct dagtrace_reader *r);
+
+/*
+ * Returns 0 at the end of the trace. Exits on a truncated or corrupt file.
+ */
+bool dagtrace_read(struct dagtrace_reader *r, struct dagtrace_record *rec);
+
+/*
+ * Feed the rest of the trace to the model. Returns the number of records.
+ */
+uint64_t dagtrace_replay(struct dagtrace_reader *r,
+    const struct dagtrace_model *m);
+
+void dagtrace_reader_close(struct dagtrace_reader *r);
+
+#endif /* !LIBDAG_DAGTRACE_H */
@@ -0,0 +1,398 @@
+/*
+ * dagverify.c - Verify (and repair) a DAG against the light cache
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for SCHED_IDLE */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagio.h"
+#include "dagasic.h"
+#include "dagverify.h"
+
+
+#define	BATCH_LINES	1024	/* 128 kB */
+
+
+struct range {
+	uint32_t	first;
+	uint32_t	lines;
+};
+
+struct job {
+	struct dag_handle *h;
+	const uint8_t	*cache;
+	unsigned	cache_bytes;
+	uint32_t	full_lines;
+	unsigned	samples;
+	uint64_t	seed;
+	bool		repair;
+	bool		idle;
+	bool		asic;		/* compare in the ASIC layout */
+	uint64_t	next;		/* next batch or sample */
+
+	pthread_mutex_t	mutex;
+	struct range	*ranges;
+	unsigned	n_ranges;
+	unsigned	max_ranges;
+	uint64_t	checked;
+	uint64_t	repaired;
+};
+
+
+/* ----- Helper functions -------------------------------------------------- */
+
+
+static void set_idle(void)
+{
+	struct sched_param sp = { .sched_priority = 0 };
+
+	/* best effort */
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+}
+
+
+static uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+
+static void add_range(struct job *job, uint32_t first, uint32_t lines)
+{
+	pthread_mutex_lock(&job->mutex);
+	if (job->n_ranges == job->max_ranges) {
+		job->max_ranges = job->max_ranges ? 2 * job->max_ranges : 16;
+		job->ranges = realloc(job->ranges,
+		    sizeof(struct range) * job->max_ranges);
+		if (!job->ranges) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	job->ranges[job->n_ranges].first = first;
+	job->ranges[job->n_ranges].lines = lines;
+	job->n_ranges++;
+	pthread_mutex_unlock(&job->mutex);
+}
+
+
+/*
+ * Compare "lines" lines starting at "first", record runs of bad lines, and
+ * optionally overwrite them with the good ones.
+ */
+
+static void compare(struct job *job, const uint8_t *good, const uint8_t *got,
+    uint32_t first, unsigned lines)
+{
+	unsigned i = 0, j;
+	uint64_t repaired = 0;
+
+	while (i != lines) {
+		if (!memcmp(good + (size_t) i * DAG_LINE_BYTES,
+		    got + (size_t) i * DAG_LINE_BYTES, DAG_LINE_BYTES)) {
+			i++;
+			continue;
+		}
+		for (j = i + 1; j != lines; j++)
+			if (!memcmp(good + (size_t) j * DAG_LINE_BYTES,
+			    got + (size_t) j * DAG_LINE_BYTES, DAG_LINE_BYTES))
+				break;
+		add_range(job, first + i, j - i);
+		if (job->repair) {
+			dagio_pwrite(job->h, good + (size_t) i * DAG_LINE_BYTES,
+			    j - i, first + i);
+			repaired += j - i;
+		}
+		i = j;
+	}
+	__atomic_fetch_add(&job->checked, lines, __ATOMIC_RELAXED);
+	if (repaired)
+		__atomic_fetch_add(&job->repaired, repaired, __ATOMIC_RELAXED);
+}
+
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct range *ra = a;
+	const struct range *rb = b;
+
+	return ra->first < rb->first ? -1 : ra->first > rb->first;
+}
+
+
+/*
+ * Sort and merge overlapping or adjacent ranges. Returns the number of
+ * lines covered.
+ */
+
+static uint64_t merge_ranges(struct job *job)
+{
+	struct range *r = job->ranges;
+	uint64_t lines = 0;
+	unsigned i, n = 0;
+
+	if (!job->n_ranges)
+		return 0;
+	qsort(r, job->n_ranges, sizeof(struct range), range_cmp);
+	for (i = 1; i != job->n_ranges; i++) {
+		if (r[i].first <= r[n].first + r[n].lines) {
+			if (r[i].first + r[i].lines > r[n].first + r[n].lines)
+				r[n].lines = r[i].first + r[i].lines -
+				    r[n].first;
+		} else {
+			lines += r[n].lines;
+			r[++n] = r[i];
+		}
+	}
+	lines += r[n].lines;
+	job->n_ranges = n + 1;
+	return lines;
+}
+
+
+/* ----- Verification ------------------------------------------------------ */
+
+
+static void *verify_thread(void *arg)
+{
+	struct job *job = arg;
+	uint8_t *good = alloc_size(BATCH_LINES * DAG_LINE_BYTES);
+	uint8_t *got = alloc_size(BATCH_LINES * DAG_LINE_BYTES);
+	uint64_t k;
+	uint32_t first;
+	unsigned n;
+
+	if (job->idle)
+		set_idle();
+	while (1) {
+		k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (job->samples) {
+			if (k >= job->samples)
+				break;
+			first = splitmix64(job->seed + k) % job->full_lines;
+			n = 1;
+		} else {
+			if (k * BATCH_LINES >= job->full_lines)
+				break;
+			first = k * BATCH_LINES;
+			n = job->full_lines - first;
+			if (n > BATCH_LINES)
+				n = BATCH_LINES;
+		}
+		calc_dataset_range(good, first, n, job->cache,
+		    job->cache_bytes);
+		if (job->asic)
+			dagasic_to_asic(good, good, n);
+		dagio_pread(job->h, got, n, first);
+		compare(job, good, got, first, n);
+	}
+	free(good);
+	free(got);
+	return NULL;
+}
+
+
+static void init_job(struct job *job, struct dag_handle *h,
+    const uint8_t *cache, unsigned cache_bytes, bool repair)
+{
+	job->h = h;
+	job->cache = cache;
+	job->cache_bytes = cache_bytes;
+	job->full_lines = dagio_full_lines(h);
+	job->samples = 0;
+	job->seed = 0;
+	job->repair = repair;
+	job->idle = 0;
+	job->asic = 0;
+	job->next = 0;
+	pthread_mutex_init(&job->mutex, NULL);
+	job->ranges = NULL;
+	job->n_ranges = job->max_ranges = 0;
+	job->checked = job->repaired = 0;
+}
+
+
+uint64_t dagverify(struct dag_handle *h, const uint8_t *cache,
+    unsigned cache_bytes, const struct dagverify_cfg *cfg,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user,
+    struct dagverify_result *res)
+{
+	unsigned threads = cfg->threads;
+	struct job job;
+	pthread_t *t;
+	uint64_t bad_lines;
+	unsigned i;
+	int err;
+
+	init_job(&job, h, cache, cache_bytes, cfg->repair);
+	job.samples = cfg->samples;
+	job.seed = cfg->seed;
+	job.idle = cfg->idle;
+	job.asic = cfg->asic;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!threads)
+		threads = 1;
+	t = alloc_size(sizeof(pthread_t) * threads);
+	for (i = 0; i != threads; i++) {
+		err = pthread_create(t + i, NULL, verify_thread, &job);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+
+	bad_lines = merge_ranges(&job);
+	if (bad)
+		for (i = 0; i != job.n_ranges; i++)
+			bad(user, job.ranges[i].first, job.ranges[i].lines);
+	if (res) {
+		res->checked = job.checked;
+		res->bad = bad_lines;
+		res->ranges = job.n_ranges;
+		res->repaired = job.repaired;
+	}
+	free(job.ranges);
+	pthread_mutex_destroy(&job.mutex);
+	return bad_lines;
+}
+
+
+/* ----- Background scrubber ----------------------------------------------- */
+
+
+struct dagverify_scrub {
+	struct job	job;
+	pthread_t	thread;
+	bool		stop;
+	unsigned	lines_per_s;
+	uint64_t	bad;
+	unsigned	ranges;
+	void (*bad_fn)(void *user, uint32_t dag_line, uint32_t lines);
+	void		*user;
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static void *scrub_thread(void *arg)
+{
+	struct dagverify_scrub *s = arg;
+	struct job *job = &s->job;
+	uint8_t *good = alloc_size(BATCH_LINES * DAG_LINE_BYTES);
+	uint8_t *got = alloc_size(BATCH_LINES * DAG_LINE_BYTES);
+	double t0 = now();
+	uint64_t done = 0;
+	double ahead;
+	uint32_t first = 0;
+	unsigned n, i;
+
+	set_idle();
+	while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+		n = job->full_lines - first;
+		if (n > BATCH_LINES)
+			n = BATCH_LINES;
+		calc_dataset_range(good, first, n, job->cache,
+		    job->cache_bytes);
+		if (job->asic)
+			dagasic_to_asic(good, good, n);
+		dagio_pread(job->h, got, n, first);
+		compare(job, good, got, first, n);
+
+		for (i = 0; i != job->n_ranges; i++) {
+			s->bad += job->ranges[i].lines;
+			s->ranges++;
+			if (s->bad_fn)
+				s->bad_fn(s->user, job->ranges[i].first,
+				    job->ranges[i].lines);
+		}
+		job->n_ranges = 0;
+
+		first += n;
+		if (first == job->full_lines)
+			first = 0;
+		done += n;
+		if (s->lines_per_s) {
+			ahead = (double) done / s->lines_per_s -
+			    (now() - t0);
+			if (ahead > 0)
+				usleep(ahead * 1e6);
+		}
+	}
+	free(good);
+	free(got);
+	return NULL;
+}
+
+
+struct dagverify_scrub *dagverify_scrub_start(struct dag_handle *h,
+    const uint8_t *cache, unsigned cache_bytes, bool repair,
+    unsigned lines_per_s,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user)
+{
+	struct dagverify_scrub *s = alloc_type(struct dagverify_scrub);
+	int err;
+
+	init_job(&s->job, h, cache, cache_bytes, repair);
+	s->stop = 0;
+	s->lines_per_s = lines_per_s;
+	s->bad = 0;
+	s->ranges = 0;
+	s->bad_fn = bad;
+	s->user = user;
+	err = pthread_create(&s->thread, NULL, scrub_thread, s);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+	return s;
+}
+
+
+void dagverify_scrub_stop(struct dagverify_scrub *s,
+    struct dagverify_result *res)
+{
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELAXED);
+	pthread_join(s->thread, NULL);
+	if (res) {
+		res->checked = s->job.checked;
+		res->bad = s->bad;
+		res->ranges = s->ranges;
+		res->repaired = s->job.repaired;
+	}
+	free(s->job.ranges);
+	pthread_mutex_destroy(&s->job.mutex);
+	free(s);
+}
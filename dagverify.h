@@ -0,0 +1,65 @@
+/*
+ * dagverify.h - Verify (and repair) a DAG against the light cache
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGVERIFY_H
+#define	LIBDAG_DAGVERIFY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+struct dag_handle;
+struct dagverify_scrub;
+
+struct dagverify_cfg {
+	unsigned	threads;	/* 0 for one per CPU */
+	unsigned	samples;	/* random lines to check, 0 for all */
+	uint64_t	seed;		/* for sampling */
+	bool		repair;		/* rewrite bad lines */
+	bool		idle;		/* run threads with SCHED_IDLE */
+	bool		asic;		/* the DAG is in the ASIC layout */
+};
+
+struct dagverify_result {
+	uint64_t	checked;	/* lines checked */
+	uint64_t	bad;		/* bad lines found */
+	unsigned	ranges;		/* ranges of consecutive bad lines */
+	uint64_t	repaired;	/* lines rewritten */
+};
+
+
+/*
+ * Recompute the DAG lines from the light cache and compare them with the
+ * DAG. "bad" is called, after all lines have been checked, once for each
+ * range of consecutive bad lines, in ascending order. Returns the number of
+ * bad lines. With "repair", the handle must be writable.
+ */
+uint64_t dagverify(struct dag_handle *h, const uint8_t *cache,
+    unsigned cache_bytes, const struct dagverify_cfg *cfg,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user,
+    struct dagverify_result *res);
+
+/*
+ * Background scrubber: one SCHED_IDLE thread walks over the whole DAG again
+ * and again, at most "lines_per_s" lines per second (0 for no limit), and
+ * reports (and optionally repairs) bad ranges as it finds them. "bad" is
+ * called from the scrubber thread.
+ */
+struct dagverify_scrub *dagverify_scrub_start(struct dag_handle *h,
+    const uint8_t *cache, unsigned cache_bytes, bool repair,
+    unsigned lines_per_s,
+    void (*bad)(void *user, uint32_t dag_line, uint32_t lines), void *user);
+
+/*
+ * Stop the scrubber and return the totals so far.
+ */
+void dagverify_scrub_stop(struct dagverify_scrub *s,
+    struct dagverify_result *res);
+
+#endif /* !LIBDAG_DAGVERIFY_H */
@@ -0,0 +1,183 @@
+/*
+ * dagwarm.c - Prefault and warm up a DAG before hashing
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagio.h"
+#include "dagwarm.h"
+
+
+#ifndef MADV_POPULATE_READ
+#define	MADV_POPULATE_READ	22	/* Linux 5.14 */
+#endif
+
+
+#define	CHUNK_BYTES	(4 << 20)
+
+
+struct warm {
+	const uint8_t	*addr;		/* memory */
+	struct dag_handle *h;		/* file */
+	uint64_t	bytes;
+	uint64_t	next;		/* next chunk to claim */
+	uint64_t	done;		/* bytes done */
+	unsigned	running;	/* threads still running */
+	bool		populate;	/* MADV_POPULATE_READ works */
+};
+
+
+/* ----- Workers ----------------------------------------------------------- */
+
+
+static bool claim(struct warm *w, uint64_t *pos, uint64_t *len)
+{
+	*pos = __atomic_fetch_add(&w->next, CHUNK_BYTES, __ATOMIC_RELAXED);
+	if (*pos >= w->bytes)
+		return 0;
+	*len = w->bytes - *pos < CHUNK_BYTES ? w->bytes - *pos : CHUNK_BYTES;
+	return 1;
+}
+
+
+static void touch(const uint8_t *p, size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	const volatile uint8_t *v = p;
+	size_t i;
+
+	for (i = 0; i < len; i += page)
+		(void) v[i];
+}
+
+
+static void warm_mem(struct warm *w, uint64_t pos, uint64_t len)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) (w->addr + pos) & ~(page - 1);
+	uintptr_t end = (uintptr_t) (w->addr + pos + len);
+
+	if (__atomic_load_n(&w->populate, __ATOMIC_RELAXED)) {
+		if (!madvise((void *) start, end - start, MADV_POPULATE_READ))
+			return;
+		/* EINVAL: kernel is too old */
+		__atomic_store_n(&w->populate, 0, __ATOMIC_RELAXED);
+	}
+	touch(w->addr + pos, len);
+}
+
+
+static void *warm_thread(void *arg)
+{
+	struct warm *w = arg;
+	uint8_t *buf = NULL;
+	uint64_t pos, len;
+
+	if (w->h)
+		buf = alloc_size(CHUNK_BYTES);
+	while (claim(w, &pos, &len)) {
+		if (w->h)
+			dagio_pread(w->h, buf, len / DAG_LINE_BYTES,
+			    pos / DAG_LINE_BYTES);
+		else
+			warm_mem(w, pos, len);
+		__atomic_add_fetch(&w->done, len, __ATOMIC_RELAXED);
+	}
+	free(buf);
+	__atomic_sub_fetch(&w->running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+/* ----- Running ----------------------------------------------------------- */
+
+
+static void run(struct warm *w, const struct dagwarm_cfg *cfg)
+{
+	unsigned threads = cfg->threads;
+	unsigned interval = cfg->interval_ms ? cfg->interval_ms : 1000;
+	unsigned waited = 0;
+	pthread_t *t;
+	unsigned i;
+	int err;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!threads)
+		threads = 1;
+	w->next = 0;
+	w->done = 0;
+	w->running = threads;
+	t = alloc_size(sizeof(pthread_t) * threads);
+	for (i = 0; i != threads; i++) {
+		err = pthread_create(t + i, NULL, warm_thread, w);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	while (__atomic_load_n(&w->running, __ATOMIC_ACQUIRE)) {
+		usleep(10 * 1000);
+		waited += 10;
+		if (cfg->progress && waited >= interval) {
+			cfg->progress(cfg->user,
+			    __atomic_load_n(&w->done, __ATOMIC_RELAXED),
+			    w->bytes);
+			waited = 0;
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(t[i], NULL);
+	free(t);
+	if (cfg->progress)
+		cfg->progress(cfg->user, w->done, w->bytes);
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+int dagwarm_mem(const void *addr, size_t bytes, const struct dagwarm_cfg *cfg)
+{
+	struct warm w = {
+		.addr		= addr,
+		.h		= NULL,
+		.bytes		= bytes,
+		.populate	= 1,
+	};
+
+	run(&w, cfg);
+	/* all pages are present by now, so this is quick */
+	if (cfg->lock && mlock(addr, bytes) < 0)
+		return -errno;
+	return 0;
+}
+
+
+void dagwarm_file(struct dag_handle *h, const struct dagwarm_cfg *cfg)
+{
+	struct warm w = {
+		.addr		= NULL,
+		.h		= h,
+		.bytes		= dagio_bytes(h),
+	};
+
+	run(&w, cfg);
+}
@@ -0,0 +1,51 @@
+/*
+ * dagwarm.h - Prefault and warm up a DAG before hashing
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_DAGWARM_H
+#define	LIBDAG_DAGWARM_H
+
+/*
+ * Hashing touches the DAG in random 128 byte pieces, which is the worst way
+ * to fault it in or to fill the page cache. Warming up walks the whole DAG
+ * in large sequential chunks instead, with several threads.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct dag_handle;
+
+struct dagwarm_cfg {
+	unsigned	threads;	/* 0 for one per CPU */
+	bool		lock;		/* mlock (memory only) */
+	/*
+	 * Called from the calling thread about every "interval_ms", and once
+	 * more when done.
+	 */
+	void (*progress)(void *user, uint64_t done, uint64_t total);
+	void		*user;
+	unsigned	interval_ms;	/* 0 for 1000 ms */
+};
+
+
+/*
+ * Prefault a mapped DAG (mdag, dagshm, ...), with MADV_POPULATE_READ if the
+ * kernel has it, by reading each page otherwise. Returns 0 on success, a
+ * negative errno value if mlock fails.
+ */
+int dagwarm_mem(const void *addr, size_t bytes, const struct dagwarm_cfg *cfg);
+
+/*
+ * Read a DAG file completely, so that it ends up in the page cache.
+ */
+void dagwarm_file(struct dag_handle *h, const struct dagwarm_cfg *cfg);
+
+#endif /* !LIBDAG_DAGWARM_H */
@@ -0,0 +1,310 @@
+/*
+ * epochmgr.c - Epoch manager with background next-epoch preparation
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagnuma.h"
+#include "dagreg.h"
+#include "epochmgr.h"
+
+
+struct key {
+	enum dag_algo	algo;
+	unsigned	epoch;
+};
+
+struct epochmgr {
+	struct epochmgr_cfg cfg;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	bool		have_block;
+	unsigned	block;
+	struct epoch_dag *current;
+	struct epoch_dag *next;		/* ready, but not current yet */
+	bool		building;
+	struct key	building_key;
+	bool		urgent;		/* the build is needed now */
+};
+
+struct build {
+	struct epochmgr	*mgr;
+	struct key	key;
+};
+
+
+static void act(struct epochmgr *mgr);
+
+
+/* ----- Keys and boundaries ----------------------------------------------- */
+
+
+static struct key block_key(const struct epochmgr *mgr, unsigned block)
+{
+	struct key k;
+
+	k.epoch = block / EPOCH_LENGTH;
+	k.algo = dagalgo_map(mgr->cfg.coin, &k.epoch);
+	return k;
+}
+
+
+static bool same(struct key a, struct key b)
+{
+	return a.algo == b.algo && a.epoch == b.epoch;
+}
+
+
+static bool is(const struct epoch_dag *d, struct key k)
+{
+	return d && d->algo == k.algo && d->epoch == k.epoch;
+}
+
+
+/*
+ * First block after "block" that needs a different (algorithm, epoch). This
+ * takes care of ETC epochs doubling in length at etchash_epoch, and of UBQ
+ * changing the algorithm at ubqhash_epoch.
+ */
+
+static unsigned next_boundary(const struct epochmgr *mgr, unsigned block,
+    struct key *next)
+{
+	struct key k = block_key(mgr, block);
+	unsigned b = (block / EPOCH_LENGTH + 1) * EPOCH_LENGTH;
+
+	while (1) {
+		*next = block_key(mgr, b);
+		if (!same(*next, k))
+			return b;
+		b += EPOCH_LENGTH;
+	}
+}
+
+
+/* ----- Building ---------------------------------------------------------- */
+
+
+static struct epoch_dag *build(const struct epochmgr_cfg *cfg, struct key k)
+{
+	struct epoch_dag *d = alloc_type(struct epoch_dag);
+	const struct dagreg_entry *e;
+
+	if (cfg->full)
+		e = dagreg_dag(k.algo, k.epoch);
+	else
+		e = dagreg_cache(k.algo, k.epoch);
+	d->algo = k.algo;
+	d->epoch = k.epoch;
+	d->cache_bytes = e->cache_bytes;
+	d->full_lines = e->full_lines;
+	d->cache = e->cache;
+	d->dag = cfg->full ? e->dag : NULL;
+	d->copies = cfg->full ? e->copies : NULL;
+	d->reg = e;
+	d->refs = 1;
+	return d;
+}
+
+
+static void *build_thread(void *arg)
+{
+	struct build *b = arg;
+	struct epochmgr *mgr = b->mgr;
+	struct epoch_dag *d;
+
+	/*
+	 * DAG threads are created by this thread and inherit its nice value.
+	 * If act() decides the build is urgent after all, they raise their
+	 * priority themselves.
+	 */
+	if (!__atomic_load_n(&mgr->urgent, __ATOMIC_RELAXED))
+		dagnuma_background(&mgr->urgent);
+	d = build(&mgr->cfg, b->key);
+	free(b);
+
+	pthread_mutex_lock(&mgr->mutex);
+	mgr->building = 0;
+	if (mgr->next)
+		epochmgr_put(mgr->next);
+	mgr->next = d;
+	act(mgr);
+	pthread_cond_broadcast(&mgr->cond);
+	pthread_mutex_unlock(&mgr->mutex);
+	return NULL;
+}
+
+
+static void start(struct epochmgr *mgr, struct key k, bool idle)
+{
+	struct build *b = alloc_type(struct build);
+	pthread_t thread;
+	int err;
+
+	b->mgr = mgr;
+	b->key = k;
+	mgr->building = 1;
+	mgr->building_key = k;
+	mgr->urgent = !idle;
+	err = pthread_create(&thread, NULL, build_thread, b);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+
+/* ----- State machine ----------------------------------------------------- */
+
+
+/*
+ * Called with the mutex held, whenever the block number changes or a build
+ * completes.
+ */
+
+static void act(struct epochmgr *mgr)
+{
+	struct epoch_dag *old;
+	struct key want, upcoming;
+	unsigned boundary;
+
+	if (!mgr->have_block)
+		return;
+	want = block_key(mgr, mgr->block);
+	boundary = next_boundary(mgr, mgr->block, &upcoming);
+
+	/* drop a prepared epoch we'll never use */
+	if (mgr->next && !is(mgr->next, want) && !is(mgr->next, upcoming)) {
+		epochmgr_put(mgr->next);
+		mgr->next = NULL;
+	}
+
+	if (!is(mgr->current, want)) {
+		if (!is(mgr->next, want)) {
+			if (!mgr->building) {
+				start(mgr, want, 0);
+			} else if (same(mgr->building_key, want)) {
+				/* too late for the background */
+				__atomic_store_n(&mgr->urgent, 1,
+				    __ATOMIC_RELAXED);
+			}
+			return;
+		}
+		old = mgr->current;
+		mgr->current = mgr->next;
+		mgr->next = NULL;
+		if (old)
+			epochmgr_put(old);
+		pthread_cond_broadcast(&mgr->cond);
+	}
+
+	if (mgr->block + mgr->cfg.ahead < boundary)
+		return;
+	if (is(mgr->next, upcoming) || mgr->building)
+		return;
+	start(mgr, upcoming, 1);
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+struct epochmgr *epochmgr_new(const struct epochmgr_cfg *cfg)
+{
+	struct epochmgr *mgr = alloc_type(struct epochmgr);
+
+	mgr->cfg = *cfg;
+	mgr->cfg.coin = stralloc(cfg->coin);
+	pthread_mutex_init(&mgr->mutex, NULL);
+	pthread_cond_init(&mgr->cond, NULL);
+	mgr->have_block = 0;
+	mgr->current = NULL;
+	mgr->next = NULL;
+	mgr->building = 0;
+	return mgr;
+}
+
+
+void epochmgr_update(struct epochmgr *mgr, unsigned block)
+{
+	pthread_mutex_lock(&mgr->mutex);
+	mgr->have_block = 1;
+	mgr->block = block;
+	act(mgr);
+	pthread_mutex_unlock(&mgr->mutex);
+}
+
+
+struct epoch_dag *epochmgr_get(struct epochmgr *mgr)
+{
+	struct epoch_dag *d;
+
+	pthread_mutex_lock(&mgr->mutex);
+	d = mgr->current;
+	if (d)
+		__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mgr->mutex);
+	return d;
+}
+
+
+struct epoch_dag *epochmgr_wait(struct epochmgr *mgr)
+{
+	struct epoch_dag *d;
+
+	pthread_mutex_lock(&mgr->mutex);
+	while (!mgr->have_block ||
+	    !is(mgr->current, block_key(mgr, mgr->block)))
+		pthread_cond_wait(&mgr->cond, &mgr->mutex);
+	d = mgr->current;
+	__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mgr->mutex);
+	return d;
+}
+
+
+void epochmgr_put(struct epoch_dag *d)
+{
+	if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (d->dag)
+		dagreg_release_dag(d->reg);
+	else
+		dagreg_release_cache(d->reg);
+	free(d);
+}
+
+
+void epochmgr_free(struct epochmgr *mgr)
+{
+	pthread_mutex_lock(&mgr->mutex);
+	mgr->have_block = 0;	/* don't start anything new */
+	while (mgr->building)
+		pthread_cond_wait(&mgr->cond, &mgr->mutex);
+	if (mgr->current)
+		epochmgr_put(mgr->current);
+	if (mgr->next)
+		epochmgr_put(mgr->next);
+	pthread_mutex_unlock(&mgr->mutex);
+	pthread_cond_destroy(&mgr->cond);
+	pthread_mutex_destroy(&mgr->mutex);
+	free((char *) mgr->cfg.coin);
+	free(mgr);
+}
@@ -0,0 +1,89 @@
+/*
+ * epochmgr.h - Epoch manager with background next-epoch preparation
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LIBDAG_EPOCHMGR_H
+#define	LIBDAG_EPOCHMGR_H
+
+/*
+ * The manager follows the block height of one coin. When the chain gets
+ * within "ahead" blocks of the next change of (algorithm, epoch), as
+ * determined by dagalgo_map, it starts building the light cache (and,
+ * optionally, the full DAG) for that change at nice 19 (see
+ * dagnuma_background). When the boundary is reached, the new epoch replaces
+ * the old one atomically. If the build hasn't finished by then, its DAG
+ * threads return to normal priority.
+ *
+ * Users take a reference with epochmgr_get and drop it with epochmgr_put.
+ * An old epoch is freed only after its last user has dropped it, so a job
+ * that is still running at the boundary can finish with the old DAG.
+ *
+ * Caches and DAGs come from the registry (dagreg.h), so managers of coins
+ * that are on the same (algorithm, epoch) share them. DAG threads and NUMA
+ * placement are set with dagreg_setup.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dagalgo.h"
+#include "dagnuma.h"
+#include "dagreg.h"
+
+
+struct epochmgr;
+
+struct epochmgr_cfg {
+	const char	*coin;		/* as for dagalgo_map */
+	unsigned	ahead;		/* blocks before the boundary */
+	bool		full;		/* also generate the full DAG */
+};
+
+struct epoch_dag {
+	enum dag_algo	algo;
+	unsigned	epoch;		/* epoch of "algo" */
+	unsigned	cache_bytes;
+	unsigned	full_lines;
+	const uint8_t	*cache;
+	const uint8_t	*dag;		/* NULL if cfg.full is not set */
+	struct dagnuma_copies *copies;	/* per-node copies of "dag" */
+
+	/* private */
+	const struct dagreg_entry *reg;
+	unsigned	refs;
+};
+
+
+struct epochmgr *epochmgr_new(const struct epochmgr_cfg *cfg);
+
+/*
+ * Report the current block number. This never blocks. If the epoch we need
+ * is not ready yet (e.g., on the first call), it is built at normal priority
+ * and epochmgr_get returns NULL or the previous epoch until it's done.
+ */
+void epochmgr_update(struct epochmgr *mgr, unsigned block);
+
+/*
+ * Current epoch, NULL if none is ready.
+ */
+struct epoch_dag *epochmgr_get(struct epochmgr *mgr);
+
+/*
+ * Wait until the epoch for the last reported block is ready, and return it.
+ */
+struct epoch_dag *epochmgr_wait(struct epochmgr *mgr);
+
+void epochmgr_put(struct epoch_dag *d);
+
+/*
+ * Waits for a background build to finish. Epochs still in use remain valid
+ * until they are put.
+ */
+void epochmgr_free(struct epochmgr *mgr);
+
+#endif /* !LIBDAG_EPOCHMGR_H */
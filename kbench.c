@@ -0,0 +1,762 @@
+/*
+ * kbench.c - Micro-benchmarks of the hashing and DAG kernels
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (save a baseline, change the code, compare):
+ * ./kbench -j >base.json
+ * make && ./kbench -c base.json
+ *
+ * Only the cache- and item-related cases:
+ * ./kbench mkcache calc
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "keccak.h"
+#include "blake2.h"
+#include "common.h"
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagasic.h"
+#include "dagio.h"
+#include "mine.h"
+
+
+#define	MAX_NAME	64
+#define	MIN_TRIAL_S	0.02	/* grow "ops" until a trial takes this long */
+
+
+struct bench_case {
+	const char	*name;
+	void		(*run)(const struct bench_case *bc, unsigned ops);
+	enum dag_algo	algo;		/* mkcache */
+	bool		slow;		/* one op per trial, no calibration */
+	bool		threaded;	/* run on "threads" threads */
+};
+
+struct result {
+	unsigned	ops;		/* per trial (and thread) */
+	double		median;		/* ns per op */
+	double		p10, p90;
+	double		min, max;
+};
+
+
+static unsigned epoch = 0;
+static unsigned full_lines = 1 << 20;	/* 128 MB */
+static unsigned trials = 11;
+static unsigned threads = 1;
+
+static uint8_t *cache;
+static unsigned cache_bytes;
+static uint8_t *dag;
+static struct dag_handle *dh;
+static uint8_t data[128];
+
+static volatile uint8_t sink;	/* keep results alive */
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+/* ----- Cases ------------------------------------------------------------- */
+
+
+/*
+ * Input sizes are the ones the library uses: 40 bytes (header hash and
+ * nonce) and 64 bytes (cache items) for KEC_512, 96 bytes (seed and cmix)
+ * and 32 bytes (seed hash) for KEC_256, 64 bytes for BLAKE2B_512.
+ */
+
+static void run_kec256_32(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t out[32];
+	unsigned i;
+
+	for (i = 0; i != ops; i++) {
+		data[0] = i;
+		KEC_256(out, data, 32);
+	}
+	sink = out[0];
+}
+
+
+static void run_kec256_96(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t out[32];
+	unsigned i;
+
+	for (i = 0; i != ops; i++) {
+		data[0] = i;
+		KEC_256(out, data, 96);
+	}
+	sink = out[0];
+}
+
+
+static void run_kec512_40(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t out[64];
+	unsigned i;
+
+	for (i = 0; i != ops; i++) {
+		data[0] = i;
+		KEC_512(out, data, 40);
+	}
+	sink = out[0];
+}
+
+
+static void run_kec512_64(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t out[64];
+	unsigned i;
+
+	for (i = 0; i != ops; i++) {
+		data[0] = i;
+		KEC_512(out, data, 64);
+	}
+	sink = out[0];
+}
+
+
+static void run_blake2b512_64(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t out[64];
+	unsigned i;
+
+	for (i = 0; i != ops; i++) {
+		data[0] = i;
+		BLAKE2B_512(out, data, 64);
+	}
+	sink = out[0];
+}
+
+
+static void run_mkcache(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t seed[SEED_BYTES];
+	uint8_t *c = alloc_size(cache_bytes);
+	unsigned i;
+
+	get_seedhash_algo(seed, bc->algo, epoch);
+	for (i = 0; i != ops; i++)
+		mkcache_algo(bc->algo, c, cache_bytes, seed);
+	sink = c[0];
+	free(c);
+}
+
+
+/*
+ * calc_dataset_item is internal to dag.c. A one-line range computes
+ * exactly two items, so we count two ops per call.
+ */
+
+static void run_calc_dataset_item(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t line[DAG_LINE_BYTES];
+	unsigned i;
+
+	for (i = 0; i != ops; i += 2)
+		calc_dataset_range(line, (i * 7919u) % full_lines, 1,
+		    cache, cache_bytes);
+	sink = line[0];
+}
+
+
+static void run_hashimoto(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t cmix[CMIX_BYTES], result[RESULT_BYTES];
+	unsigned i;
+
+	for (i = 0; i != ops; i++)
+		hashimoto(cmix, result, data, i, dag, full_lines);
+	sink = result[0];
+}
+
+
+static void run_hashimoto_light(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t cmix[CMIX_BYTES], result[RESULT_BYTES];
+	unsigned i;
+
+	for (i = 0; i != ops; i++)
+		hashimoto_light(cmix, result, data, i, cache, cache_bytes,
+		    full_lines);
+	sink = result[0];
+}
+
+
+static void run_hashimoto_dh(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t cmix[CMIX_BYTES], result[RESULT_BYTES];
+	unsigned i;
+
+	for (i = 0; i != ops; i++)
+		hashimoto_dh(cmix, result, data, i, dh, full_lines);
+	sink = result[0];
+}
+
+
+/*
+ * One op is one line. We convert the first ASIC_LINES lines of the DAG again
+ * and again, so this measures the transform, not memory bandwidth.
+ */
+
+#define	ASIC_LINES	1024	/* 128 kB */
+
+static void run_dagasic_to_asic(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t *buf = alloc_size((size_t) ASIC_LINES * DAG_LINE_BYTES);
+	unsigned i, n;
+
+	for (i = 0; i < ops; i += n) {
+		n = ops - i < ASIC_LINES ? ops - i : ASIC_LINES;
+		dagasic_to_asic(buf, dag, n);
+	}
+	sink = buf[0];
+	free(buf);
+}
+
+
+static void run_dagasic_from_asic(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t *buf = alloc_size((size_t) ASIC_LINES * DAG_LINE_BYTES);
+	unsigned i, n;
+
+	for (i = 0; i < ops; i += n) {
+		n = ops - i < ASIC_LINES ? ops - i : ASIC_LINES;
+		dagasic_from_asic(buf, dag, n);
+	}
+	sink = buf[0];
+	free(buf);
+}
+
+
+static void run_get_target(const struct bench_case *bc, unsigned ops)
+{
+	uint8_t target[TARGET_BYTES];
+	uint64_t difficulty[4] = { 0, 0, 0, 0 };
+	unsigned i;
+
+	for (i = 0; i != ops; i++) {
+		difficulty[0] = 1000000007ull * (i + 1);
+		get_target(target, difficulty);
+	}
+	sink = target[0];
+}
+
+
+/*
+ * The first RESULTS * RESULT_BYTES bytes of the (random) DAG serve as results.
+ */
+
+#define	RESULTS		4096	/* 128 kB */
+
+static void run_share_difficulty(const struct bench_case *bc, unsigned ops)
+{
+	uint64_t difficulty[4];
+	unsigned i;
+
+	for (i = 0; i != ops; i++)
+		share_difficulty(difficulty,
+		    dag + (size_t) (i % RESULTS) * RESULT_BYTES);
+	sink = difficulty[0];
+}
+
+
+static void run_below_target_batch(const struct bench_case *bc,
+    unsigned ops)
+{
+	const uint64_t difficulty[4] = { 1000000007ull, 0, 0, 0 };
+	uint8_t target[TARGET_BYTES];
+	unsigned i, n, hits = 0;
+
+	get_target(target, difficulty);
+	for (i = 0; i < ops; i += n) {
+		n = ops - i < RESULTS ? ops - i : RESULTS;
+		hits += below_target_batch(NULL, dag, n, target);
+	}
+	sink = hits;
+}
+
+
+static struct bench_case cases[] = {
+	{ .name = "kec256_32",		.run = run_kec256_32 },
+	{ .name = "kec256_96",		.run = run_kec256_96 },
+	{ .name = "kec512_40",		.run = run_kec512_40 },
+	{ .name = "kec512_64",		.run = run_kec512_64 },
+	{ .name = "blake2b512_64",	.run = run_blake2b512_64 },
+	{ .name = "mkcache_ethash",	.run = run_mkcache,
+	  .algo = da_ethash,		.slow = 1 },
+	{ .name = "mkcache_ubqhash",	.run = run_mkcache,
+	  .algo = da_ubqhash,		.slow = 1 },
+	{ .name = "calc_dataset_item",	.run = run_calc_dataset_item,
+	  .threaded = 1 },
+	{ .name = "hashimoto",		.run = run_hashimoto },
+	{ .name = "hashimoto_light",	.run = run_hashimoto_light },
+	{ .name = "hashimoto_dh",	.run = run_hashimoto_dh },
+	{ .name = "dagasic_to_asic",	.run = run_dagasic_to_asic },
+	{ .name = "dagasic_from_asic",	.run = run_dagasic_from_asic },
+	{ .name = "get_target",		.run = run_get_target },
+	{ .name = "share_difficulty",	.run = run_share_difficulty },
+	{ .name = "below_target_batch",	.run = run_below_target_batch },
+};
+
+#define	N_CASES	(sizeof(cases) / sizeof(*cases))
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+/*
+ * The text trace (print_line_asic) is the reference for the ASIC word order.
+ * Make sure the dagasic conversions we're about to time agree with it.
+ */
+
+static void check_asic(void)
+{
+	uint8_t line[DAG_LINE_BYTES], asic[DAG_LINE_BYTES];
+	struct mine_trace_sink *trace;
+	unsigned long word;
+	char *text, *p, *end, *tok, *save;
+	size_t size;
+	FILE *file;
+	unsigned i;
+
+	for (i = 0; i != DAG_LINE_BYTES / WORD_BYTES; i++)
+		write32(line + i * WORD_BYTES, i);
+
+	file = open_memstream(&text, &size);
+	if (!file) {
+		perror("open_memstream");
+		exit(1);
+	}
+	trace = mine_trace_text_new(file, 0);
+	trace->mix(trace->user, line, line, line);
+	mine_trace_text_free(trace);
+	if (fclose(file)) {
+		perror("fclose");
+		exit(1);
+	}
+
+	dagasic_to_asic(asic, line, 1);
+	p = strstr(text, "DAG in:");
+	end = strstr(text, "Mix out:");
+	if (!p || !end) {
+		fprintf(stderr, "check_asic: no DAG line in trace\n");
+		exit(1);
+	}
+	*end = 0;
+	i = 0;
+	for (tok = strtok_r(p, " \n", &save); tok;
+	    tok = strtok_r(NULL, " \n", &save)) {
+		if (strlen(tok) != 8)	/* labels */
+			continue;
+		word = strtoul(tok, NULL, 16);
+		if (i == DAG_LINE_BYTES / WORD_BYTES ||
+		    word != __builtin_bswap32(read32(asic + i * WORD_BYTES))) {
+			fprintf(stderr,
+			    "dagasic_to_asic: word %u differs from trace\n",
+			    i);
+			exit(1);
+		}
+		i++;
+	}
+	if (i != DAG_LINE_BYTES / WORD_BYTES) {
+		fprintf(stderr, "dagasic_to_asic: short trace\n");
+		exit(1);
+	}
+	free(text);
+
+	dagasic_from_asic(asic, asic, 1);
+	if (memcmp(asic, line, DAG_LINE_BYTES)) {
+		fprintf(stderr, "dagasic_from_asic: no round trip\n");
+		exit(1);
+	}
+}
+
+
+static void setup(void)
+{
+	uint8_t seed[SEED_BYTES];
+	uint64_t x = 0x9e3779b97f4a7c15ull;
+	size_t i;
+
+	check_asic();
+
+	cache_bytes = get_cache_size(epoch);
+	cache = alloc_size(cache_bytes);
+	get_seedhash(seed, epoch);
+	mkcache(cache, cache_bytes, seed);
+
+	/*
+	 * Hashing speed doesn't depend on the DAG content, so we use random
+	 * data instead of spending minutes on generating a real DAG.
+	 */
+	dag = alloc_size((size_t) full_lines * DAG_LINE_BYTES);
+	for (i = 0; i != (size_t) full_lines * DAG_LINE_BYTES / 8; i++) {
+		/* xorshift64 */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		((uint64_t *) dag)[i] = x;
+	}
+	dh = dagio_open_backend(dbe_mem, NULL, 0, O_RDWR, full_lines, 0);
+	dagio_pwrite(dh, dag, full_lines, 0);
+
+	for (i = 0; i != sizeof(data); i++)
+		data[i] = i * 37;
+}
+
+
+/* ----- Measurement ------------------------------------------------------- */
+
+
+struct job {
+	const struct bench_case *bc;
+	unsigned	ops;
+	pthread_t	thread;
+};
+
+
+static void *job_thread(void *arg)
+{
+	const struct job *job = arg;
+
+	job->bc->run(job->bc, job->ops);
+	return NULL;
+}
+
+
+static double trial(const struct bench_case *bc, unsigned ops)
+{
+	struct job *job;
+	double t0, t;
+	unsigned i;
+	int err;
+
+	if (!bc->threaded || threads == 1) {
+		t0 = now();
+		bc->run(bc, ops);
+		return now() - t0;
+	}
+
+	job = alloc_size(sizeof(struct job) * threads);
+	t0 = now();
+	for (i = 0; i != threads; i++) {
+		job[i].bc = bc;
+		job[i].ops = ops;
+		err = pthread_create(&job[i].thread, NULL, job_thread,
+		    job + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(job[i].thread, NULL);
+	t = now() - t0;
+	free(job);
+	return t;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double *x = a;
+	const double *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+
+static double percentile(const double *sorted, unsigned n, unsigned p)
+{
+	return sorted[(n - 1) * p / 100];
+}
+
+
+static void measure(const struct bench_case *bc, struct result *res)
+{
+	double *ns = alloc_size(sizeof(double) * trials);
+	unsigned ops = bc->threaded ? 2 : 1;
+	unsigned i;
+
+	/* warm up, and find how many ops make a trial long enough */
+	while (trial(bc, ops) < MIN_TRIAL_S && !bc->slow)
+		ops *= 2;
+
+	for (i = 0; i != trials; i++)
+		ns[i] = trial(bc, ops) * 1e9 / ops;
+	qsort(ns, trials, sizeof(double), cmp_double);
+
+	res->ops = ops;
+	res->median = trials & 1 ? ns[trials / 2] :
+	    (ns[trials / 2 - 1] + ns[trials / 2]) / 2;
+	res->p10 = percentile(ns, trials, 10);
+	res->p90 = percentile(ns, trials, 90);
+	res->min = ns[0];
+	res->max = ns[trials - 1];
+	free(ns);
+}
+
+
+/* ----- Baseline ---------------------------------------------------------- */
+
+
+struct baseline {
+	char		name[MAX_NAME];
+	double		median;
+	struct baseline	*next;
+};
+
+
+/*
+ * We only read files we wrote ourselves with -j, so it's enough to pick the
+ * "name" and "median_ns" fields from each case line.
+ */
+
+static struct baseline *load_baseline(const char *path)
+{
+	struct baseline *list = NULL;
+	struct baseline *b;
+	FILE *file;
+	char line[1024];
+	const char *p, *q;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), file)) {
+		p = strstr(line, "\"name\": \"");
+		q = strstr(line, "\"median_ns\": ");
+		if (!p || !q)
+			continue;
+		b = alloc_type(struct baseline);
+		if (sscanf(p + 9, "%63[^\"]", b->name) != 1 ||
+		    sscanf(q + 13, "%lf", &b->median) != 1) {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			exit(1);
+		}
+		b->next = list;
+		list = b;
+	}
+	fclose(file);
+	return list;
+}
+
+
+static const struct baseline *find_baseline(const struct baseline *list,
+    const char *name)
+{
+	while (list && strcmp(list->name, name))
+		list = list->next;
+	return list;
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+static void print_text_header(bool compare)
+{
+	printf("%-20s %12s %12s %12s %14s", "case", "median_ns", "p10_ns",
+	    "p90_ns", "ops/s");
+	if (compare)
+		printf(" %12s %8s", "base_ns", "delta");
+	printf("\n");
+}
+
+
+/*
+ * Returns 1 if the case got slower than "threshold" percent.
+ */
+
+static bool print_text(const char *name, const struct result *res,
+    const struct baseline *base, unsigned threshold)
+{
+	double delta;
+
+	printf("%-20s %12.1f %12.1f %12.1f %14.1f", name,
+	    res->median, res->p10, res->p90, 1e9 / res->median);
+	if (!base) {
+		printf("\n");
+		return 0;
+	}
+	delta = 100.0 * (res->median - base->median) / base->median;
+	printf(" %12.1f %+7.1f%%%s\n", base->median, delta,
+	    delta > threshold ? " SLOWER" : "");
+	return delta > threshold;
+}
+
+
+static void print_json(const char *name, const struct result *res,
+    bool last)
+{
+	printf("    { \"name\": \"%s\", \"ops\": %u, \"median_ns\": %.3f, "
+	    "\"p10_ns\": %.3f, \"p90_ns\": %.3f, \"min_ns\": %.3f, "
+	    "\"max_ns\": %.3f }%s\n", name, res->ops, res->median,
+	    res->p10, res->p90, res->min, res->max, last ? "" : ",");
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static bool selected(const char *name, char *const *sel, unsigned n_sel)
+{
+	unsigned i;
+
+	if (!n_sel)
+		return 1;
+	for (i = 0; i != n_sel; i++)
+		if (!strncmp(name, sel[i], strlen(sel[i])))
+			return 1;
+	return 0;
+}
+
+
+static void usage(const char *name)
+{
+	unsigned i;
+
+	fprintf(stderr,
+"usage: %s [-c baseline.json [-T percent]] [-e epoch] [-f dag_lines] [-j]\n"
+"       %*s[-n trials] [-t threads] [case-prefix ...]\n\n"
+"  -c baseline.json\n"
+"      compare medians against a file written with -j\n"
+"  -e epoch\n"
+"      epoch for the light cache (default: 0)\n"
+"  -f dag_lines\n"
+"      size of the (random) DAG for hashimoto (default: %u)\n"
+"  -j  output JSON\n"
+"  -n trials\n"
+"      number of trials per case (default: 11)\n"
+"  -T percent\n"
+"      report cases whose median grew by more than this (default: 5)\n"
+"  -t threads\n"
+"      threads for calc_dataset_item; ns/op is per thread (default: 1)\n\n"
+"cases:"
+	    , name, (int) strlen(name) + 1, "", 1 << 20);
+	for (i = 0; i != N_CASES; i++)
+		fprintf(stderr, " %s", cases[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *baseline_path = NULL;
+	const struct baseline *baseline = NULL;
+	unsigned threshold = 5;
+	bool json = 0;
+	bool slower = 0;
+	struct result res;
+	char name[MAX_NAME];
+	unsigned i, last = 0;
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, "c:e:f:jn:T:t:")) != EOF)
+		switch (c) {
+		case 'c':
+			baseline_path = optarg;
+			break;
+		case 'e':
+			epoch = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end || !full_lines)
+				usage(*argv);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'n':
+			trials = strtoul(optarg, &end, 0);
+			if (*end || !trials)
+				usage(*argv);
+			break;
+		case 'T':
+			threshold = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 't':
+			threads = strtoul(optarg, &end, 0);
+			if (*end || !threads)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+	if (json && baseline_path)
+		usage(*argv);
+
+	if (baseline_path)
+		baseline = load_baseline(baseline_path);
+	setup();
+
+	for (i = 0; i != N_CASES; i++)
+		if (selected(cases[i].name, argv + optind, argc - optind))
+			last = i;
+	if (json)
+		printf("{\n  \"epoch\": %u,\n  \"dag_lines\": %u,\n"
+		    "  \"threads\": %u,\n  \"trials\": %u,\n  \"cases\": [\n",
+		    epoch, full_lines, threads, trials);
+	else
+		print_text_header(baseline);
+
+	for (i = 0; i != N_CASES; i++) {
+		const struct bench_case *bc = cases + i;
+
+		if (!selected(bc->name, argv + optind, argc - optind))
+			continue;
+		if (bc->threaded && threads > 1)
+			snprintf(name, sizeof(name), "%s/t%u", bc->name,
+			    threads);
+		else
+			snprintf(name, sizeof(name), "%s", bc->name);
+		measure(bc, &res);
+		if (json) {
+			print_json(name, &res, i == last);
+		} else {
+			slower |= print_text(name, &res,
+			    baseline ? find_baseline(baseline, name) : NULL,
+			    threshold);
+		}
+		fflush(stdout);
+	}
+
+	if (json)
+		printf("  ]\n}\n");
+	return slower;
+}
@@ -1,7 +1,7 @@
 /*
  * mdag.c - Memory-based DAG (for development)
  *
- * Copyright (C) 2021 Linzhi Ltd.
+ * Copyright (C) 2021, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
@@ -12,80 +12,148 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "linzhi/alloc.h"
+
 #include "dag.h"
 #include "mdag.h"
 
 
-static int fd = -1;
-static void *addr;
-static size_t length;
+struct mdag {
+	void		*addr;
+	size_t		length;
+	unsigned	full_lines;
+	unsigned	flags;
+};
 
 
-void mdag_write(const char *path, const void *dag, unsigned full_lines)
+int mdag_write(const char *path, const void *dag, unsigned full_lines)
 {
 	FILE *file;
+	int err;
 
 	file = fopen(path, "w");
-	if (!file) {
-		perror(path);
-		exit(1);
-	}
+	if (!file)
+		return -errno;
 	if (fwrite(dag, (size_t) full_lines * DAG_LINE_BYTES, 1, file) != 1) {
-		perror(path);
-		exit(1);
-	}
-	if (fclose(file) < 0) {
-		perror(path);
-		exit(1);
+		err = errno ? errno : EIO;
+		(void) fclose(file);
+		return -err;
 	}
+	if (fclose(file) < 0)
+		return -errno;
+	return 0;
 }
 
 
-const void *mdag_open(const char *path, unsigned *full_lines)
+/* ----- Mapping ----------------------------------------------------------- */
+
+
+int mdag_map(struct mdag **res, const char *path, unsigned flags)
 {
+	struct mdag *m;
 	struct stat st;
+	void *addr;
+	int fd, err;
 
-	assert(fd == -1);
 	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		perror(path);
-		exit(1);
-	}
-	if (fstat(fd, &st) < 0) {
-		perror(path);
-		exit(1);
-	}
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0)
+		goto fail;
 	if (st.st_size % DAG_LINE_BYTES) {
-		fprintf(stderr,
-		    "DAG (%llu) size must be multiple of %u bytes\n",
-		    (unsigned long long) st.st_size, DAG_LINE_BYTES);
-		exit(1);
+		errno = EINVAL;
+		goto fail;
 	}
-	length = st.st_size;
-	*full_lines = length / DAG_LINE_BYTES;
-	addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (addr == MAP_FAILED) {
-		perror(path);
-		exit(1);
+	addr = mmap(NULL, st.st_size, PROT_READ,
+	    MAP_SHARED | (flags & MDAG_POPULATE ? MAP_POPULATE : 0), fd, 0);
+	if (addr == MAP_FAILED)
+		goto fail;
+	(void) close(fd);
+
+	/* hints; failure is harmless */
+	if (flags & MDAG_HUGEPAGE)
+		(void) madvise(addr, st.st_size, MADV_HUGEPAGE);
+	if (flags & MDAG_RANDOM)
+		(void) madvise(addr, st.st_size, MADV_RANDOM);
+
+	if ((flags & MDAG_LOCK) && mlock(addr, st.st_size) < 0) {
+		err = errno;
+		munmap(addr, st.st_size);
+		return -err;
 	}
-	return addr;
+
+	m = alloc_type(struct mdag);
+	m->addr = addr;
+	m->length = st.st_size;
+	m->full_lines = st.st_size / DAG_LINE_BYTES;
+	m->flags = flags;
+	*res = m;
+	return 0;
+
+fail:
+	err = errno;
+	(void) close(fd);
+	return -err;
 }
 
 
-void mdag_close(void)
+const void *mdag_addr(const struct mdag *m)
 {
-	if (munmap(addr, length) < 0) {
+	return m->addr;
+}
+
+
+unsigned mdag_lines(const struct mdag *m)
+{
+	return m->full_lines;
+}
+
+
+void mdag_unmap(struct mdag *m)
+{
+	if (m->flags & MDAG_LOCK)
+		(void) munlock(m->addr, m->length);
+	if (munmap(m->addr, m->length) < 0)
 		perror("munmap");
+	free(m);
+}
+
+
+/* ----- Old API ----------------------------------------------------------- */
+
+
+static struct mdag *mdag = NULL;
+
+
+const void *mdag_open(const char *path, unsigned *full_lines)
+{
+	int err;
+
+	assert(!mdag);
+	err = mdag_map(&mdag, path, 0);
+	if (err == -EINVAL) {
+		fprintf(stderr, "%s: DAG size must be multiple of %u bytes\n",
+		    path, DAG_LINE_BYTES);
 		exit(1);
 	}
-	if (close(fd) < 0) {
-		perror("close");
+	if (err < 0) {
+		errno = -err;
+		perror(path);
 		exit(1);
 	}
-	fd = -1;
+	*full_lines = mdag->full_lines;
+	return mdag->addr;
+}
+
+
+void mdag_close(void)
+{
+	mdag_unmap(mdag);
+	mdag = NULL;
 }
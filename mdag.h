@@ -1,7 +1,7 @@
 /*
  * mdag.h - Memory-based DAG (for development)
  *
- * Copyright (C) 2021 Linzhi Ltd.
+ * Copyright (C) 2021, 2023 Linzhi Ltd.
  *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
@@ -10,7 +10,33 @@
 #ifndef LIBDAG_MDAG_H
 #define	LIBDAG_MDAG_H
 
-void mdag_write(const char *path, const void *dag, unsigned full_lines);
+#define	MDAG_POPULATE	(1 << 0)	/* prefault the whole DAG */
+#define	MDAG_LOCK	(1 << 1)	/* mlock the DAG */
+#define	MDAG_HUGEPAGE	(1 << 2)	/* hint: use huge pages if possible */
+#define	MDAG_RANDOM	(1 << 3)	/* hint: access is random */
+
+
+struct mdag;
+
+
+/*
+ * Returns 0 on success, a negative errno value on failure.
+ */
+int mdag_write(const char *path, const void *dag, unsigned full_lines);
+
+/*
+ * Map a DAG file read-only (MAP_SHARED). Any number of DAGs can be mapped at
+ * the same time. Returns 0 on success, a negative errno value on failure.
+ * A file whose size is not a multiple of DAG_LINE_BYTES yields -EINVAL.
+ */
+int mdag_map(struct mdag **res, const char *path, unsigned flags);
+const void *mdag_addr(const struct mdag *m);
+unsigned mdag_lines(const struct mdag *m);
+void mdag_unmap(struct mdag *m);
+
+/*
+ * Old API: one DAG at a time, exits on error.
+ */
 const void *mdag_open(const char *path, unsigned *full_lines);
 void mdag_close(void);
 
@@ -0,0 +1,675 @@
+/*
+ * membench.c - Random-access DAG memory bandwidth, as Ethash sees it
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (epoch 400, all page sizes, up to 16 accesses in flight):
+ * ./membench -e 400 -t 1,4,16 -o 1,4,16
+ *
+ * Compare NUMA placements on a multi-socket host:
+ * ./membench -e 400 -p thp -N first,node0,replicate
+ *
+ * Replay the accesses recorded with dagcapture:
+ * ./membench -r trace400 -p thp -o 1,16
+ *
+ * hugetlb needs reserved pages, e.g.,
+ * echo 1024 >/proc/sys/vm/nr_hugepages
+ */
+
+#define _GNU_SOURCE	/* for MAP_HUGETLB */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "dagnuma.h"
+#include "mine.h"
+#include "dagtrace.h"
+
+
+#define	MAX_LIST	32
+#define	MAX_OUTSTANDING	64
+#define	HUGE_BYTES	(2 << 20)
+#define	BATCH_ROUNDS	256	/* uniform: rounds between stop checks */
+
+
+enum workload {
+	wl_uniform,		/* uniform random 128-byte reads */
+	wl_mix,			/* mix_dag_line streams */
+	wl_replay,		/* lines from a trace (-r) */
+	workloads
+};
+
+enum pages {
+	pg_4k,
+	pg_thp,
+	pg_huge,
+	page_kinds
+};
+
+enum placement {
+	pl_first,		/* first touch, partitioned over all nodes */
+	pl_node0,		/* everything on node 0 */
+	pl_replicate,		/* one copy per node, threads read locally */
+	placements
+};
+
+static const char *workload_name[] = {
+	[wl_uniform]	= "uniform",
+	[wl_mix]	= "mix",
+	[wl_replay]	= "replay",
+};
+
+static const char *page_name[] = {
+	[pg_4k]		= "4k",
+	[pg_thp]	= "thp",
+	[pg_huge]	= "huge",
+};
+
+static const char *placement_name[] = {
+	[pl_first]	= "first",
+	[pl_node0]	= "node0",
+	[pl_replicate]	= "replicate",
+};
+
+
+struct list {
+	unsigned	n;
+	unsigned	v[MAX_LIST];
+};
+
+struct worker {
+	enum workload	workload;
+	const struct dagnuma_copies *dag;
+	unsigned	index;
+	unsigned	outstanding;
+	uint64_t	lines;		/* lines read */
+	pthread_t	thread;
+};
+
+
+static unsigned full_lines;
+static double duration = 1;
+static bool stop;
+static volatile uint64_t zero = 0;	/* creates a data dependency */
+static volatile uint64_t sink;		/* keeps results alive */
+static uint32_t *replay_line = NULL;
+static uint64_t replay_lines;		/* entries in replay_line */
+
+
+/* ----- Memory ------------------------------------------------------------ */
+
+
+static size_t map_bytes(enum pages pages)
+{
+	size_t bytes = (size_t) full_lines * DAG_LINE_BYTES;
+
+	if (pages == pg_huge)
+		bytes = (bytes + HUGE_BYTES - 1) & ~(size_t) (HUGE_BYTES - 1);
+	return bytes;
+}
+
+
+static void *map(enum pages pages)
+{
+	size_t bytes = map_bytes(pages);
+	void *p;
+
+	p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS |
+	    (pages == pg_huge ? MAP_HUGETLB : 0), -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if (pages == pg_4k)
+		(void) madvise(p, bytes, MADV_NOHUGEPAGE);
+	if (pages == pg_thp)
+		(void) madvise(p, bytes, MADV_HUGEPAGE);
+	return p;
+}
+
+
+struct fill {
+	uint8_t		*p;
+	size_t		bytes;
+	unsigned	node;
+	pthread_t	thread;
+};
+
+
+/*
+ * The content doesn't matter for the access pattern, but it shouldn't be
+ * zero, or the kernel may map the zero page.
+ */
+
+static void *fill_thread(void *arg)
+{
+	const struct fill *f = arg;
+	uint64_t x = 0x9e3779b97f4a7c15ull * (f->node + 1);
+	uint64_t *p = (uint64_t *) f->p;
+	size_t i;
+
+	dagnuma_bind(f->node);
+	for (i = 0; i != f->bytes / 8; i++) {
+		/* xorshift64 */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		p[i] = x;
+	}
+	return NULL;
+}
+
+
+static void fill(struct fill *f, unsigned n)
+{
+	unsigned i;
+	int err;
+
+	for (i = 0; i != n; i++) {
+		err = pthread_create(&f[i].thread, NULL, fill_thread, f + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != n; i++)
+		pthread_join(f[i].thread, NULL);
+}
+
+
+/*
+ * Returns NULL if the memory can't be allocated, e.g., if there are not
+ * enough huge pages.
+ */
+
+static struct dagnuma_copies *setup(enum pages pages, enum placement place)
+{
+	struct dagnuma_copies *c = alloc_type(struct dagnuma_copies);
+	unsigned nodes = dagnuma_nodes();
+	size_t bytes = map_bytes(pages);
+	struct fill f[DAGNUMA_MAX_NODES];
+	size_t part;
+	unsigned i;
+
+	c->mode = place == pl_replicate ? dnm_replicate :
+	    place == pl_first ? dnm_partition : dnm_off;
+	c->nodes = nodes;
+	c->bytes = bytes;
+	for (i = 0; i != nodes; i++) {
+		c->copy[i] = !i || place == pl_replicate ? map(pages) :
+		    c->copy[0];
+		if (c->copy[i])
+			continue;
+		while (i--)
+			if (!i || place == pl_replicate)
+				munmap(c->copy[i], bytes);
+		free(c);
+		return NULL;
+	}
+
+	switch (place) {
+	case pl_first:
+		/* partition in huge page units, so that THP can work */
+		part = (bytes / nodes + HUGE_BYTES - 1) &
+		    ~(size_t) (HUGE_BYTES - 1);
+		for (i = 0; i != nodes; i++) {
+			f[i].p = (uint8_t *) c->copy[0] + part * i;
+			f[i].bytes = part * i >= bytes ? 0 :
+			    bytes - part * i < part ? bytes - part * i : part;
+			f[i].node = i;
+		}
+		fill(f, nodes);
+		break;
+	case pl_node0:
+		f[0].p = c->copy[0];
+		f[0].bytes = bytes;
+		f[0].node = 0;
+		fill(f, 1);
+		break;
+	case pl_replicate:
+		for (i = 0; i != nodes; i++) {
+			f[i].p = c->copy[i];
+			f[i].bytes = bytes;
+			f[i].node = i;
+		}
+		fill(f, nodes);
+		break;
+	default:
+		abort();
+	}
+	return c;
+}
+
+
+static void release(struct dagnuma_copies *c)
+{
+	unsigned i;
+
+	for (i = 0; i != c->nodes; i++)
+		if (!i || c->copy[i] != c->copy[0])
+			munmap(c->copy[i], c->bytes);
+	free(c);
+}
+
+
+/* ----- Workloads --------------------------------------------------------- */
+
+
+/*
+ * Each of the "outstanding" streams picks its next line from the data it
+ * has just read (XORed with a zero the compiler can't see through), so
+ * exactly that many reads can be in flight.
+ */
+
+static uint64_t run_uniform(const uint8_t *dag, unsigned index,
+    unsigned outstanding)
+{
+	uint64_t x[MAX_OUTSTANDING];
+	uint64_t mask = zero;
+	uint64_t lines = 0;
+	const uint64_t *p;
+	unsigned i, k;
+
+	for (k = 0; k != outstanding; k++)
+		x[k] = 0x9e3779b97f4a7c15ull *
+		    (index * MAX_OUTSTANDING + k + 1);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (i = 0; i != BATCH_ROUNDS; i++)
+			for (k = 0; k != outstanding; k++) {
+				p = (const uint64_t *) (dag +
+				    (x[k] % full_lines) * DAG_LINE_BYTES);
+				x[k] ^= x[k] << 13;
+				x[k] ^= x[k] >> 7;
+				x[k] ^= x[k] << 17;
+				x[k] ^= (p[0] ^ p[8]) & mask;
+			}
+		lines += (uint64_t) BATCH_ROUNDS * outstanding;
+	}
+	for (k = 0; k != outstanding; k++)
+		sink += x[k];
+	return lines;
+}
+
+
+/*
+ * Interleave "outstanding" hashimoto computations, round by round. This is
+ * the real access stream, including the cost of mixing.
+ */
+
+static uint64_t run_mix(const uint8_t *dag, unsigned index,
+    unsigned outstanding)
+{
+	uint8_t header_hash[HEADER_HASH_BYTES];
+	uint8_t mix[MAX_OUTSTANDING][MIX_BYTES];
+	uint8_t s[MAX_OUTSTANDING][HASH_BYTES];
+	uint64_t nonce = (uint64_t) index << 40;
+	uint64_t lines = 0;
+	uint32_t line;
+	unsigned i, k;
+
+	memset(header_hash, 0x5a, sizeof(header_hash));
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (k = 0; k != outstanding; k++)
+			mix_setup(mix[k], s[k], header_hash, nonce++);
+		for (i = 0; i != ACCESSES; i++)
+			for (k = 0; k != outstanding; k++) {
+				line = mix_dag_line(i, mix[k], s[k],
+				    full_lines);
+				mix_do_mix(mix[k], dag +
+				    (size_t) line * DAG_LINE_BYTES);
+			}
+		lines += (uint64_t) ACCESSES * outstanding;
+	}
+	sink += mix[0][0];
+	return lines;
+}
+
+
+/*
+ * Walk the recorded lines in "outstanding" streams, each starting at a
+ * different place in the trace. As in "uniform", each read must complete
+ * before its stream can move on.
+ */
+
+static uint64_t run_replay(const uint8_t *dag, unsigned index,
+    unsigned outstanding)
+{
+	uint64_t pos[MAX_OUTSTANDING];
+	uint64_t x[MAX_OUTSTANDING];
+	uint64_t mask = zero;
+	uint64_t lines = 0;
+	const uint64_t *p;
+	unsigned i, k;
+
+	for (k = 0; k != outstanding; k++) {
+		pos[k] = (replay_lines / MAX_OUTSTANDING *
+		    (index * MAX_OUTSTANDING + k)) % replay_lines;
+		x[k] = 0;
+	}
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (i = 0; i != BATCH_ROUNDS; i++)
+			for (k = 0; k != outstanding; k++) {
+				p = (const uint64_t *) (dag + (size_t)
+				    replay_line[pos[k]] * DAG_LINE_BYTES);
+				x[k] ^= p[0] ^ p[8];
+				if (++pos[k] == replay_lines)
+					pos[k] = 0;
+				pos[k] += x[k] & mask;
+			}
+		lines += (uint64_t) BATCH_ROUNDS * outstanding;
+	}
+	for (k = 0; k != outstanding; k++)
+		sink += x[k];
+	return lines;
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	unsigned node = w->index % w->dag->nodes;
+
+	dagnuma_bind(node);
+	switch (w->workload) {
+	case wl_uniform:
+		w->lines = run_uniform(w->dag->copy[node], w->index,
+		    w->outstanding);
+		break;
+	case wl_mix:
+		w->lines = run_mix(w->dag->copy[node], w->index,
+		    w->outstanding);
+		break;
+	case wl_replay:
+		w->lines = run_replay(w->dag->copy[node], w->index,
+		    w->outstanding);
+		break;
+	default:
+		abort();
+	}
+	return NULL;
+}
+
+
+static void run(enum workload workload, enum pages pages,
+    enum placement place, const struct dagnuma_copies *dag, unsigned threads,
+    unsigned outstanding)
+{
+	struct worker *w = alloc_size(sizeof(struct worker) * threads);
+	struct timespec ts = {
+		.tv_sec		= duration,
+		.tv_nsec	= (duration - (time_t) duration) * 1e9,
+	};
+	uint64_t lines = 0;
+	unsigned i;
+	int err;
+
+	stop = 0;
+	for (i = 0; i != threads; i++) {
+		w[i].workload = workload;
+		w[i].dag = dag;
+		w[i].index = i;
+		w[i].outstanding = outstanding;
+		err = pthread_create(&w[i].thread, NULL, worker_thread, w + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	nanosleep(&ts, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i != threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		lines += w[i].lines;
+	}
+	free(w);
+
+	/* workers finish their batch after "stop", so this is approximate */
+	printf("%-8s %-5s %-10s %7u %11u %12.3f %8.2f\n",
+	    workload_name[workload], page_name[pages], placement_name[place],
+	    threads, outstanding, lines / duration * 1e-6,
+	    lines * DAG_LINE_BYTES / duration * 1e-9);
+	fflush(stdout);
+}
+
+
+static void sweep(enum workload workload, enum pages pages,
+    enum placement place, const struct dagnuma_copies *dag,
+    const struct list *threads, const struct list *outstanding)
+{
+	unsigned t, o;
+
+	for (t = 0; t != threads->n; t++)
+		for (o = 0; o != outstanding->n; o++)
+			run(workload, pages, place, dag, threads->v[t],
+			    outstanding->v[o]);
+}
+
+
+/* ----- Trace ------------------------------------------------------------- */
+
+
+static void load_trace(const char *path)
+{
+	struct dagtrace_record *rec = alloc_type(struct dagtrace_record);
+	struct dagtrace_reader *r;
+	uint64_t max = 0;
+
+	r = dagtrace_open(path);
+	if (!r) {
+		perror(path);
+		exit(1);
+	}
+	full_lines = dagtrace_info(r)->full_lines;
+	while (dagtrace_read(r, rec)) {
+		if (replay_lines == max) {
+			max = max ? 2 * max : 1 << 16;
+			replay_line = realloc(replay_line,
+			    sizeof(uint32_t) * max);
+			if (!replay_line) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		memcpy(replay_line + replay_lines, rec->line,
+		    sizeof(rec->line));
+		replay_lines += ACCESSES;
+	}
+	dagtrace_reader_close(r);
+	free(rec);
+	if (!replay_lines) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		exit(1);
+	}
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-d seconds] [-e epoch | -f dag_lines | -r trace_file]\n"
+"       %*s[-N placement,...] [-o outstanding,...] [-p pages,...]\n"
+"       %*s[-t threads,...] [-w workload,...]\n\n"
+"  -d seconds\n"
+"      duration of each measurement (default: 1)\n"
+"  -e epoch\n"
+"      use the DAG size of this epoch (default: 0)\n"
+"  -f dag_lines\n"
+"      DAG size in lines\n"
+"  -N placement,...\n"
+"      first, node0, replicate (default: first)\n"
+"  -o outstanding,...\n"
+"      accesses in flight per thread, up to %u (default: 1,4,16)\n"
+"  -p pages,...\n"
+"      4k, thp, huge (default: all)\n"
+"  -r trace_file\n"
+"      replay the DAG lines recorded by dagcapture. This sets the DAG size.\n"
+"  -t threads,...\n"
+"      default: powers of two up to the number of CPUs\n"
+"  -w workload,...\n"
+"      uniform (random 128 byte reads), mix (mix_dag_line streams),\n"
+"      replay (needs -r) (default: replay with -r, else uniform and mix)\n"
+	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "",
+	    MAX_OUTSTANDING);
+	exit(1);
+}
+
+
+static void parse_list(struct list *list, char *s, unsigned max,
+    const char *name)
+{
+	char *tok, *end;
+	unsigned long v;
+
+	list->n = 0;
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		v = strtoul(tok, &end, 0);
+		if (*end || !v || v > max || list->n == MAX_LIST)
+			usage(name);
+		list->v[list->n++] = v;
+	}
+	if (!list->n)
+		usage(name);
+}
+
+
+static void parse_names(struct list *list, char *s, const char **names,
+    unsigned n, const char *name)
+{
+	char *tok;
+	unsigned i;
+
+	list->n = 0;
+	for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+		for (i = 0; i != n; i++)
+			if (!strcmp(tok, names[i]))
+				break;
+		if (i == n || list->n == MAX_LIST)
+			usage(name);
+		list->v[list->n++] = i;
+	}
+	if (!list->n)
+		usage(name);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct list workload_list = { 0, };
+	struct list page_list = { 3, { pg_4k, pg_thp, pg_huge } };
+	struct list place_list = { 1, { pl_first } };
+	struct list thread_list = { 0, };
+	struct list outstanding_list = { 3, { 1, 4, 16 } };
+	unsigned epoch = 0;
+	unsigned cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *trace = NULL;
+	struct dagnuma_copies *dag;
+	unsigned w, p, n, t;
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:e:f:N:o:p:r:t:w:")) != EOF)
+		switch (c) {
+		case 'd':
+			duration = strtod(optarg, &end);
+			if (*end || duration <= 0)
+				usage(*argv);
+			break;
+		case 'e':
+			epoch = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end || !full_lines)
+				usage(*argv);
+			break;
+		case 'N':
+			parse_names(&place_list, optarg, placement_name,
+			    placements, *argv);
+			break;
+		case 'o':
+			parse_list(&outstanding_list, optarg, MAX_OUTSTANDING,
+			    *argv);
+			break;
+		case 'p':
+			parse_names(&page_list, optarg, page_name, page_kinds,
+			    *argv);
+			break;
+		case 'r':
+			trace = optarg;
+			break;
+		case 't':
+			parse_list(&thread_list, optarg, ~0u, *argv);
+			break;
+		case 'w':
+			parse_names(&workload_list, optarg, workload_name,
+			    workloads, *argv);
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc != optind)
+		usage(*argv);
+	if (!workload_list.n) {
+		if (trace) {
+			workload_list.v[workload_list.n++] = wl_replay;
+		} else {
+			workload_list.v[workload_list.n++] = wl_uniform;
+			workload_list.v[workload_list.n++] = wl_mix;
+		}
+	}
+	for (w = 0; w != workload_list.n; w++)
+		if (workload_list.v[w] == wl_replay && !trace)
+			usage(*argv);
+
+	if (trace)
+		load_trace(trace);
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+	if (!thread_list.n) {
+		for (t = 1; t < cpus && thread_list.n != MAX_LIST - 1; t *= 2)
+			thread_list.v[thread_list.n++] = t;
+		thread_list.v[thread_list.n++] = cpus ? cpus : 1;
+	}
+
+	printf("DAG %u lines (%.2f GB), %u NUMA node%s\n\n", full_lines,
+	    (double) full_lines * DAG_LINE_BYTES * 1e-9, dagnuma_nodes(),
+	    dagnuma_nodes() == 1 ? "" : "s");
+	printf("%-8s %-5s %-10s %7s %11s %12s %8s\n", "workload", "pages",
+	    "placement", "threads", "outstanding", "Mlines/s", "GB/s");
+
+	for (p = 0; p != page_list.n; p++)
+		for (n = 0; n != place_list.n; n++) {
+			dag = setup(page_list.v[p], place_list.v[n]);
+			if (!dag) {
+				printf("%-8s %-5s %-10s (can't allocate)\n",
+				    "", page_name[page_list.v[p]],
+				    placement_name[place_list.v[n]]);
+				continue;
+			}
+			for (w = 0; w != workload_list.n; w++)
+				sweep(workload_list.v[w], page_list.v[p],
+				    place_list.v[n], dag, &thread_list,
+				    &outstanding_list);
+			release(dag);
+		}
+	return 0;
+}
@@ -18,17 +18,37 @@
 
 #include "keccak.h"
 #include "common.h"
-#include "util.h"
 #include "dag.h"
 #include "dagio.h"
 #include "mine.h"
+#include "dagcount.h"
 
 
-FILE *mine_trace = NULL;
-bool mine_trace_linear = 0;
+/*
+ * Each step is written once, with a trace sink argument. Callers pass
+ * either the installed sink or a literal NULL, and since the steps are
+ * always inlined, the NULL case compiles to kernels without any tracing.
+ */
 
+#define	KERNEL	static inline __attribute__((always_inline))
 
-/* ----- Main loop --------------------------------------------------------- */
+
+static const struct mine_trace_sink *trace_sink = NULL;
+
+
+void mine_trace_set(const struct mine_trace_sink *sink)
+{
+	__atomic_store_n(&trace_sink, sink, __ATOMIC_RELEASE);
+}
+
+
+static inline const struct mine_trace_sink *sink(void)
+{
+	return __atomic_load_n(&trace_sink, __ATOMIC_ACQUIRE);
+}
+
+
+/* ----- Steps ------------------------------------------------------------- */
 
 
 /*
@@ -38,30 +58,27 @@ bool mine_trace_linear = 0;
  * "cmix" and "result" are both 32 bytes
  */
 
-void mix_setup(uint8_t *mix, uint8_t *s, const uint8_t *header_hash,
-    uint64_t nonce)
+KERNEL void setup(const struct mine_trace_sink *t, uint8_t *mix, uint8_t *s,
+    const uint8_t *header_hash, uint64_t nonce)
 {
 	/* combine header+nonce into a 64 byte seed */
 	uint8_t tmp[HEADER_HASH_BYTES + NONCE_BYTES];
+	unsigned i;
 
 	memcpy(tmp, header_hash, 32);
 	write64(tmp + HEADER_HASH_BYTES, nonce);
-	if (mine_trace)
-		dump_blob("Pre-KEC512", tmp, sizeof(tmp));
 	KEC_512(s, tmp, sizeof(tmp));
-	if (mine_trace)
-		dump_blob("Post-KEC512 (s)", s, HASH_BYTES);
+	if (t && t->setup)
+		t->setup(t->user, tmp, s);
 
 	/* start the mix with replicated s */
-	unsigned i;
-
 	for (i = 0; i != MIX_BYTES / HASH_BYTES; i++)
 		memcpy(mix + i * HASH_BYTES, s, HASH_BYTES);
 }
 
 
-uint32_t mix_dag_line(unsigned round0, const uint8_t *mix, const uint8_t *s,
-    unsigned full_lines)
+KERNEL uint32_t dag_line(const struct mine_trace_sink *t, unsigned round0,
+    const uint8_t *mix, const uint8_t *s, unsigned full_lines)
 {
 	unsigned w = MIX_BYTES / WORD_BYTES;
 
@@ -71,196 +88,152 @@ uint32_t mix_dag_line(unsigned round0, const uint8_t *mix, const uint8_t *s,
 	uint32_t f = fnv(v1, v2);
 	uint32_t line = f % full_lines;
 
-	if (mine_trace) {
-		fprintf(mine_trace,
-		    "--- Calculate DAG address, round %u (0x%x) ---\n"
-		    "round0: %u (0x%08x)\n"
-		    "s0: 0x%08x\n"
-		    "v1 = round0 ^ s0: 0x%08x\n"
-		    "w: 0x%08x\n"
-		    "word_index = round0 %% w: 0x%08x\n"
-		    "v2 = mix[word_index]: 0x%08x\n"
-		    "f = fnv(v1, v2): 0x%08x\n"
-		    "lines: 0x%08x\n"
-		    "line = f %% lines: 0x%08x\n",
-
-		    round0 + 1, round0 + 1,
-		    round0, round0, read32(s), v1,
-		    w, word_index, v2,
-		    f,
+	if (t && t->dag_line)
+		t->dag_line(t->user, round0, read32(s), word_index, v2,
 		    full_lines, line);
-	}
-
 	return line;
 }
 
 
-/*
- * The ASIC organizes data as follows:
- * - the last word comes first, the first word comes last,
- * - we interleave even and odd 32-bit words,
- * - instead of little-endian, words are big-endian,
- *
- * w[30] w[28] w[26] ... w[0] w[31] w[29] ... w[1]
- */
-
-static void print_line_asic(FILE *file, const char *s, const uint8_t *p)
+KERNEL void do_mix(const struct mine_trace_sink *t, uint8_t *mix,
+    const uint8_t *this_dag_line)
 {
 	unsigned w = MIX_BYTES / WORD_BYTES;
+	uint8_t mix_in[MIX_BYTES];
 	unsigned j;
 
-	for (j = 0; j < w; j += 2) {
-		if (!(j & 6)) {
-			if (j)
-				fprintf(file, "\n%*s", (int) strlen(s), "");
-			else
-				fprintf(file, "%s", s);
-		}
-		fprintf(mine_trace, " %08x",
-		    read32(p + (w - 1 - j) * WORD_BYTES));
-	}
-	for (j = 1; j < w; j += 2) {
-		if (!(j & 6)) {
-			if (j > 1)
-				fprintf(file, "\n%*s", (int) strlen(s), "");
-			else
-				fprintf(file, "\n%*s",
-				    (int) strlen(s), "(odd)");
-		}
-		fprintf(mine_trace, " %08x",
-		    read32(p + (w - 1 - j) * WORD_BYTES));
+	if (t && t->mix)
+		memcpy(mix_in, mix, MIX_BYTES);
+	for (j = 0; j != w; j++) {
+		uint8_t *m = mix + j * WORD_BYTES;
+		uint32_t v1 = read32(m);
+		uint32_t v2 = read32(this_dag_line + j * WORD_BYTES);
+
+		write32(m, fnv(v1, v2));
 	}
-	fprintf(file, "\n");
+	if (t && t->mix)
+		t->mix(t->user, mix_in, this_dag_line, mix);
 }
 
 
-static void print_line_linear(FILE *file, const char *s, const uint8_t *p)
+KERNEL void finish(const struct mine_trace_sink *t, uint8_t *cmix,
+    uint8_t *result, const uint8_t *mix, const uint8_t *s)
 {
-	unsigned j;
+	unsigned w = MIX_BYTES / WORD_BYTES;
+	uint8_t tmp2[HASH_BYTES + CMIX_BYTES];
+	uint32_t v[4];
+	unsigned i;
 
-	for (j = 0; j != MIX_BYTES; j++) {
-		if (!(j & 15)) {
-			if (j)
-				fprintf(file, "\n%*s", (int) strlen(s), "");
-			else
-				fprintf(file, "%s", s);
-		}
-		fprintf(mine_trace, " %02x", p[j]);
+	/* compress mix */
+	for (i = 0; i != w; i += 4) {
+		v[0] = read32(mix + 4 * i);
+		v[1] = read32(mix + 4 * i + 4);
+		v[2] = read32(mix + 4 * i + 8);
+		v[3] = read32(mix + 4 * i + 12);
+		if (t && t->compress)
+			t->compress(t->user, i, v);
+		write32(cmix + i, fnv(fnv(fnv(v[0], v[1]), v[2]), v[3]));
 	}
-	fprintf(file, "\n");
+
+	memcpy(tmp2, s, HASH_BYTES);
+	memcpy(tmp2 + HASH_BYTES, cmix, CMIX_BYTES);
+	if (t && t->finish)
+		t->finish(t->user, tmp2);
+	KEC_256(result, tmp2, HASH_BYTES + CMIX_BYTES);
 }
 
 
-static void print_line(FILE *file, const char *s, const uint8_t *p)
+/* ----- Step API ---------------------------------------------------------- */
+
+
+void mix_setup(uint8_t *mix, uint8_t *s, const uint8_t *header_hash,
+    uint64_t nonce)
 {
-	if (mine_trace_linear)
-		print_line_linear(file, s, p);
+	const struct mine_trace_sink *t = sink();
+
+	if (t)
+		setup(t, mix, s, header_hash, nonce);
 	else
-		print_line_asic(file, s, p);
+		setup(NULL, mix, s, header_hash, nonce);
+}
+
+
+uint32_t mix_dag_line(unsigned round0, const uint8_t *mix, const uint8_t *s,
+    unsigned full_lines)
+{
+	const struct mine_trace_sink *t = sink();
+
+	if (t)
+		return dag_line(t, round0, mix, s, full_lines);
+	return dag_line(NULL, round0, mix, s, full_lines);
 }
 
 
 void mix_do_mix(uint8_t *mix, const uint8_t *this_dag_line)
 {
-	unsigned w = MIX_BYTES / WORD_BYTES;
-	unsigned j;
+	const struct mine_trace_sink *t = sink();
 
-	if (mine_trace) {
-		fprintf(mine_trace, "--- Mix ---\n");
-		print_line(mine_trace, "Mix in: ", mix);
-		print_line(mine_trace, "DAG in: ", this_dag_line);
-	}
-	for (j = 0; j != w; j++) {
-		uint8_t *m = mix + j * WORD_BYTES;
-		uint32_t v1 = read32(m);
-		uint32_t v2 = read32(this_dag_line + j * WORD_BYTES);
-		uint32_t f = fnv(v1, v2);
-
-#if 0
-		if (mine_trace) {
-			fprintf(mine_trace,
-			    "j: 0x%08x\n"
-			    "   v1 = mix[j]: 0x%08x\n"
-			    "   v2 = dag[dag_addr][j]: 0x%08x\n"
-			    "   mix[j] = fnv(v1, v2): 0x%08x\n",
-
-			    j, v1,
-			    v2,
-			    f);
-		}
-#endif
-		write32(m, f);
-	}
-	if (mine_trace)
-		print_line(mine_trace, "Mix out:", mix);
+	if (t)
+		do_mix(t, mix, this_dag_line);
+	else
+		do_mix(NULL, mix, this_dag_line);
 }
 
 
 void mix_finish(uint8_t *cmix, uint8_t *result, const uint8_t *mix,
     const uint8_t *s)
 {
-	unsigned w = MIX_BYTES / WORD_BYTES;
-	unsigned i;
-
-	if (mine_trace)
-		fprintf(mine_trace, "--- Compress mix ---\n");
+	const struct mine_trace_sink *t = sink();
 
-	/* compress mix */
-	for (i = 0; i != w; i += 4) {
-		uint32_t v1 = read32(mix + 4 * i);
-		uint32_t v2 = read32(mix + 4 * i + 4);
-		uint32_t v3 = read32(mix + 4 * i + 8);
-		uint32_t v4 = read32(mix + 4 * i + 12);
-		uint32_t f1 = fnv(v1, v2);
-		uint32_t f2 = fnv(f1, v3);
-		uint32_t f3 = fnv(f2, v4);
-
-		if (mine_trace) {
-			fprintf(mine_trace,
-			    "i: 0x%08x\n"
-			    "   v1 = mix[i]: 0x%08x\n"
-			    "   v2 = mix[i + 1]: 0x%08x\n"
-			    "   v3 = mix[i + 2]: 0x%08x\n"
-			    "   v4 = mix[i + 3]: 0x%08x\n"
-			    "   f1 = fnv(v1, v2): 0x%08x\n"
-			    "   f2 = fnv(f1, v3): 0x%08x\n"
-			    "   cmix[i] = fnv(f2, v3): 0x%08x\n",
-			    i, v1, v2, v3, v4,
-			    f1, f2, f3);
-		}
-		write32(cmix + i, fnv(fnv(fnv(read32(mix + 4 * i),
-		    read32(mix + 4 * i + 4)),
-		    read32(mix + 4 * i + 8)),
-		    read32(mix + 4 * i + 12)));
-	}
+	if (t)
+		finish(t, cmix, result, mix, s);
+	else
+		finish(NULL, cmix, result, mix, s);
+}
 
-	uint8_t tmp2[HASH_BYTES + CMIX_BYTES];
 
-	memcpy(tmp2, s, HASH_BYTES);
-	memcpy(tmp2 + HASH_BYTES, cmix, CMIX_BYTES);
-	if (mine_trace)
-		dump_blob("Pre-KEC256", tmp2, HASH_BYTES + CMIX_BYTES);
-	KEC_256(result, tmp2, HASH_BYTES + CMIX_BYTES);
-}
+/* ----- Main loop --------------------------------------------------------- */
 
 
-void hashimoto(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
-    uint64_t nonce, const uint8_t *dag, unsigned full_lines)
+KERNEL void hashimoto_mem(const struct mine_trace_sink *t, uint8_t *cmix,
+    uint8_t *result, const uint8_t *header_hash, uint64_t nonce,
+    const uint8_t *dag, unsigned full_lines)
 {
 	uint8_t s[HASH_BYTES];
 	uint8_t mix[MIX_BYTES];
 	unsigned i;
-	uint32_t dag_line;
+	uint32_t line;
 
-	mix_setup(mix, s, header_hash, nonce);
+	setup(t, mix, s, header_hash, nonce);
 	for (i = 0; i != ACCESSES; i++) {
-		dag_line = mix_dag_line(i, mix, s, full_lines);
-		mix_do_mix(mix, dag + (ptrdiff_t) dag_line * DAG_LINE_BYTES);
+		line = dag_line(t, i, mix, s, full_lines);
+		do_mix(t, mix, dag + (ptrdiff_t) line * DAG_LINE_BYTES);
 	}
-	mix_finish(cmix, result, mix, s);
+	finish(t, cmix, result, mix, s);
 }
 
 
+void hashimoto(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
+    uint64_t nonce, const uint8_t *dag, unsigned full_lines)
+{
+	const struct mine_trace_sink *t = sink();
+
+	if (t)
+		hashimoto_mem(t, cmix, result, header_hash, nonce, dag,
+		    full_lines);
+	else
+		hashimoto_mem(NULL, cmix, result, header_hash, nonce, dag,
+		    full_lines);
+	dagcount(ls_hashimoto, 1);
+	dagcount(ls_dag_lines_read, ACCESSES);
+}
+
+
+/*
+ * The variants below spend their time in system calls or in generating DAG
+ * lines, so they just use the step API.
+ */
+
 void hashimoto_fd(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
     uint64_t nonce, int dag_fd, unsigned full_lines)
 {
@@ -277,6 +250,8 @@ void hashimoto_fd(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
 		mix_do_mix(mix, buf);
 	}
 	mix_finish(cmix, result, mix, s);
+	dagcount(ls_hashimoto_fd, 1);
+	dagcount(ls_dag_lines_read, ACCESSES);
 }
 
 
@@ -296,6 +271,8 @@ void hashimoto_dh(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
 		mix_do_mix(mix, buf);
 	}
 	mix_finish(cmix, result, mix, s);
+	dagcount(ls_hashimoto_dh, 1);
+	dagcount(ls_dag_lines_read, ACCESSES);
 }
 
 
@@ -316,6 +293,7 @@ void hashimoto_light(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
 		mix_do_mix(mix, line);
 	}
 	mix_finish(cmix, result, mix, s);
+	dagcount(ls_hashimoto_light, 1);
 }
 
 
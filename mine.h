@@ -29,8 +29,46 @@
 #define	TARGET_BYTES		RESULT_BYTES
 
 
-extern FILE *mine_trace;
-extern bool mine_trace_linear;
+/*
+ * Trace sink. Any callback can be NULL.
+ *
+ * setup:	seed is the 40 bytes header hash + nonce before KEC-512,
+ *		s the 64 bytes after.
+ * dag_line:	inputs and result of the DAG address calculation. s0 is the
+ *		first word of s, v2 is mix[word_index] with word_index =
+ *		round0 % (MIX_BYTES / WORD_BYTES), and line is
+ *		fnv(round0 ^ s0, v2) % full_lines.
+ * mix:		mix_in, the DAG line, and mix_out, MIX_BYTES each.
+ * compress:	the four mix words folded into cmix[i].
+ * finish:	the 96 bytes s + cmix before KEC-256.
+ *
+ * With no sink installed, the hashing functions run kernels that contain no
+ * tracing at all. The sink is global, and should be set or cleared while no
+ * other thread is hashing.
+ */
+
+struct mine_trace_sink {
+	void (*setup)(void *user, const uint8_t *seed, const uint8_t *s);
+	void (*dag_line)(void *user, unsigned round0, uint32_t s0,
+	    uint32_t word_index, uint32_t v2, unsigned full_lines,
+	    uint32_t line);
+	void (*mix)(void *user, const uint8_t *mix_in,
+	    const uint8_t *dag_line, const uint8_t *mix_out);
+	void (*compress)(void *user, unsigned i, const uint32_t v[4]);
+	void (*finish)(void *user, const uint8_t *pre_kec);
+	void *user;
+};
+
+
+void mine_trace_set(const struct mine_trace_sink *sink);
+
+/*
+ * Text sink that prints the trace check -v -v shows. "linear" prints lines
+ * as bytes in memory order instead of in the ASIC's word order.
+ */
+
+struct mine_trace_sink *mine_trace_text_new(FILE *file, bool linear);
+void mine_trace_text_free(struct mine_trace_sink *sink);
 
 
 void mix_setup(uint8_t *mix, uint8_t *s, const uint8_t *header_hash,
@@ -53,9 +91,22 @@ void hashimoto_light(uint8_t *cmix, uint8_t *result, const uint8_t *header_hash,
 
 /*
  * Lowest 64 bits of difficulty are in difficulty[0], highest in [3]
+ *
+ * get_target computes 2^256 / difficulty, share_difficulty the difficulty a
+ * result meets, 2^256 / result. Both saturate at 2^256 - 1.
  */
 
 void get_target(uint8_t *target, const uint64_t difficulty[4]);
+void share_difficulty(uint64_t difficulty[4], const uint8_t *result);
+
+/*
+ * below_target_batch checks n results, RESULT_BYTES apart, and returns how
+ * many are below the target. If "res" is not NULL, it receives the result of
+ * each check.
+ */
+
 bool below_target(const uint8_t *result, const uint8_t *target);
+unsigned below_target_batch(bool *res, const uint8_t *results, unsigned n,
+    const uint8_t *target);
 
 #endif /* !LIBDAG_MINE_H */
@@ -0,0 +1,214 @@
+/*
+ * minetrace.c - Text trace sink for the Ethash-family calculations
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "mine.h"
+
+
+struct text_sink {
+	struct mine_trace_sink sink;	/* must be first */
+	FILE	*file;
+	bool	linear;
+};
+
+
+/* ----- Helper functions -------------------------------------------------- */
+
+
+static void blob(FILE *file, const char *s, const uint8_t *p, unsigned bytes)
+{
+	unsigned i;
+
+	fprintf(file, "--- %s (%u bytes) ---\n", s, bytes);
+	for (i = 0; i != bytes; i++)
+		fprintf(file, "%02x%s", p[i],
+		    (i & 15) == 15 ? "\n" : (i & 7) == 7 ? "  " : " ");
+	if (bytes & 15)
+		putc('\n', file);
+}
+
+
+/*
+ * The ASIC organizes data as follows:
+ * - the last word comes first, the first word comes last,
+ * - we interleave even and odd 32-bit words,
+ * - instead of little-endian, words are big-endian,
+ *
+ * w[31] w[29] w[27] ... w[1] w[30] w[28] ... w[0]
+ */
+
+static void print_line_asic(FILE *file, const char *s, const uint8_t *p)
+{
+	unsigned w = MIX_BYTES / WORD_BYTES;
+	unsigned j;
+
+	for (j = 0; j < w; j += 2) {
+		if (!(j & 6)) {
+			if (j)
+				fprintf(file, "\n%*s", (int) strlen(s), "");
+			else
+				fprintf(file, "%s", s);
+		}
+		fprintf(file, " %08x", read32(p + (w - 1 - j) * WORD_BYTES));
+	}
+	for (j = 1; j < w; j += 2) {
+		if (!(j & 6)) {
+			if (j > 1)
+				fprintf(file, "\n%*s", (int) strlen(s), "");
+			else
+				fprintf(file, "\n%*s",
+				    (int) strlen(s), "(odd)");
+		}
+		fprintf(file, " %08x", read32(p + (w - 1 - j) * WORD_BYTES));
+	}
+	fprintf(file, "\n");
+}
+
+
+static void print_line_linear(FILE *file, const char *s, const uint8_t *p)
+{
+	unsigned j;
+
+	for (j = 0; j != MIX_BYTES; j++) {
+		if (!(j & 15)) {
+			if (j)
+				fprintf(file, "\n%*s", (int) strlen(s), "");
+			else
+				fprintf(file, "%s", s);
+		}
+		fprintf(file, " %02x", p[j]);
+	}
+	fprintf(file, "\n");
+}
+
+
+static void print_line(const struct text_sink *t, const char *s,
+    const uint8_t *p)
+{
+	if (t->linear)
+		print_line_linear(t->file, s, p);
+	else
+		print_line_asic(t->file, s, p);
+}
+
+
+/* ----- Callbacks --------------------------------------------------------- */
+
+
+static void text_setup(void *user, const uint8_t *seed, const uint8_t *s)
+{
+	const struct text_sink *t = user;
+
+	blob(t->file, "Pre-KEC512", seed, HEADER_HASH_BYTES + NONCE_BYTES);
+	blob(t->file, "Post-KEC512 (s)", s, HASH_BYTES);
+}
+
+
+static void text_dag_line(void *user, unsigned round0, uint32_t s0,
+    uint32_t word_index, uint32_t v2, unsigned full_lines, uint32_t line)
+{
+	const struct text_sink *t = user;
+	uint32_t v1 = round0 ^ s0;
+
+	fprintf(t->file,
+	    "--- Calculate DAG address, round %u (0x%x) ---\n"
+	    "round0: %u (0x%08x)\n"
+	    "s0: 0x%08x\n"
+	    "v1 = round0 ^ s0: 0x%08x\n"
+	    "w: 0x%08x\n"
+	    "word_index = round0 %% w: 0x%08x\n"
+	    "v2 = mix[word_index]: 0x%08x\n"
+	    "f = fnv(v1, v2): 0x%08x\n"
+	    "lines: 0x%08x\n"
+	    "line = f %% lines: 0x%08x\n",
+
+	    round0 + 1, round0 + 1,
+	    round0, round0, s0, v1,
+	    MIX_BYTES / WORD_BYTES, word_index, v2,
+	    fnv(v1, v2),
+	    full_lines, line);
+}
+
+
+static void text_mix(void *user, const uint8_t *mix_in,
+    const uint8_t *dag_line, const uint8_t *mix_out)
+{
+	const struct text_sink *t = user;
+
+	fprintf(t->file, "--- Mix ---\n");
+	print_line(t, "Mix in: ", mix_in);
+	print_line(t, "DAG in: ", dag_line);
+	print_line(t, "Mix out:", mix_out);
+}
+
+
+static void text_compress(void *user, unsigned i, const uint32_t v[4])
+{
+	const struct text_sink *t = user;
+	uint32_t f1 = fnv(v[0], v[1]);
+	uint32_t f2 = fnv(f1, v[2]);
+	uint32_t f3 = fnv(f2, v[3]);
+
+	if (!i)
+		fprintf(t->file, "--- Compress mix ---\n");
+	fprintf(t->file,
+	    "i: 0x%08x\n"
+	    "   v1 = mix[i]: 0x%08x\n"
+	    "   v2 = mix[i + 1]: 0x%08x\n"
+	    "   v3 = mix[i + 2]: 0x%08x\n"
+	    "   v4 = mix[i + 3]: 0x%08x\n"
+	    "   f1 = fnv(v1, v2): 0x%08x\n"
+	    "   f2 = fnv(f1, v3): 0x%08x\n"
+	    "   cmix[i] = fnv(f2, v3): 0x%08x\n",
+	    i, v[0], v[1], v[2], v[3],
+	    f1, f2, f3);
+}
+
+
+static void text_finish(void *user, const uint8_t *pre_kec)
+{
+	const struct text_sink *t = user;
+
+	blob(t->file, "Pre-KEC256", pre_kec, HASH_BYTES + CMIX_BYTES);
+}
+
+
+/* ----- API --------------------------------------------------------------- */
+
+
+struct mine_trace_sink *mine_trace_text_new(FILE *file, bool linear)
+{
+	struct text_sink *t = alloc_type(struct text_sink);
+
+	t->sink.setup = text_setup;
+	t->sink.dag_line = text_dag_line;
+	t->sink.mix = text_mix;
+	t->sink.compress = text_compress;
+	t->sink.finish = text_finish;
+	t->sink.user = t;
+	t->file = file;
+	t->linear = linear;
+	return &t->sink;
+}
+
+
+void mine_trace_text_free(struct mine_trace_sink *sink)
+{
+	free(sink);
+}
@@ -0,0 +1,363 @@
+/*
+ * mkdag.c - Generate a DAG into dagio files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (compare buffered and direct writes, without generation cost):
+ * ./mkdag -w -f 8000000 100 /tmp/dag
+ * ./mkdag -w -f 8000000 -D 100 /tmp/dag
+ *
+ * Striped over two disks, 1 MB per stripe:
+ * ./mkdag -b 1024 -D 100 /disk0/dag /disk1/dag
+ *
+ * In the background of a miner, on two idle threads, computing a quarter of
+ * the time:
+ * ./mkdag -t 2 -I 25 100 /tmp/dag
+ *
+ * A hardware-ready image, in the ASIC's word layout:
+ * ./mkdag -A 100 /tmp/dag.asic
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagasic.h"
+#include "dagio.h"
+#include "dagmeta.h"
+#include "dagthrottle.h"
+
+
+#define	BATCH_LINES	(1 << 16)	/* 8 MB */
+
+
+static bool quiet = 0;
+static bool meta = 1;
+static bool asic = 0;
+static uint32_t stripe_lines = 0;
+static enum dagio_backend backend = dbe_file;
+static struct dagthrottle_cfg throttle = {
+	.threads	= 0,
+	.duty		= 0,
+	.idle		= 0,
+};
+
+
+/* ----- Generation ------------------------------------------------------- */
+
+
+/*
+ * Generation runs in its own thread, one batch ahead of writing. Batch b
+ * goes into buf[b % 2].
+ */
+
+struct gen {
+	const uint8_t	*cache;
+	unsigned	cache_bytes;
+	unsigned	full_lines;
+	uint8_t		*buf[2];
+	unsigned	generated;	/* batches */
+	unsigned	written;	/* batches */
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+};
+
+
+static void *gen_thread(void *arg)
+{
+	struct gen *g = arg;
+	unsigned b, line, n;
+
+	for (b = 0; (uint64_t) b * BATCH_LINES < g->full_lines; b++) {
+		pthread_mutex_lock(&g->mutex);
+		while (b - g->written == 2)
+			pthread_cond_wait(&g->cond, &g->mutex);
+		pthread_mutex_unlock(&g->mutex);
+
+		line = b * BATCH_LINES;
+		n = g->full_lines - line;
+		if (n > BATCH_LINES)
+			n = BATCH_LINES;
+		if (throttle.threads || throttle.duty)
+			dagthrottle_range(g->buf[b & 1], line, n, g->cache,
+			    g->cache_bytes, &throttle, NULL);
+		else
+			calc_dataset_range(g->buf[b & 1], line, n, g->cache,
+			    g->cache_bytes);
+
+		pthread_mutex_lock(&g->mutex);
+		g->generated++;
+		pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->mutex);
+	}
+	return NULL;
+}
+
+
+static uint8_t *gen_wait(struct gen *g, unsigned b)
+{
+	pthread_mutex_lock(&g->mutex);
+	while (g->generated == b)
+		pthread_cond_wait(&g->cond, &g->mutex);
+	pthread_mutex_unlock(&g->mutex);
+	return g->buf[b & 1];
+}
+
+
+static void gen_done(struct gen *g)
+{
+	pthread_mutex_lock(&g->mutex);
+	g->written++;
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->mutex);
+}
+
+
+/* ----- Generate and write ------------------------------------------------ */
+
+
+static void mkdag(char *const *paths, unsigned files, unsigned epoch,
+    unsigned full_lines, const struct dagio_writer_cfg *cfg, bool write_only)
+{
+	const char *path = paths[0];
+	struct dag_handle *h;
+	struct dagio_writer *w;
+	struct dagio_writer_stats st;
+	struct dagmeta *m = NULL;
+	char *meta_path = dagmeta_path(path);
+	uint8_t seed[SEED_BYTES];
+	unsigned cache_bytes = get_cache_size(epoch);
+	uint8_t *cache, *buf;
+	struct gen g;
+	pthread_t thread;
+	unsigned line, n;
+	int err;
+
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+
+	get_seedhash(seed, epoch);
+	cache = alloc_size(cache_bytes);
+	mkcache(cache, cache_bytes, seed);
+
+	buf = alloc_size((size_t) BATCH_LINES * DAG_LINE_BYTES);
+	if (write_only) {
+		calc_dataset_range(buf, 0, BATCH_LINES, cache, cache_bytes);
+	} else {
+		if (meta && !asic)
+			m = dagmeta_new(dag_algo, epoch, full_lines, seed, 0);
+		g.cache = cache;
+		g.cache_bytes = cache_bytes;
+		g.full_lines = full_lines;
+		g.buf[0] = buf;
+		g.buf[1] = alloc_size((size_t) BATCH_LINES * DAG_LINE_BYTES);
+		g.generated = g.written = 0;
+		pthread_mutex_init(&g.mutex, NULL);
+		pthread_cond_init(&g.cond, NULL);
+		err = pthread_create(&thread, NULL, gen_thread, &g);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	/* we either write a new sidecar at the end, or none */
+	dagmeta_remove(meta_path);
+	h = dagio_open_backend(backend, (const char *const *) paths, files,
+	    O_WRONLY | O_CREAT | O_TRUNC, full_lines, stripe_lines);
+	w = dagio_writer_open(h, cfg);
+	for (line = 0; line != full_lines; line += n) {
+		n = full_lines - line;
+		if (n > BATCH_LINES)
+			n = BATCH_LINES;
+		if (write_only) {
+			dagio_writer_write(w, buf, n);
+			continue;
+		}
+		buf = gen_wait(&g, line / BATCH_LINES);
+		if (m)
+			dagmeta_sum(m, buf, n, line);
+		if (asic)
+			dagasic_to_asic(buf, buf, n);
+		dagio_writer_write(w, buf, n);
+		gen_done(&g);
+	}
+	dagio_writer_close(w, &st);
+	dagio_close(h);
+
+	if (!write_only) {
+		pthread_join(thread, NULL);
+		pthread_cond_destroy(&g.cond);
+		pthread_mutex_destroy(&g.mutex);
+		free(g.buf[0]);
+		buf = g.buf[1];
+	}
+
+	if (m) {
+		dagmeta_write(m, meta_path);
+		dagmeta_free(m);
+	}
+	free(meta_path);
+
+	if (!quiet)
+		printf("%s epoch %u: %llu bytes in %.3f s, %.1f MB/s (%s)\n",
+		    dagalgo_name(dag_algo), epoch,
+		    (unsigned long long) st.bytes, st.seconds, st.mb_s,
+		    st.direct ? "direct" : "buffered");
+
+	free(buf);
+	free(cache);
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-A] [-a algo] [-B backend] [-b stripe_kB]\n"
+"       %*s[-D [-c chunk_kB] [-i inflight]] [-f dag_lines] [-I duty] [-M]\n"
+"       %*s[-q] [-S none|end|chunk] [-t threads] [-w] epoch dag-file ...\n\n"
+"  -A  write the DAG in the ASIC's word layout (implies -M)\n"
+"  -a algo\n"
+"      DAG algorithm (ethash, etchash, ubqhash; default: ethash)\n"
+"  -B backend\n"
+"      storage backend (file, mmap, uring; default: file)\n"
+"  -b stripe_kB\n"
+"      stripe the DAG over the dag-files, in stripes of this size\n"
+"  -c chunk_kB\n"
+"      size of each direct write, in kB (default: 1024)\n"
+"  -D  write with O_DIRECT and asynchronous I/O\n"
+"  -f dag_lines\n"
+"      override the DAG size\n"
+"  -I duty\n"
+"      generate at idle priority, computing only duty percent of the time\n"
+"  -i inflight\n"
+"      number of direct writes in flight (default: 8)\n"
+"  -M  don't write the metadata sidecar (dag-file.meta)\n"
+"  -q  quiet operation\n"
+"  -S none|end|chunk\n"
+"      sync policy (default: none)\n"
+"  -t threads\n"
+"      generate with this many threads (default: 1)\n"
+"  -w  write only: repeat the first batch instead of generating the DAG\n"
+"      (implies -M)\n"
+	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct dagio_writer_cfg cfg = {
+		.direct	= 0,
+		.sync	= dsync_none,
+	};
+	unsigned full_lines = 0;
+	unsigned epoch;
+	bool write_only = 0;
+	char *end;
+	int c, algo;
+
+	while ((c = getopt(argc, argv, "Aa:B:b:c:Df:I:i:MqS:t:w")) != EOF)
+		switch (c) {
+		case 'A':
+			asic = 1;
+			break;
+		case 'a':
+			algo = dagalgo_code(optarg);
+			if (algo < 0)
+				usage(*argv);
+			dag_algo = algo;
+			break;
+		case 'B':
+			algo = dagio_backend_code(optarg);
+			if (algo < 0)
+				usage(*argv);
+			backend = algo;
+			break;
+		case 'b':
+			stripe_lines = (strtoul(optarg, &end, 0) << 10) /
+			    DAG_LINE_BYTES;
+			if (*end || !stripe_lines)
+				usage(*argv);
+			break;
+		case 'c':
+			cfg.chunk_bytes = strtoul(optarg, &end, 0) << 10;
+			if (*end)
+				usage(*argv);
+			break;
+		case 'D':
+			cfg.direct = 1;
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'I':
+			throttle.duty = strtoul(optarg, &end, 0);
+			if (*end || !throttle.duty || throttle.duty > 100)
+				usage(*argv);
+			throttle.idle = 1;
+			break;
+		case 'i':
+			cfg.inflight = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'M':
+			meta = 0;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'S':
+			if (!strcmp(optarg, "none"))
+				cfg.sync = dsync_none;
+			else if (!strcmp(optarg, "end"))
+				cfg.sync = dsync_end;
+			else if (!strcmp(optarg, "chunk"))
+				cfg.sync = dsync_chunk;
+			else
+				usage(*argv);
+			break;
+		case 't':
+			throttle.threads = strtoul(optarg, &end, 0);
+			if (*end || !throttle.threads)
+				usage(*argv);
+			break;
+		case 'w':
+			write_only = 1;
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind < 2)
+		usage(*argv);
+	if (!stripe_lines && argc - optind != 2)
+		usage(*argv);
+	epoch = strtoul(argv[optind], &end, 0);
+	if (*end)
+		usage(*argv);
+
+	mkdag(argv + optind + 1, argc - optind - 1, epoch, full_lines, &cfg,
+	    write_only);
+
+	return 0;
+}
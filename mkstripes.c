@@ -0,0 +1,282 @@
+/*
+ * mkstripes.c - Per-channel DAG images, and how accesses spread over them
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (four channels, two lines at a time, images in /tmp/ch.0 to .3):
+ * ./mkstripes -n 4 -g 2 -o /tmp/ch 100 /tmp/dag
+ *
+ * Hot spots of 10000 nonces with eight word-sliced channels of 32 banks:
+ * ./mkstripes -m word -n 8 -k 32 -s 10000 100 /tmp/dag
+ *
+ * The same, with the accesses of a dagcapture trace:
+ * ./mkstripes -m word -n 8 -k 32 -r trace100 100 /tmp/dag
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagio.h"
+#include "mine.h"
+#include "dagtrace.h"
+#include "dagstripe.h"
+
+#include "util.h"
+
+
+static uint32_t stripe_lines = 0;
+static enum dagio_backend backend = dbe_file;
+
+
+/* ----- Export ------------------------------------------------------------ */
+
+
+static void export(const struct dagstripe_cfg *cfg, struct dag_handle *h,
+    const char *prefix)
+{
+	char **paths = alloc_size(sizeof(char *) * cfg->channels);
+	unsigned i;
+
+	for (i = 0; i != cfg->channels; i++)
+		if (asprintf(paths + i, "%s.%u", prefix, i) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+	dagstripe_export(cfg, h, paths);
+	for (i = 0; i != cfg->channels; i++) {
+		printf("%s: %llu bytes\n", paths[i], (unsigned long long)
+		    dagstripe_channel_bytes(cfg, dagio_full_lines(h), i));
+		free(paths[i]);
+	}
+	free(paths);
+}
+
+
+/* ----- Access analysis --------------------------------------------------- */
+
+
+static void sample(struct dagstripe_stats *s, struct dag_handle *h,
+    const uint8_t *header_hash, uint64_t nonces)
+{
+	unsigned full_lines = dagio_full_lines(h);
+	uint8_t buf[DAG_LINE_BYTES];
+	uint8_t mix[MIX_BYTES];
+	uint8_t seed[HASH_BYTES];
+	uint32_t line[ACCESSES];
+	uint64_t nonce;
+	unsigned i;
+
+	for (nonce = 0; nonce != nonces; nonce++) {
+		mix_setup(mix, seed, header_hash, nonce);
+		for (i = 0; i != ACCESSES; i++) {
+			line[i] = mix_dag_line(i, mix, seed, full_lines);
+			dagio_pread(h, buf, 1, line[i]);
+			mix_do_mix(mix, buf);
+		}
+		dagstripe_account(s, line);
+	}
+}
+
+
+static void replay(struct dagstripe_stats *s, const char *path,
+    unsigned full_lines)
+{
+	struct dagtrace_record *rec = alloc_type(struct dagtrace_record);
+	struct dagtrace_reader *r;
+
+	r = dagtrace_open(path);
+	if (!r) {
+		perror(path);
+		exit(1);
+	}
+	if (dagtrace_info(r)->full_lines != full_lines) {
+		fprintf(stderr, "%s: trace is for %u lines, not %u\n", path,
+		    dagtrace_info(r)->full_lines, full_lines);
+		exit(1);
+	}
+	while (dagtrace_read(r, rec))
+		dagstripe_account(s, rec->line);
+	dagtrace_reader_close(r);
+	free(rec);
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-B backend] [-b stripe_kB] [-f dag_lines] [-g granule]\n"
+"       %*s[-k banks] [-m line|word|bit] [-n channels] [-R row_bytes]\n"
+"       %*s[-o prefix] [-r trace_file] [-s nonces [-H header_hash]]\n"
+"       %*sepoch dag-file ...\n\n"
+"  -B backend\n"
+"      storage backend (file, mmap, mem, uring; default: file)\n"
+"  -b stripe_kB\n"
+"      the DAG is striped over the dag-files, in stripes of this size\n"
+"  -f dag_lines\n"
+"      override the DAG size\n"
+"  -g granule\n"
+"      lines (line) or words (word) per channel and turn (default: 1)\n"
+"  -H header_hash\n"
+"      header hash for -s (default: all zero)\n"
+"  -k banks\n"
+"      banks per channel (default: 16)\n"
+"  -m line|word|bit\n"
+"      interleave (default: line)\n"
+"  -n channels\n"
+"      number of channels (default: 4)\n"
+"  -R row_bytes\n"
+"      bytes per row in a channel (default: 2048)\n"
+"  -o prefix\n"
+"      write the channel images to prefix.0, prefix.1, ...\n"
+"  -r trace_file\n"
+"      analyze the accesses recorded by dagcapture\n"
+"  -s nonces\n"
+"      analyze the accesses of nonces 0 to nonces - 1\n"
+	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "",
+	    (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct dagstripe_cfg cfg = {
+		.mode		= dsm_line,
+		.channels	= 4,
+	};
+	uint8_t header_hash[HEADER_HASH_BYTES];
+	const char *prefix = NULL;
+	const char *trace = NULL;
+	unsigned long long nonces = 0;
+	unsigned full_lines = 0;
+	unsigned epoch;
+	struct dag_handle *h;
+	struct dagstripe_stats *s;
+	char *end;
+	int c, code;
+
+	memset(header_hash, 0, sizeof(header_hash));
+	while ((c = getopt(argc, argv, "B:b:f:g:H:k:m:n:o:R:r:s:")) != EOF)
+		switch (c) {
+		case 'B':
+			code = dagio_backend_code(optarg);
+			if (code < 0)
+				usage(*argv);
+			backend = code;
+			break;
+		case 'b':
+			stripe_lines = (strtoul(optarg, &end, 0) << 10) /
+			    DAG_LINE_BYTES;
+			if (*end || !stripe_lines)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'g':
+			cfg.granule = strtoul(optarg, &end, 0);
+			if (*end || !cfg.granule)
+				usage(*argv);
+			break;
+		case 'H':
+			hex_decode_big_endian(header_hash, optarg,
+			    HEADER_HASH_BYTES);
+			break;
+		case 'k':
+			cfg.banks = strtoul(optarg, &end, 0);
+			if (*end || !cfg.banks)
+				usage(*argv);
+			break;
+		case 'm':
+			code = dagstripe_mode_code(optarg);
+			if (code < 0)
+				usage(*argv);
+			cfg.mode = code;
+			break;
+		case 'n':
+			cfg.channels = strtoul(optarg, &end, 0);
+			if (*end || !cfg.channels)
+				usage(*argv);
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		case 'R':
+			cfg.row_bytes = strtoul(optarg, &end, 0);
+			if (*end || !cfg.row_bytes)
+				usage(*argv);
+			break;
+		case 'r':
+			trace = optarg;
+			break;
+		case 's':
+			nonces = strtoull(optarg, &end, 0);
+			if (*end || !nonces)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind < 2)
+		usage(*argv);
+	if (!stripe_lines && argc - optind != 2)
+		usage(*argv);
+	if (!prefix && !trace && !nonces)
+		usage(*argv);
+	if (!dagstripe_check(&cfg)) {
+		fprintf(stderr, "%s interleave can't split a line into %u "
+		    "channels with granule %u\n", dagstripe_mode_name(cfg.mode),
+		    cfg.channels, cfg.granule ? cfg.granule : 1);
+		exit(1);
+	}
+	epoch = strtoul(argv[optind], &end, 0);
+	if (*end)
+		usage(*argv);
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+
+	h = dagio_open_backend(backend, (const char *const *) argv + optind + 1,
+	    argc - optind - 1, O_RDONLY, full_lines, stripe_lines);
+	if (dagio_bytes(h) != (uint64_t) full_lines * DAG_LINE_BYTES) {
+		fprintf(stderr, "%s: %llu bytes instead of %llu\n",
+		    argv[optind + 1], (unsigned long long) dagio_bytes(h),
+		    (unsigned long long) full_lines * DAG_LINE_BYTES);
+		exit(1);
+	}
+
+	if (prefix)
+		export(&cfg, h, prefix);
+	if (trace || nonces) {
+		s = dagstripe_stats_new(&cfg);
+		if (trace)
+			replay(s, trace, full_lines);
+		if (nonces)
+			sample(s, h, header_hash, nonces);
+		if (prefix)
+			printf("\n");
+		dagstripe_report(s, stdout);
+		dagstripe_stats_free(s);
+	}
+	dagio_close(h);
+	return 0;
+}
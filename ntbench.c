@@ -0,0 +1,257 @@
+/*
+ * ntbench.c - Compare DAG generation with normal and non-temporal stores
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (epoch 400, 1 GB of DAG per run):
+ * ./ntbench -f 8388608 400
+ *
+ * LLC counters need access to the PMU, e.g., perf_event_paranoid <= 2 on
+ * bare metal. Without them, only the throughput is reported.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagalgo.h"
+
+
+#define	DEFAULT_LINES	(1 << 18)	/* 32 MB, more than most LLCs */
+
+
+enum counter {
+	cnt_read_access,
+	cnt_read_miss,
+	cnt_write_miss,
+	counters
+};
+
+static const char *counter_name[] = {
+	[cnt_read_access]	= "LLC loads",
+	[cnt_read_miss]		= "LLC load misses",
+	[cnt_write_miss]	= "LLC store misses",
+};
+
+static const uint64_t counter_config[] = {
+	[cnt_read_access]	= PERF_COUNT_HW_CACHE_LL |
+				  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+				  PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16,
+	[cnt_read_miss]		= PERF_COUNT_HW_CACHE_LL |
+				  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+				  PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+	[cnt_write_miss]	= PERF_COUNT_HW_CACHE_LL |
+				  PERF_COUNT_HW_CACHE_OP_WRITE << 8 |
+				  PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+/* ----- Performance counters ---------------------------------------------- */
+
+
+static int counter_open(enum counter c)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = counter_config[c];
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static void counters_start(const int *fd)
+{
+	unsigned i;
+
+	for (i = 0; i != counters; i++)
+		if (fd[i] >= 0) {
+			ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+}
+
+
+static void counters_stop(const int *fd, uint64_t *res)
+{
+	unsigned i;
+
+	for (i = 0; i != counters; i++) {
+		res[i] = 0;
+		if (fd[i] < 0)
+			continue;
+		ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd[i], res + i, sizeof(uint64_t)) != sizeof(uint64_t))
+			res[i] = 0;
+	}
+}
+
+
+/* ----- Benchmark --------------------------------------------------------- */
+
+
+static void bench(const char *mode, bool nt, uint8_t *dag, unsigned lines,
+    const uint8_t *cache, unsigned cache_bytes, unsigned runs, const int *fd)
+{
+	uint64_t sum[counters] = { 0, };
+	uint64_t res[counters];
+	double t0, t = 0;
+	unsigned r, i;
+
+	for (r = 0; r != runs; r++) {
+		counters_start(fd);
+		t0 = now();
+		if (nt)
+			calc_dataset_range_nt(dag, 0, lines, cache,
+			    cache_bytes);
+		else
+			calc_dataset_range(dag, 0, lines, cache, cache_bytes);
+		t += now() - t0;
+		counters_stop(fd, res);
+		for (i = 0; i != counters; i++)
+			sum[i] += res[i];
+	}
+
+	printf("%-8s %10.0f lines/s\n", mode, (double) lines * runs / t);
+	for (i = 0; i != counters; i++) {
+		if (fd[i] < 0) {
+			printf("%8s %-18s n/a\n", "", counter_name[i]);
+			continue;
+		}
+		printf("%8s %-18s %14llu (%.2f per line)\n", "",
+		    counter_name[i], (unsigned long long) sum[i],
+		    (double) sum[i] / lines / runs);
+	}
+	if (fd[cnt_read_access] >= 0 && fd[cnt_read_miss] >= 0 &&
+	    sum[cnt_read_access])
+		printf("%8s %-18s %13.2f%%\n", "", "LLC load miss rate",
+		    100.0 * sum[cnt_read_miss] / sum[cnt_read_access]);
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-a algo] [-f dag_lines] [-r runs] epoch\n\n"
+"  -a algo\n"
+"      DAG algorithm (ethash, etchash, ubqhash; default: ethash)\n"
+"  -f dag_lines\n"
+"      number of lines to generate per run (default: %u)\n"
+"  -r runs\n"
+"      number of runs per mode (default: 1)\n"
+	    , name, DEFAULT_LINES);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned lines = DEFAULT_LINES;
+	unsigned runs = 1;
+	unsigned epoch, cache_bytes;
+	uint8_t seed[SEED_BYTES];
+	uint8_t *cache, *dag, *ref;
+	int fd[counters];
+	unsigned i;
+	char *end;
+	int c, algo;
+
+	while ((c = getopt(argc, argv, "a:f:r:")) != EOF)
+		switch (c) {
+		case 'a':
+			algo = dagalgo_code(optarg);
+			if (algo < 0)
+				usage(*argv);
+			dag_algo = algo;
+			break;
+		case 'f':
+			lines = strtoul(optarg, &end, 0);
+			if (*end || !lines)
+				usage(*argv);
+			break;
+		case 'r':
+			runs = strtoul(optarg, &end, 0);
+			if (*end || !runs)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind != 1)
+		usage(*argv);
+	epoch = strtoul(argv[optind], &end, 0);
+	if (*end)
+		usage(*argv);
+
+	cache_bytes = get_cache_size(epoch);
+	cache = alloc_size(cache_bytes);
+	get_seedhash(seed, epoch);
+	mkcache(cache, cache_bytes, seed);
+
+	/* malloc'ed memory is at least 16-byte aligned */
+	dag = alloc_size((size_t) lines * DAG_LINE_BYTES);
+	memset(dag, 0, (size_t) lines * DAG_LINE_BYTES);
+
+	for (i = 0; i != counters; i++)
+		fd[i] = counter_open(i);
+	if (fd[cnt_read_miss] < 0)
+		perror("perf_event_open");
+
+	bench("normal", 0, dag, lines, cache, cache_bytes, runs, fd);
+
+	/*
+	 * Both must produce the same DAG. Clear the buffer, so that lines the
+	 * non-temporal path fails to store don't pass as correct.
+	 */
+	ref = alloc_size((size_t) lines * DAG_LINE_BYTES);
+	memcpy(ref, dag, (size_t) lines * DAG_LINE_BYTES);
+	memset(dag, 0, (size_t) lines * DAG_LINE_BYTES);
+
+	bench("nt", 1, dag, lines, cache, cache_bytes, runs, fd);
+
+	for (i = 0; i != lines; i++)
+		if (memcmp(dag + (size_t) i * DAG_LINE_BYTES,
+		    ref + (size_t) i * DAG_LINE_BYTES, DAG_LINE_BYTES)) {
+			fprintf(stderr, "nt: line %u differs\n", i);
+			exit(1);
+		}
+
+	for (i = 0; i != counters; i++)
+		if (fd[i] >= 0)
+			close(fd[i]);
+	free(ref);
+	free(dag);
+	free(cache);
+	return 0;
+}
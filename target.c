@@ -1,8 +1,8 @@
 /*
  * target.c - Target difficulty calculation and comparison
- * 
+ *
  * Copyright (C) 2021 Linzhi Ltd.
- *   
+ *
  * This work is licensed under the terms of the MIT License.
  * A copy of the license can be found in the file COPYING.txt
  */
@@ -12,137 +12,164 @@
 #include <stdint.h>
 #include <string.h>
 
-#ifdef USE_GCRYPT
-#include <gcrypt.h>
-#endif
-
 #include "common.h"
 #include "mine.h"
 
 
-/* ----- Target check ------------------------------------------------------ */
-
 /*
- * "target" is 32 bytes
- *
- * https://www.gnupg.org/documentation/manuals/gcrypt/MPI-library.html
- *
- * Difficulty had a local peak on 2018-03-27 at 3'339'796'333'912'015, which
- * is roughly 2^51.57. So we're only a factor of about 5000 from needing more
- * than 64 bits.
+ * 256-bit numbers are four 64-bit limbs, least significant limb first, like
+ * "difficulty". Targets and results are big-endian byte strings.
  */
 
-#ifdef USE_GCRYPT
+#define	LIMBS	4
 
-void get_target(uint8_t *target, const uint64_t difficulty[4])
+
+static inline uint64_t read64_be(const uint8_t *p)
+{
+	return __builtin_bswap64(read64(p));
+}
+
+
+static void load_be(uint64_t *v, const uint8_t *p)
 {
-	gcry_mpi_t a, b, q;
 	unsigned i;
 
-	a = gcry_mpi_new(257);
-	b = gcry_mpi_new(257);
-	q = gcry_mpi_new(257);
-
-	/* a = 1 << 256 */
-	gcry_mpi_set_ui(a, 1);
-	gcry_mpi_mul_2exp(a, a, 256);
-
-	/* b = difficulty */
-	gcry_mpi_set_ui(b, 0);
-	for (i = 0; i != 4; i++) {
-		gcry_mpi_mul_2exp(b, b, 32);
-		gcry_mpi_add_ui(b, b, difficulty[3 - i] >> 32);
-		gcry_mpi_mul_2exp(b, b, 32);
-		gcry_mpi_add_ui(b, b, (uint32_t) difficulty[3 - i]);
-	}
+	for (i = 0; i != LIMBS; i++)
+		v[LIMBS - 1 - i] = read64_be(p + 8 * i);
+}
 
-	/* q = a / b */
-	gcry_mpi_div(q, NULL, a, b, 0);
 
-	/* @@@ is bitwise extraction REALLY the best we can do ?!? */
-	memset(target, 0, TARGET_BYTES);
-	for (i = 0; i != TARGET_BYTES * 8; i++)
-		if (gcry_mpi_test_bit(q, i))
-			target[TARGET_BYTES - 1 - (i >> 3)] |= 1 << (i & 7);
+static void store_be(uint8_t *p, const uint64_t *v)
+{
+	unsigned i;
 
-	gcry_mpi_release(a);
-	gcry_mpi_release(b);
-	gcry_mpi_release(q);
+	for (i = 0; i != LIMBS; i++)
+		write64(p + 8 * i, __builtin_bswap64(v[LIMBS - 1 - i]));
 }
 
-#else /* USE_GCRYPT */
 
+/* ----- Division ---------------------------------------------------------- */
 
 /*
- * Bit vectors are LSb first, i.e. vec[0] is the LSb, vec[n - 1] is the MSb.
+ * Difficulty had a local peak on 2018-03-27 at 3'339'796'333'912'015, which
+ * is roughly 2^51.57. So we're only a factor of about 5000 from needing more
+ * than 64 bits.
+ *
+ * Both directions (difficulty to target, result to share difficulty) are
+ * q = 2^256 / d. For d = 0 and d = 1, q doesn't fit in 256 bits, and we
+ * saturate at 2^256 - 1.
  */
 
-static bool vec_le(const bool *a, unsigned a_n, const bool *b, unsigned b_n)
+static void div_short(uint64_t *q, uint64_t d)
 {
-	unsigned i = a_n > b_n ? a_n : b_n;
+	unsigned __int128 r = 1;	/* the 2^256 */
+	unsigned i;
 
-	while (i--) {
-		if ((i < a_n && a[i]) == (i < b_n && b[i]))
-			continue;
-		return i < b_n && b[i];
+	for (i = LIMBS; i--;) {
+		r = r << 64;
+		q[i] = r / d;
+		r %= d;
 	}
-	return 1;
 }
 
 
-static bool vec_sub(bool *a, unsigned a_n, const bool *b, unsigned b_n)
-{
-	bool borrow = 0;
-	unsigned i;
+/*
+ * Knuth, TAOCP vol. 2, 4.3.1, Algorithm D, with 64-bit digits. The divisor
+ * has n > 1 digits. The dividend 2^256 has LIMBS + 1 digits, and the
+ * quotient LIMBS + 2 - n.
+ */
 
-	for (i = 0; i != a_n && i != b_n; i++) {
-		int sum = a[i] - borrow - b[i];
+static void div_long(uint64_t *q, const uint64_t *d, unsigned n)
+{
+	uint64_t u[LIMBS + 2] = { 0, };
+	uint64_t v[LIMBS];
+	unsigned __int128 num, qhat, rhat, p;
+	__int128 t, k;
+	unsigned s, i, j;
+
+	/* normalize, so that the top digit of v has its MSb set */
+	s = __builtin_clzll(d[n - 1]);
+	for (i = n - 1; i; i--)
+		v[i] = s ? d[i] << s | d[i - 1] >> (64 - s) : d[i];
+	v[0] = d[0] << s;
+	u[LIMBS] = (uint64_t) 1 << s;
+
+	for (j = LIMBS + 2 - n; j--;) {
+		num = (unsigned __int128) u[j + n] << 64 | u[j + n - 1];
+		qhat = num / v[n - 1];
+		rhat = num % v[n - 1];
+		while (qhat >> 64 ||
+		    qhat * v[n - 2] > (rhat << 64 | u[j + n - 2])) {
+			qhat--;
+			rhat += v[n - 1];
+			if (rhat >> 64)
+				break;
+		}
 
-		a[i] = sum & 1;
-		borrow = sum < 0;
+		/* u[j ... j + n] -= qhat * v */
+		k = 0;
+		for (i = 0; i != n; i++) {
+			p = qhat * v[i];
+			t = (__int128) u[i + j] - k - (uint64_t) p;
+			u[i + j] = t;
+			k = (__int128) (p >> 64) - (t >> 64);
+		}
+		t = (__int128) u[j + n] - k;
+		u[j + n] = t;
+
+		q[j] = qhat;
+		if (t < 0) {
+			/* qhat was one too large: add v back */
+			q[j]--;
+			k = 0;
+			for (i = 0; i != n; i++) {
+				t = (__int128) u[i + j] + v[i] + k;
+				u[i + j] = t;
+				k = t >> 64;
+			}
+			u[j + n] += k;
+		}
 	}
-	while (i != b_n)
-		if (b[i++])
-			return 1;
-	while (i != a_n && borrow) {
-		int sum = a[i] - borrow;
-
-		a[i] = sum & 1;
-		borrow = sum < 0;
-		i++;
+}
+
+
+static void div_2_256(uint64_t *q, const uint64_t *d)
+{
+	unsigned n = LIMBS;
+
+	while (n && !d[n - 1])
+		n--;
+	if (n < 2 && (!n || d[0] == 1)) {
+		memset(q, 0xff, LIMBS * sizeof(uint64_t));
+		return;
 	}
-	return borrow;
+	memset(q, 0, LIMBS * sizeof(uint64_t));
+	if (n == 1)
+		div_short(q, d[0]);
+	else
+		div_long(q, d, n);
 }
 
 
 void get_target(uint8_t *target, const uint64_t difficulty[4])
 {
-	bool a[257] = { 0, };
-	bool b[256];
-	bool q[256];
-	unsigned i;
+	uint64_t q[LIMBS];
 
-	// a = 1 << 256
-	a[256] = 1;
+	div_2_256(q, difficulty);
+	store_be(target, q);
+}
 
-	// b = difficulty
-	for (i = 0; i != 256; i++)
-		b[i] = (difficulty[i >> 6] >> i) & 1;
 
-	for (i = 0; i != 256; i++)
-		q[i] = 0;
+void share_difficulty(uint64_t difficulty[4], const uint8_t *result)
+{
+	uint64_t d[LIMBS];
 
-	for (i = 256; i--;) {
-		if (vec_le(b, 256, a + i, 257 - i)) {
-			q[i] = 1;
-			vec_sub(a + i, 257 - i, b, 256);
-		}
-	}
-	for (i = 0; i != TARGET_BYTES * 8; i++)
-		target[TARGET_BYTES - 1 - (i >> 3)] |= q[i] << (i & 7);
+	load_be(d, result);
+	div_2_256(difficulty, d);
 }
 
-#endif /* !USE_GCRYPT */
+
+/* ----- Target check ------------------------------------------------------ */
 
 /*
  * The comparison in the Ethash reference (between a Python dictionary and a
@@ -153,9 +180,50 @@ void get_target(uint8_t *target, const uint64_t difficulty[4])
  * The comparison in ethminer is "result < boundary", unlike the <= one would
  * derive from "dictionary > target" in ethash.py. We therefore use
  * "result < target" as well.
+ *
+ * Nearly all results differ from the target in the first word, so we compare
+ * big-endian 64-bit words instead of bytes.
  */
 
+static inline bool below(const uint8_t *result, const uint64_t *t)
+{
+	uint64_t r;
+	unsigned i;
+
+	for (i = 0; i != LIMBS; i++) {
+		r = read64_be(result + 8 * i);
+		if (r != t[i])
+			return r < t[i];
+	}
+	return 0;
+}
+
+
 bool below_target(const uint8_t *result, const uint8_t *target)
 {
-	return memcmp(result, target, TARGET_BYTES) < 0;
+	uint64_t t[LIMBS];
+	unsigned i;
+
+	for (i = 0; i != LIMBS; i++)
+		t[i] = read64_be(target + 8 * i);
+	return below(result, t);
+}
+
+
+unsigned below_target_batch(bool *res, const uint8_t *results, unsigned n,
+    const uint8_t *target)
+{
+	uint64_t t[LIMBS];
+	unsigned i, hits = 0;
+	bool b;
+
+	for (i = 0; i != LIMBS; i++)
+		t[i] = read64_be(target + 8 * i);
+	for (i = 0; i != n; i++) {
+		b = below(results + (size_t) i * RESULT_BYTES, t);
+		if (res)
+			res[i] = b;
+		hits += b;
+	}
+	return hits;
 }
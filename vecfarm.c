@@ -0,0 +1,528 @@
+/*
+ * vecfarm.c - Generate Ethash test vectors in bulk
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (one million synthetic vectors, as with mixone 589824, on all
+ * CPUs):
+ * ./vecfarm -t $(nproc) 589824 \
+ *   0x0000000000000000000000000000000000000000000000000000000000001234 \
+ *   0x303 1000000 vectors.bin
+ *
+ * Real epoch 400, from a DAG file, with the mix after each round, as JSONL:
+ * ./vecfarm -j -m -D dag400 -e 400 \
+ *   0x892a2e92b8a050dff196e1a19efcb2a903655584913e719435c0ad2b53cfa7bd \
+ *   0 1000 vectors.jsonl
+ *
+ * Binary format (all integers little-endian):
+ *
+ * Header (64 bytes):
+ *	magic "DAGVECS\0", u32 version (1), u32 flags (1: with mixes),
+ *	u32 mode (0: synthetic, 1: epoch), u32 epoch (0 if synthetic),
+ *	u32 full_lines, u32 record_bytes, 32 bytes of zero
+ *
+ * Records, in nonce order:
+ *	header_hash[32], u64 nonce, u32 line[64],
+ *	if flag 1: mix[64][128] after each round,
+ *	cmix[32], result[32]
+ *
+ * JSONL records have the same fields, with byte strings in hex, in memory
+ * order. (mixone prints "mix" byte-reversed.)
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "linzhi/alloc.h"
+
+#include "common.h"
+#include "dag.h"
+#include "mdag.h"
+#include "mine.h"
+#include "dagthrottle.h"
+
+#include "util.h"
+
+
+#define	MAGIC		"DAGVECS"	/* and the NUL */
+#define	VERSION		1
+#define	HDR_BYTES	64
+#define	FLAG_MIXES	1
+#define	CHUNK		1024		/* nonces a thread takes at a time */
+
+
+enum mode {
+	mode_synth,	/* cache size 1, all-zero seed hash, DAG lines */
+	mode_epoch,	/* parameter is (ETH) epoch number */
+	mode_block,	/* parameter is (ETH) block number */
+};
+
+struct vector {
+	uint64_t	nonce;
+	uint32_t	line[ACCESSES];
+	uint8_t		mix[ACCESSES][MIX_BYTES];
+	uint8_t		cmix[CMIX_BYTES];
+	uint8_t		result[RESULT_BYTES];
+};
+
+struct farm {
+	const uint8_t	*header_hash;
+	const uint8_t	*cache;		/* light: each thread makes a copy */
+	unsigned	cache_bytes;
+	const uint8_t	*dag;		/* full: shared */
+	unsigned	full_lines;
+	uint64_t	first, count;
+	uint64_t	next_chunk;	/* next chunk to compute */
+	uint64_t	write_chunk;	/* next chunk to write */
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	FILE		*file;
+};
+
+
+static bool json = 0;
+static bool mixes = 0;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* ----- Records ----------------------------------------------------------- */
+
+
+static unsigned record_bytes(void)
+{
+	return HEADER_HASH_BYTES + 8 + ACCESSES * 4 +
+	    (mixes ? ACCESSES * MIX_BYTES : 0) + CMIX_BYTES + RESULT_BYTES;
+}
+
+
+static char *hex(char *p, const uint8_t *buf, unsigned bytes)
+{
+	static const char digits[] = "0123456789abcdef";
+	unsigned i;
+
+	for (i = 0; i != bytes; i++) {
+		*p++ = digits[buf[i] >> 4];
+		*p++ = digits[buf[i] & 15];
+	}
+	return p;
+}
+
+
+static char *encode_json(char *p, const uint8_t *header_hash,
+    const struct vector *v)
+{
+	unsigned i;
+
+	p += sprintf(p, "{\"header\":\"");
+	p = hex(p, header_hash, HEADER_HASH_BYTES);
+	p += sprintf(p, "\",\"nonce\":\"0x%llx\",\"lines\":[",
+	    (unsigned long long) v->nonce);
+	for (i = 0; i != ACCESSES; i++)
+		p += sprintf(p, "%s%u", i ? "," : "", v->line[i]);
+	p += sprintf(p, "]");
+	if (mixes) {
+		p += sprintf(p, ",\"mix\":[");
+		for (i = 0; i != ACCESSES; i++) {
+			p += sprintf(p, "%s\"", i ? "," : "");
+			p = hex(p, v->mix[i], MIX_BYTES);
+			*p++ = '"';
+		}
+		*p++ = ']';
+	}
+	p += sprintf(p, ",\"cmix\":\"");
+	p = hex(p, v->cmix, CMIX_BYTES);
+	p += sprintf(p, "\",\"result\":\"");
+	p = hex(p, v->result, RESULT_BYTES);
+	p += sprintf(p, "\"}\n");
+	return p;
+}
+
+
+static char *encode_binary(char *p, const uint8_t *header_hash,
+    const struct vector *v)
+{
+	uint8_t *q = (uint8_t *) p;
+	unsigned i;
+
+	memcpy(q, header_hash, HEADER_HASH_BYTES);
+	q += HEADER_HASH_BYTES;
+	write64(q, v->nonce);
+	q += 8;
+	for (i = 0; i != ACCESSES; i++) {
+		write32(q, v->line[i]);
+		q += 4;
+	}
+	if (mixes) {
+		memcpy(q, v->mix, ACCESSES * MIX_BYTES);
+		q += ACCESSES * MIX_BYTES;
+	}
+	memcpy(q, v->cmix, CMIX_BYTES);
+	q += CMIX_BYTES;
+	memcpy(q, v->result, RESULT_BYTES);
+	return (char *) q + RESULT_BYTES;
+}
+
+
+/*
+ * Upper bound for a JSON record: 2 hex digits per byte, up to 11 characters
+ * per line number, and 4 of quotes and comma per mix, plus 128 bytes for
+ * the field names.
+ */
+
+static size_t max_record(void)
+{
+	if (!json)
+		return record_bytes();
+	return 2 * (HEADER_HASH_BYTES + CMIX_BYTES + RESULT_BYTES) + 20 +
+	    11 * ACCESSES + (mixes ? ACCESSES * (2 * MIX_BYTES + 4) : 0) +
+	    128;
+}
+
+
+/* ----- Computation ------------------------------------------------------- */
+
+
+static void compute(const struct farm *f, const uint8_t *cache,
+    uint64_t nonce, struct vector *v)
+{
+	uint8_t line[DAG_LINE_BYTES];
+	uint8_t s[HASH_BYTES];
+	uint8_t mix[MIX_BYTES];
+	uint32_t dag_line;
+	unsigned i;
+
+	mix_setup(mix, s, f->header_hash, nonce);
+	for (i = 0; i != ACCESSES; i++) {
+		dag_line = mix_dag_line(i, mix, s, f->full_lines);
+		v->line[i] = dag_line;
+		if (f->dag) {
+			mix_do_mix(mix,
+			    f->dag + (size_t) dag_line * DAG_LINE_BYTES);
+		} else {
+			calc_dataset_range(line, dag_line, 1, cache,
+			    f->cache_bytes);
+			mix_do_mix(mix, line);
+		}
+		if (mixes)
+			memcpy(v->mix[i], mix, MIX_BYTES);
+	}
+	mix_finish(v->cmix, v->result, mix, s);
+	v->nonce = nonce;
+}
+
+
+/*
+ * Threads compute whole chunks into their own buffer, then wait for their
+ * turn to write, so the output is in nonce order no matter how many threads
+ * we use.
+ */
+
+static void *farm_thread(void *arg)
+{
+	struct farm *f = arg;
+	struct vector *v = alloc_type(struct vector);
+	char *buf = alloc_size(max_record() * CHUNK);
+	uint8_t *cache = NULL;
+	uint64_t chunk, i, n;
+	char *p;
+
+	if (!f->dag) {
+		cache = alloc_size(f->cache_bytes);
+		memcpy(cache, f->cache, f->cache_bytes);
+	}
+	while (1) {
+		chunk = __atomic_fetch_add(&f->next_chunk, 1,
+		    __ATOMIC_RELAXED);
+		if (chunk * CHUNK >= f->count)
+			break;
+		n = f->count - chunk * CHUNK;
+		if (n > CHUNK)
+			n = CHUNK;
+		p = buf;
+		for (i = 0; i != n; i++) {
+			compute(f, cache, f->first + chunk * CHUNK + i, v);
+			p = json ? encode_json(p, f->header_hash, v) :
+			    encode_binary(p, f->header_hash, v);
+		}
+
+		pthread_mutex_lock(&f->mutex);
+		while (f->write_chunk != chunk)
+			pthread_cond_wait(&f->cond, &f->mutex);
+		pthread_mutex_unlock(&f->mutex);
+		if (fwrite(buf, 1, p - buf, f->file) != (size_t) (p - buf)) {
+			perror("fwrite");
+			exit(1);
+		}
+		pthread_mutex_lock(&f->mutex);
+		f->write_chunk++;
+		pthread_cond_broadcast(&f->cond);
+		pthread_mutex_unlock(&f->mutex);
+	}
+	free(cache);
+	free(buf);
+	free(v);
+	return NULL;
+}
+
+
+static void farm(struct farm *f, unsigned threads)
+{
+	pthread_t *t = alloc_size(sizeof(pthread_t) * threads);
+	unsigned i;
+	int err;
+
+	f->next_chunk = f->write_chunk = 0;
+	pthread_mutex_init(&f->mutex, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	for (i = 0; i != threads; i++) {
+		err = pthread_create(t + i, NULL, farm_thread, f);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i != threads; i++)
+		pthread_join(t[i], NULL);
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->mutex);
+	free(t);
+}
+
+
+static void write_header(FILE *file, enum mode mode, unsigned epoch,
+    unsigned full_lines)
+{
+	uint8_t hdr[HDR_BYTES];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, MAGIC, 8);
+	write32(hdr + 8, VERSION);
+	write32(hdr + 12, mixes ? FLAG_MIXES : 0);
+	write32(hdr + 16, mode != mode_synth);
+	write32(hdr + 20, mode == mode_synth ? 0 : epoch);
+	write32(hdr + 24, full_lines);
+	write32(hdr + 28, record_bytes());
+	if (fwrite(hdr, 1, HDR_BYTES, file) != HDR_BYTES) {
+		perror("fwrite");
+		exit(1);
+	}
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-D dag_file | -F] [-f dag_lines] [-j] [-m] [-q] [-t threads]\n"
+"       %*s{-b block | -e epoch | dag_lines} header_hash nonce count\n"
+"       %*sout_file\n\n"
+"  -b block\n"
+"      use real Ethash parameters, for given block.\n"
+"  -D dag_file\n"
+"      read DAG lines from this (full) DAG, shared by all threads\n"
+"  -e epoch\n"
+"      use real Ethash parameters, for any block in given epoch.\n"
+"  -f dag_lines\n"
+"      override the DAG size of -b or -e\n"
+"  -F  generate the full DAG in memory first, and share it\n"
+"      (default: each thread uses its own copy of the light cache)\n"
+"  -j  write JSONL instead of binary records\n"
+"  -m  include the mix after each round (8 kB per binary record)\n"
+"  -q  quiet operation\n"
+"  -t threads\n"
+"      number of threads (default: one per CPU)\n\n"
+"dag_lines selects synthetic mode (as in mixone). out_file can be - for\n"
+"stdout.\n"
+	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	enum mode mode = mode_synth;
+	struct farm f;
+	const char *dag_file = NULL;
+	bool full = 0, quiet = 0;
+	unsigned threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint8_t header_hash[HEADER_HASH_BYTES];
+	uint8_t seed[SEED_BYTES];
+	struct mdag *m = NULL;
+	uint8_t *cache, *dag = NULL;
+	unsigned n, epoch = 0, full_lines = 0;
+	double t;
+	char *end;
+	int c, err;
+
+	while ((c = getopt(argc, argv, "b:D:e:f:Fjmqt:")) != EOF)
+		switch (c) {
+		case 'b':
+			mode = mode_block;
+			n = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'D':
+			dag_file = optarg;
+			break;
+		case 'e':
+			mode = mode_epoch;
+			n = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end || !full_lines)
+				usage(*argv);
+			break;
+		case 'F':
+			full = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'm':
+			mixes = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 't':
+			threads = strtoul(optarg, &end, 0);
+			if (*end || !threads)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+	if (dag_file && full)
+		usage(*argv);
+
+	switch (argc - optind) {
+	case 5:
+		if (mode != mode_synth)
+			usage(*argv);
+		n = strtoul(argv[optind], &end, 0);
+		if (*end || !n)
+			usage(*argv);
+		optind++;
+		break;
+	case 4:
+		if (mode == mode_synth)
+			usage(*argv);
+		break;
+	default:
+		usage(*argv);
+	}
+	if (!threads)
+		threads = 1;
+
+	hex_decode_big_endian(header_hash, argv[optind], HEADER_HASH_BYTES);
+	f.header_hash = header_hash;
+	f.first = strtoull(argv[optind + 1], &end, 16);
+	if (*end)
+		usage(*argv);
+	f.count = strtoull(argv[optind + 2], &end, 0);
+	if (*end)
+		usage(*argv);
+	if (!strcmp(argv[optind + 3], "-")) {
+		f.file = stdout;
+	} else {
+		f.file = fopen(argv[optind + 3], "w");
+		if (!f.file) {
+			perror(argv[optind + 3]);
+			exit(1);
+		}
+	}
+
+	switch (mode) {
+	case mode_synth:
+		/* this is the setup used by cgen, not real Ethash */
+		memset(seed, 0, sizeof(seed));
+		f.cache_bytes = CACHE_LINE_BYTES;
+		f.full_lines = n;
+		break;
+	case mode_block:
+		n = get_epoch(n);
+		/* fall through */
+	case mode_epoch:
+		epoch = n;
+		f.cache_bytes = get_cache_size(epoch);
+		f.full_lines = full_lines ? full_lines :
+		    get_full_lines(epoch);
+		get_seedhash(seed, epoch);
+		break;
+	default:
+		abort();
+	}
+	cache = alloc_size(f.cache_bytes);
+	mkcache(cache, f.cache_bytes, seed);
+	f.cache = cache;
+	f.dag = NULL;
+
+	if (dag_file) {
+		err = mdag_map(&m, dag_file, MDAG_POPULATE | MDAG_RANDOM);
+		if (err < 0) {
+			fprintf(stderr, "%s: %s\n", dag_file, strerror(-err));
+			exit(1);
+		}
+		if (mdag_lines(m) != f.full_lines) {
+			fprintf(stderr, "%s: %u lines instead of %u\n",
+			    dag_file, mdag_lines(m), f.full_lines);
+			exit(1);
+		}
+		f.dag = mdag_addr(m);
+	}
+	if (full) {
+		struct dagthrottle_cfg cfg = {
+			.threads	= threads,
+		};
+
+		dag = alloc_size((size_t) f.full_lines * DAG_LINE_BYTES);
+		dagthrottle_range(dag, 0, f.full_lines, cache, f.cache_bytes,
+		    &cfg, NULL);
+		f.dag = dag;
+	}
+
+	if (!json)
+		write_header(f.file, mode, epoch, f.full_lines);
+	t = now();
+	farm(&f, threads);
+	t = now() - t;
+	if (fclose(f.file) == EOF) {
+		perror(argv[optind + 3]);
+		exit(1);
+	}
+	if (!quiet)
+		fprintf(stderr,
+		    "%llu vectors in %.3f s (%.0f/s), %u thread%s\n",
+		    (unsigned long long) f.count, t, f.count / t, threads,
+		    threads == 1 ? "" : "s");
+
+	if (m)
+		mdag_unmap(m);
+	free(dag);
+	free(cache);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * verifydag.c - Verify (and repair) a DAG in dagio files
+ *
+ * Copyright (C) 2023 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ *
+ *
+ * Example (quick check of 10000 random lines, then full check and repair):
+ * ./verifydag -n 10000 100 /tmp/dag
+ * ./verifydag -r 100 /tmp/dag
+ *
+ * A DAG image in the ASIC's word layout:
+ * ./verifydag -A 100 /tmp/dag.asic
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "linzhi/alloc.h"
+
+#include "dag.h"
+#include "dagalgo.h"
+#include "dagio.h"
+#include "dagverify.h"
+
+
+static bool quiet = 0;
+static uint32_t stripe_lines = 0;
+static enum dagio_backend backend = dbe_file;
+
+
+/* ----- Verify ------------------------------------------------------------ */
+
+
+static void bad_range(void *user, uint32_t dag_line, uint32_t lines)
+{
+	printf("bad %u-%u (%u line%s)\n", dag_line, dag_line + lines - 1,
+	    lines, lines == 1 ? "" : "s");
+}
+
+
+static bool verify(char *const *paths, unsigned files, unsigned epoch,
+    unsigned full_lines, const struct dagverify_cfg *cfg)
+{
+	const char *path = paths[0];
+	mode_t mode = cfg->repair ? O_RDWR : O_RDONLY;
+	struct dag_handle *h;
+	struct dagverify_result res;
+	uint8_t seed[SEED_BYTES];
+	unsigned cache_bytes = get_cache_size(epoch);
+	uint8_t *cache;
+
+	if (!full_lines)
+		full_lines = get_full_lines(epoch);
+
+	get_seedhash(seed, epoch);
+	cache = alloc_size(cache_bytes);
+	mkcache(cache, cache_bytes, seed);
+
+	h = dagio_open_backend(backend, (const char *const *) paths, files,
+	    mode, full_lines, stripe_lines);
+	if (dagio_bytes(h) != (uint64_t) full_lines * DAG_LINE_BYTES) {
+		fprintf(stderr, "%s: %llu bytes instead of %llu\n", path,
+		    (unsigned long long) dagio_bytes(h),
+		    (unsigned long long) full_lines * DAG_LINE_BYTES);
+		exit(1);
+	}
+	dagverify(h, cache, cache_bytes, cfg, quiet ? NULL : bad_range, NULL,
+	    &res);
+	dagio_close(h);
+	free(cache);
+
+	if (!quiet)
+		printf("%s epoch %u: %llu lines checked, %llu bad in %u "
+		    "range%s, %llu repaired\n",
+		    dagalgo_name(dag_algo), epoch,
+		    (unsigned long long) res.checked,
+		    (unsigned long long) res.bad,
+		    res.ranges, res.ranges == 1 ? "" : "s",
+		    (unsigned long long) res.repaired);
+	return res.bad == res.repaired;
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-A] [-a algo] [-B backend] [-b stripe_kB] [-f dag_lines] [-i]\n"
+"       %*s[-n samples [-s seed]] [-q] [-r] [-t threads]\n"
+"       %*sepoch dag-file ...\n\n"
+"  -A  the DAG is in the ASIC's word layout (e.g., read back from a board)\n"
+"  -a algo\n"
+"      DAG algorithm (ethash, etchash, ubqhash; default: ethash)\n"
+"  -B backend\n"
+"      storage backend (file, mmap, mem, uring; default: file)\n"
+"  -b stripe_kB\n"
+"      the DAG is striped over the dag-files, in stripes of this size\n"
+"  -f dag_lines\n"
+"      override the DAG size\n"
+"  -i  run at idle priority (SCHED_IDLE)\n"
+"  -n samples\n"
+"      only check this many randomly chosen lines\n"
+"  -q  quiet operation\n"
+"  -r  repair bad lines\n"
+"  -s seed\n"
+"      seed for choosing lines (default: based on the time)\n"
+"  -t threads\n"
+"      number of threads (default: one per CPU)\n"
+	    , name, (int) strlen(name) + 1, "", (int) strlen(name) + 1, "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct dagverify_cfg cfg = {
+		.threads	= 0,
+		.samples	= 0,
+		.seed		= time(NULL),
+		.repair		= 0,
+		.idle		= 0,
+		.asic		= 0,
+	};
+	unsigned full_lines = 0;
+	unsigned epoch;
+	char *end;
+	int c, algo;
+
+	while ((c = getopt(argc, argv, "Aa:B:b:f:in:qrs:t:")) != EOF)
+		switch (c) {
+		case 'A':
+			cfg.asic = 1;
+			break;
+		case 'a':
+			algo = dagalgo_code(optarg);
+			if (algo < 0)
+				usage(*argv);
+			dag_algo = algo;
+			break;
+		case 'B':
+			algo = dagio_backend_code(optarg);
+			if (algo < 0)
+				usage(*argv);
+			backend = algo;
+			break;
+		case 'b':
+			stripe_lines = (strtoul(optarg, &end, 0) << 10) /
+			    DAG_LINE_BYTES;
+			if (*end || !stripe_lines)
+				usage(*argv);
+			break;
+		case 'f':
+			full_lines = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'i':
+			cfg.idle = 1;
+			break;
+		case 'n':
+			cfg.samples = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'r':
+			cfg.repair = 1;
+			break;
+		case 's':
+			cfg.seed = strtoull(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		case 't':
+			cfg.threads = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc - optind < 2)
+		usage(*argv);
+	if (!stripe_lines && argc - optind != 2)
+		usage(*argv);
+	epoch = strtoul(argv[optind], &end, 0);
+	if (*end)
+		usage(*argv);
+
+	return !verify(argv + optind + 1, argc - optind - 1, epoch, full_lines,
+	    &cfg);
+}